@@ -0,0 +1,295 @@
+#include "aead.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// ChaCha20 works on CHACHA_LANES blocks at once: every state word is a vector holding that word of
+// each block, so the rounds compile to SSE2 (or NEON) instructions without any intrinsics.
+#define CHACHA_LANES 4
+
+typedef uint32_t u32xN __attribute__((vector_size(4 * CHACHA_LANES)));
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d)                                                                 \
+    a += b, d ^= a, d = ROTL(d, 16);                                                               \
+    c += d, b ^= c, b = ROTL(b, 12);                                                               \
+    a += b, d ^= a, d = ROTL(d, 8);                                                                \
+    c += d, b ^= c, b = ROTL(b, 7)
+
+// Reads a little-endian 32-bit word.
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// Writes a little-endian 32-bit word.
+static void store32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+}
+
+// Writes a little-endian 64-bit word.
+static void store64(uint8_t *p, uint64_t v) {
+    store32(p, (uint32_t) v);
+    store32(p + 4, (uint32_t) (v >> 32));
+}
+
+// Computes CHACHA_LANES consecutive ChaCha20 keystream blocks starting at block counter.
+// IN: key, nonce, counter (first block number), ks (keystream buffer of 64 * CHACHA_LANES bytes)
+// OUT: ks (keystream)
+static void chacha20_blocks(const uint8_t key[AEAD_KEY_BYTES],
+    const uint8_t nonce[AEAD_NONCE_BYTES], uint32_t counter, uint8_t *ks) {
+    uint32_t in[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+    for (int i = 0; i < 8; i++) {
+        in[4 + i] = load32(key + 4 * i);
+    }
+    for (int i = 0; i < 3; i++) {
+        in[13 + i] = load32(nonce + 4 * i);
+    }
+
+    u32xN s[16], x[16];
+    for (int i = 0; i < 16; i++) {
+        for (int l = 0; l < CHACHA_LANES; l++) {
+            s[i][l] = in[i];
+        }
+    }
+    for (int l = 0; l < CHACHA_LANES; l++) {
+        s[12][l] = counter + (uint32_t) l;
+    }
+    memcpy(x, s, sizeof(x));
+
+    for (int round = 0; round < 10; round++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        x[i] += s[i];
+        for (int l = 0; l < CHACHA_LANES; l++) {
+            store32(ks + 64 * l + 4 * i, x[i][l]);
+        }
+    }
+}
+
+// XORs len bytes of in with the ChaCha20 keystream starting at block counter, writing to out.
+// Encryption and decryption are the same operation; in and out may be the same buffer.
+// IN: key, nonce, counter (first block number), in (input), out (output), len (bytes)
+// OUT: out (transformed bytes)
+void chacha20_xor(const uint8_t key[AEAD_KEY_BYTES], const uint8_t nonce[AEAD_NONCE_BYTES],
+    uint32_t counter, const uint8_t *in, uint8_t *out, size_t len) {
+    uint8_t ks[64 * CHACHA_LANES];
+    while (len > 0) {
+        chacha20_blocks(key, nonce, counter, ks);
+        size_t n = len < sizeof(ks) ? len : sizeof(ks);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] ^ ks[i];
+        }
+        in += n;
+        out += n;
+        len -= n;
+        counter += CHACHA_LANES;
+    }
+}
+
+// Poly1305 state in radix 2^26: the clamped key r, the accumulator h and the final pad s.
+typedef struct {
+    uint32_t r[5], h[5], pad[4];
+} Poly1305;
+
+// Sets up a Poly1305 state with a one-time key.
+// IN: p (state), key (32-byte one-time key)
+// OUT: p (initialized state)
+static void poly1305_init(Poly1305 *p, const uint8_t key[32]) {
+    p->r[0] = load32(key + 0) & 0x3ffffff;
+    p->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+    p->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+    p->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+    p->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+    memset(p->h, 0, sizeof(p->h));
+    for (int i = 0; i < 4; i++) {
+        p->pad[i] = load32(key + 16 + 4 * i);
+    }
+}
+
+// Absorbs len bytes into the accumulator, zero padding the last block to 16 bytes as RFC 8439 does
+// for the additional data and the ciphertext.
+// IN: p (state), m (message), len (bytes)
+// OUT: p (updated state)
+static void poly1305_update(Poly1305 *p, const uint8_t *m, size_t len) {
+    const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    uint8_t last[16];
+
+    while (len > 0) {
+        const uint8_t *b = m;
+        size_t n = 16;
+        if (len < 16) {
+            memset(last, 0, sizeof(last));
+            memcpy(last, m, len);
+            b = last;
+            n = len;
+        }
+        h0 += load32(b + 0) & 0x3ffffff;
+        h1 += (load32(b + 3) >> 2) & 0x3ffffff;
+        h2 += (load32(b + 6) >> 4) & 0x3ffffff;
+        h3 += (load32(b + 9) >> 6) & 0x3ffffff;
+        h4 += (load32(b + 12) >> 8) | (1 << 24);
+
+        uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3
+                      + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+        uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4
+                      + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+        uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0
+                      + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+        uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1
+                      + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+        uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2
+                      + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+        uint32_t c = (uint32_t) (d0 >> 26);
+        h0 = (uint32_t) d0 & 0x3ffffff;
+        d1 += c;
+        c = (uint32_t) (d1 >> 26);
+        h1 = (uint32_t) d1 & 0x3ffffff;
+        d2 += c;
+        c = (uint32_t) (d2 >> 26);
+        h2 = (uint32_t) d2 & 0x3ffffff;
+        d3 += c;
+        c = (uint32_t) (d3 >> 26);
+        h3 = (uint32_t) d3 & 0x3ffffff;
+        d4 += c;
+        c = (uint32_t) (d4 >> 26);
+        h4 = (uint32_t) d4 & 0x3ffffff;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += n;
+        len -= n;
+    }
+
+    p->h[0] = h0;
+    p->h[1] = h1;
+    p->h[2] = h2;
+    p->h[3] = h3;
+    p->h[4] = h4;
+}
+
+// Fully reduces the accumulator mod 2^130 - 5, adds the pad and writes the tag.
+// IN: p (state), tag (output)
+// OUT: tag (16-byte authenticator)
+static void poly1305_finish(Poly1305 *p, uint8_t tag[AEAD_TAG_BYTES]) {
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    uint32_t c = h1 >> 26;
+    h1 &= 0x3ffffff;
+    h2 += c;
+    c = h2 >> 26;
+    h2 &= 0x3ffffff;
+    h3 += c;
+    c = h3 >> 26;
+    h3 &= 0x3ffffff;
+    h4 += c;
+    c = h4 >> 26;
+    h4 &= 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= 0x3ffffff;
+    h1 += c;
+
+    // g = h + 5 - 2^130; use it instead of h when it did not go negative
+    uint32_t g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1 << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    uint32_t w0 = h0 | (h1 << 26);
+    uint32_t w1 = (h1 >> 6) | (h2 << 20);
+    uint32_t w2 = (h2 >> 12) | (h3 << 14);
+    uint32_t w3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f = (uint64_t) w0 + p->pad[0];
+    store32(tag + 0, (uint32_t) f);
+    f = (uint64_t) w1 + p->pad[1] + (f >> 32);
+    store32(tag + 4, (uint32_t) f);
+    f = (uint64_t) w2 + p->pad[2] + (f >> 32);
+    store32(tag + 8, (uint32_t) f);
+    f = (uint64_t) w3 + p->pad[3] + (f >> 32);
+    store32(tag + 12, (uint32_t) f);
+}
+
+// Computes the RFC 8439 tag over the additional data and the ciphertext, keyed from block 0 of the keystream.
+// IN: key, nonce, aad (additional data), aad_len, ct (ciphertext), len (bytes), tag (output)
+// OUT: tag (16-byte authenticator)
+static void aead_tag(const uint8_t key[AEAD_KEY_BYTES], const uint8_t nonce[AEAD_NONCE_BYTES],
+    const uint8_t *aad, size_t aad_len, const uint8_t *ct, size_t len, uint8_t tag[AEAD_TAG_BYTES]) {
+    uint8_t block0[64 * CHACHA_LANES];
+    chacha20_blocks(key, nonce, 0, block0);
+
+    Poly1305 p;
+    poly1305_init(&p, block0);
+    poly1305_update(&p, aad, aad_len);
+    poly1305_update(&p, ct, len);
+    uint8_t lengths[16];
+    store64(lengths, aad_len);
+    store64(lengths + 8, len);
+    poly1305_update(&p, lengths, sizeof(lengths));
+    poly1305_finish(&p, tag);
+}
+
+// Encrypts len bytes of in to out and authenticates them together with aad.
+// A (key, nonce) pair must never be used for two different messages.
+// IN: key, nonce, aad (additional data), aad_len, in (plaintext), out (ciphertext), len (bytes), tag (output)
+// OUT: out (ciphertext), tag (16-byte authenticator)
+void aead_seal(const uint8_t key[AEAD_KEY_BYTES], const uint8_t nonce[AEAD_NONCE_BYTES],
+    const uint8_t *aad, size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+    uint8_t tag[AEAD_TAG_BYTES]) {
+    chacha20_xor(key, nonce, 1, in, out, len);
+    aead_tag(key, nonce, aad, aad_len, out, len, tag);
+}
+
+// Checks the tag over aad and the ciphertext in, and only then decrypts in to out.
+// IN: key, nonce, aad (additional data), aad_len, in (ciphertext), out (plaintext), len (bytes), tag (received tag)
+// OUT: out (plaintext), bool (false if the tag does not match, in which case out is untouched)
+bool aead_open(const uint8_t key[AEAD_KEY_BYTES], const uint8_t nonce[AEAD_NONCE_BYTES],
+    const uint8_t *aad, size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+    const uint8_t tag[AEAD_TAG_BYTES]) {
+    uint8_t expected[AEAD_TAG_BYTES];
+    aead_tag(key, nonce, aad, aad_len, in, len, expected);
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG_BYTES; i++) {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        return false;
+    }
+    chacha20_xor(key, nonce, 1, in, out, len);
+    return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ChaCha20-Poly1305 authenticated encryption as specified in RFC 8439.
+#define AEAD_KEY_BYTES   32
+#define AEAD_NONCE_BYTES 12
+#define AEAD_TAG_BYTES   16
+
+void chacha20_xor(const uint8_t key[AEAD_KEY_BYTES], const uint8_t nonce[AEAD_NONCE_BYTES],
+    uint32_t counter, const uint8_t *in, uint8_t *out, size_t len);
+
+void aead_seal(const uint8_t key[AEAD_KEY_BYTES], const uint8_t nonce[AEAD_NONCE_BYTES],
+    const uint8_t *aad, size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+    uint8_t tag[AEAD_TAG_BYTES]);
+
+bool aead_open(const uint8_t key[AEAD_KEY_BYTES], const uint8_t nonce[AEAD_NONCE_BYTES],
+    const uint8_t *aad, size_t aad_len, const uint8_t *in, uint8_t *out, size_t len,
+    const uint8_t tag[AEAD_TAG_BYTES]);
@@ -0,0 +1,437 @@
+#include "numtheory.h"
+#include "randstate.h"
+#include "rsa.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "b:n:i:m:t:s:f:o:h"
+
+// One benchmark measurement: an operation at a key size, run by our code or by a GMP baseline.
+typedef struct {
+    const char *op;
+    const char *impl;
+    uint64_t bits;
+    uint64_t ops;
+    double seconds; // total time over all ops
+    double p50, p90, p99; // latency percentiles in microseconds
+    double mb_per_s; // throughput for file operations, 0 otherwise
+} Result;
+
+// Everything a benchmark needs at one key size.
+typedef struct {
+    uint64_t bits;
+    uint64_t reps; // repetitions for the cheap operations
+    uint64_t iters; // Miller-Rabin iterations
+    uint32_t threads;
+    size_t file_bytes; // input size for the file benchmarks
+    mpz_t p, q, n, e, d; // a key of 'bits' bits
+    rsa_crt crt;
+    mont_ctx mont; // Montgomery context for n on the fixed-width backend
+    uint32_t primes; // primes in the moduli made by op_keygen
+    rsa_key_ctx ctx; // private key context for op_decrypt
+} Bench;
+
+static bool json = false;
+static bool first_record = true;
+static FILE *out;
+
+// Returns a monotonic timestamp in seconds.
+// IN: N/A
+// OUT: double (seconds)
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// qsort comparator for latencies.
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Fills in the totals and percentiles of r from per-op latencies in seconds.
+// IN: r (result), lat (latencies, sorted in place), ops (number of latencies)
+// OUT: r (summarized result)
+static void summarize(Result *r, double *lat, uint64_t ops) {
+    qsort(lat, ops, sizeof(double), cmp_double);
+    r->ops = ops;
+    r->seconds = 0;
+    for (uint64_t i = 0; i < ops; i++) {
+        r->seconds += lat[i];
+    }
+    r->p50 = lat[(ops - 1) * 50 / 100] * 1e6;
+    r->p90 = lat[(ops - 1) * 90 / 100] * 1e6;
+    r->p99 = lat[(ops - 1) * 99 / 100] * 1e6;
+}
+
+// Writes one result as a CSV line or a JSON object.
+// IN: r (result)
+// OUT: out (updated output)
+static void emit(Result *r) {
+    double ops_per_s = r->seconds > 0 ? r->ops / r->seconds : 0;
+    if (json) {
+        fprintf(out,
+            "%s\n  {\"op\": \"%s\", \"impl\": \"%s\", \"bits\": %lu, \"ops\": %lu, \"ops_per_s\": %.3f, "
+            "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"mb_per_s\": %.3f}",
+            first_record ? "" : ",", r->op, r->impl, (unsigned long) r->bits, (unsigned long) r->ops,
+            ops_per_s, r->p50, r->p90, r->p99, r->mb_per_s);
+    } else {
+        fprintf(out, "%s,%s,%lu,%lu,%.3f,%.3f,%.3f,%.3f,%.3f\n", r->op, r->impl,
+            (unsigned long) r->bits, (unsigned long) r->ops, ops_per_s, r->p50, r->p90, r->p99,
+            r->mb_per_s);
+    }
+    first_record = false;
+    fflush(out);
+}
+
+// Operation under test: one call on the bench's key material, x is a random input below n.
+typedef void (*bench_fn)(Bench *b, mpz_t out, mpz_t x);
+
+static void op_pow_mod(Bench *b, mpz_t out, mpz_t x) {
+    pow_mod(out, x, b->d, b->n);
+}
+
+static void op_pow_mod_fixed(Bench *b, mpz_t out, mpz_t x) {
+    mont_pow(&b->mont, out, x, b->d);
+}
+
+static void op_mpz_powm(Bench *b, mpz_t out, mpz_t x) {
+    mpz_powm(out, x, b->d, b->n);
+}
+
+static void op_pow_mod_basic(Bench *b, mpz_t out, mpz_t x) {
+    pow_mod_basic(out, x, b->d, b->n);
+}
+
+static void op_is_prime(Bench *b, mpz_t out, mpz_t x) {
+    (void) out;
+    (void) x;
+    is_prime(b->p, b->iters);
+}
+
+static void op_is_prime_bpsw(Bench *b, mpz_t out, mpz_t x) {
+    (void) out;
+    (void) x;
+    prime_test_bpsw(true);
+    is_prime(b->p, 0);
+    prime_test_bpsw(false);
+}
+
+static void op_mpz_probab_prime_p(Bench *b, mpz_t out, mpz_t x) {
+    (void) out;
+    (void) x;
+    mpz_probab_prime_p(b->p, (int) b->iters);
+}
+
+static void op_gcd(Bench *b, mpz_t out, mpz_t x) {
+    gcd(out, x, b->n);
+}
+
+static void op_mpz_gcd(Bench *b, mpz_t out, mpz_t x) {
+    mpz_gcd(out, x, b->n);
+}
+
+static void op_mod_inverse(Bench *b, mpz_t out, mpz_t x) {
+    mod_inverse(out, x, b->n);
+}
+
+static void op_mpz_invert(Bench *b, mpz_t out, mpz_t x) {
+    mpz_invert(out, x, b->n);
+}
+
+static void op_make_prime(Bench *b, mpz_t out, mpz_t x) {
+    (void) x;
+    make_prime(out, b->bits / 2, b->iters);
+}
+
+static void op_make_prime_bpsw(Bench *b, mpz_t out, mpz_t x) {
+    prime_test_bpsw(true);
+    make_prime(out, b->bits / 2, 0);
+    prime_test_bpsw(false);
+    (void) x;
+}
+
+static void op_keygen(Bench *b, mpz_t out, mpz_t x) {
+    mpz_t primes[RSA_MAX_PRIMES], n, e;
+    mpz_inits(n, e, NULL);
+    for (uint32_t i = 0; i < b->primes; i++) {
+        mpz_init(primes[i]);
+    }
+    mpz_set_ui(e, RSA_DEFAULT_EXP);
+    rsa_make_pub_primes(primes, b->primes, n, e, b->bits, b->iters, b->threads);
+    rsa_make_priv_primes(out, e, primes, b->primes);
+    (void) x;
+    for (uint32_t i = 0; i < b->primes; i++) {
+        mpz_clear(primes[i]);
+    }
+    mpz_clears(n, e, NULL);
+}
+
+static void op_decrypt(Bench *b, mpz_t out, mpz_t x) {
+    rsa_decrypt_ctx(&b->ctx, out, x);
+}
+
+// Times reps calls of fn on random inputs below n and emits the result.
+// IN: b (bench), op impl (names), fn (operation), reps (number of calls)
+// OUT: out (result record)
+static void run_op(Bench *b, const char *op, const char *impl, bench_fn fn, uint64_t reps) {
+    if (reps == 0) {
+        reps = 1;
+    }
+    double *lat = (double *) calloc(reps, sizeof(double));
+    mpz_t x, r;
+    mpz_inits(x, r, NULL);
+    for (uint64_t i = 0; i < reps; i++) {
+        mpz_urandomm(x, state, b->n);
+        double start = now();
+        fn(b, r, x);
+        lat[i] = now() - start;
+    }
+    Result res = { op, impl, b->bits, 0, 0, 0, 0, 0, 0 };
+    summarize(&res, lat, reps);
+    emit(&res);
+    mpz_clears(x, r, NULL);
+    free(lat);
+}
+
+// Times keygen and CRT decryption of single blocks with two primes in the modulus ("rsa") and with each larger
+// number of primes up to RSA_MAX_PRIMES ("3prime", "4prime") and emits the results.
+// IN: b (bench)
+// OUT: out (result records)
+static void run_primes(Bench *b) {
+    const char *impls[RSA_MAX_PRIMES - 1] = { "rsa", "3prime", "4prime" };
+    for (uint32_t k = 2; k <= RSA_MAX_PRIMES; k++) {
+        b->primes = k;
+        run_op(b, "keygen", impls[k - 2], op_keygen, b->reps / 10);
+
+        mpz_t primes[RSA_MAX_PRIMES], n, e, d;
+        mpz_inits(n, e, d, NULL);
+        for (uint32_t i = 0; i < k; i++) {
+            mpz_init(primes[i]);
+        }
+        rsa_crt crt;
+        rsa_crt_init(&crt);
+        mpz_set_ui(e, RSA_DEFAULT_EXP);
+        rsa_make_pub_primes(primes, k, n, e, b->bits, b->iters, b->threads);
+        rsa_make_priv_primes(d, e, primes, k);
+        rsa_make_crt_primes(&crt, d, primes, k);
+        rsa_key_ctx_init(&b->ctx, n, d, &crt);
+        run_op(b, "decrypt", impls[k - 2], op_decrypt, b->reps);
+
+        rsa_key_ctx_clear(&b->ctx);
+        rsa_crt_clear(&crt);
+        for (uint32_t i = 0; i < k; i++) {
+            mpz_clear(primes[i]);
+        }
+        mpz_clears(n, e, d, NULL);
+    }
+}
+
+// Times rsa_encrypt_file and rsa_decrypt_file over file_bytes of random input and emits their throughput,
+// once in the binary RSA block format and once in hybrid mode.
+// IN: b (bench)
+// OUT: out (result records)
+static void run_files(Bench *b) {
+    FILE *plain = tmpfile();
+    if (plain == NULL) {
+        fprintf(stderr, "Unable to create temporary files.\n");
+        return;
+    }
+    uint8_t *data = (uint8_t *) malloc(b->file_bytes);
+    for (size_t i = 0; i < b->file_bytes; i++) {
+        data[i] = (uint8_t) gmp_urandomb_ui(state, 8);
+    }
+    fwrite(data, 1, b->file_bytes, plain);
+    free(data);
+    double mb = b->file_bytes / 1e6;
+
+    // "scalar" is the RSA block mode again with the multi-buffer kernel turned off
+    const char *impls[] = { "rsa", "scalar", "hybrid" };
+    for (int mode = 0; mode < 3; mode++) {
+        const char *impl = impls[mode];
+        bool hybrid = mode == 2;
+        mb_enable(mode != 1);
+        rsa_file_opts opts = { .threads = b->threads, .binary = true, .hybrid = hybrid };
+        FILE *cipher = tmpfile(), *back = tmpfile();
+        if (cipher == NULL || back == NULL) {
+            fprintf(stderr, "Unable to create temporary files.\n");
+            break;
+        }
+
+        rewind(plain);
+        double start = now();
+        rsa_encrypt_file(plain, cipher, b->n, b->e, &opts);
+        fflush(cipher);
+        double t = now() - start;
+        Result enc = { "encrypt_file", impl, b->bits, 1, t, t * 1e6, t * 1e6, t * 1e6, mb / t };
+        emit(&enc);
+
+        rewind(cipher);
+        start = now();
+        rsa_decrypt_file(cipher, back, b->n, b->d, &b->crt, &opts);
+        fflush(back);
+        t = now() - start;
+        Result dec = { "decrypt_file", impl, b->bits, 1, t, t * 1e6, t * 1e6, t * 1e6, mb / t };
+        emit(&dec);
+
+        fclose(cipher);
+        fclose(back);
+    }
+    mb_enable(true);
+    fclose(plain);
+}
+
+// Times rsa_sign_batch and rsa_verify_batch over count random messages and emits their rate.
+// Percentiles are not measured per item, so the mean time per item is reported for all three.
+// IN: b (bench), count (number of messages)
+// OUT: out (result records)
+static void run_batch(Bench *b, uint64_t count) {
+    mpz_t *m = (mpz_t *) calloc(count, sizeof(mpz_t));
+    mpz_t *s = (mpz_t *) calloc(count, sizeof(mpz_t));
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_inits(m[i], s[i], NULL);
+        mpz_urandomm(m[i], state, b->n);
+    }
+    uint8_t *ok = (uint8_t *) calloc((count + 7) / 8, sizeof(uint8_t));
+    rsa_key_ctx priv, pub;
+    rsa_key_ctx_init(&priv, b->n, b->d, &b->crt);
+    rsa_key_ctx_init(&pub, b->n, b->e, NULL);
+
+    double start = now();
+    rsa_sign_batch(&priv, s, m, count, b->threads);
+    double t = now() - start, per = t / count * 1e6;
+    Result sign = { "sign_batch", "rsa", b->bits, count, t, per, per, per, 0 };
+    emit(&sign);
+
+    start = now();
+    uint64_t valid = rsa_verify_batch(&pub, m, s, count, b->threads, ok);
+    t = now() - start;
+    per = t / count * 1e6;
+    Result verify = { "verify_batch", "rsa", b->bits, count, t, per, per, per, 0 };
+    emit(&verify);
+    if (valid != count) {
+        fprintf(stderr, "verify_batch: %lu of %lu signatures failed.\n", (unsigned long) (count - valid),
+            (unsigned long) count);
+    }
+
+    rsa_key_ctx_clear(&priv);
+    rsa_key_ctx_clear(&pub);
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_clears(m[i], s[i], NULL);
+    }
+    free(m);
+    free(s);
+    free(ok);
+}
+
+// Runs every benchmark at one key size.
+// IN: bits (key size), reps (repetitions), iters (Miller-Rabin iterations), threads, file_bytes (file benchmark input size)
+// OUT: out (result records)
+static void run_size(uint64_t bits, uint64_t reps, uint64_t iters, uint32_t threads, size_t file_bytes) {
+    Bench b = { .bits = bits, .reps = reps, .iters = iters, .threads = threads, .file_bytes = file_bytes };
+    mpz_inits(b.p, b.q, b.n, b.e, b.d, NULL);
+    rsa_crt_init(&b.crt);
+    mpz_set_ui(b.e, RSA_DEFAULT_EXP);
+    rsa_make_pub(b.p, b.q, b.n, b.e, bits, iters, threads);
+    rsa_make_priv(b.d, b.e, b.p, b.q);
+    rsa_make_crt(&b.crt, b.d, b.p, b.q);
+    mont_init(&b.mont, b.n);
+    mont_use_fixed(&b.mont);
+
+    run_op(&b, "pow_mod", "rsa", op_pow_mod, reps);
+    run_op(&b, "pow_mod", "fixed", op_pow_mod_fixed, reps);
+    run_op(&b, "pow_mod", "basic", op_pow_mod_basic, reps);
+    run_op(&b, "pow_mod", "gmp", op_mpz_powm, reps);
+    run_op(&b, "is_prime", "rsa", op_is_prime, reps);
+    run_op(&b, "is_prime", "bpsw", op_is_prime_bpsw, reps);
+    run_op(&b, "is_prime", "gmp", op_mpz_probab_prime_p, reps);
+    run_op(&b, "gcd", "rsa", op_gcd, reps * 10);
+    run_op(&b, "gcd", "gmp", op_mpz_gcd, reps * 10);
+    run_op(&b, "mod_inverse", "rsa", op_mod_inverse, reps * 10);
+    run_op(&b, "mod_inverse", "gmp", op_mpz_invert, reps * 10);
+    run_op(&b, "make_prime", "rsa", op_make_prime, reps / 5);
+    run_op(&b, "make_prime", "bpsw", op_make_prime_bpsw, reps / 5);
+    run_primes(&b);
+    run_batch(&b, reps * 10);
+    run_files(&b);
+
+    mont_clear(&b.mont);
+    rsa_crt_clear(&b.crt);
+    mpz_clears(b.p, b.q, b.n, b.e, b.d, NULL);
+}
+
+int main(int argc, char **argv) {
+    uint64_t sizes[] = { 1024, 2048, 3072, 4096 };
+    uint64_t only_bits = 0;
+    uint64_t reps = 20;
+    uint64_t iters = 25;
+    uint32_t threads = 1;
+    size_t file_kib = 64;
+    uint64_t seed = time(NULL);
+    char *outfile_path = NULL;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'b': only_bits = strtoull(optarg, NULL, 10); break;
+        case 'n': reps = strtoull(optarg, NULL, 10); break;
+        case 'i': iters = strtoull(optarg, NULL, 10); break;
+        case 'm': file_kib = strtoull(optarg, NULL, 10); break;
+        case 't': threads = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'f': json = strcmp(optarg, "json") == 0; break;
+        case 'o': outfile_path = optarg; break;
+        case 'h':
+            printf("SYNOPSIS\n");
+            printf("   Benchmarks the number theory and RSA hot paths against GMP built-ins.\n\n");
+            printf("USAGE\n");
+            printf("   ./bench [-h] [-b bits] [-n reps] [-i iters] [-m KiB] [-t threads] [-s seed] "
+                   "[-f csv|json] [-o outfile]\n\n");
+            printf("OPTIONS\n");
+            printf("   -h              Display program help and usage.\n");
+            printf("   -b bits         Only benchmark this key size (default: 1024, 2048, 3072 and 4096).\n");
+            printf("   -n reps         Repetitions of the cheap operations (default: 20).\n");
+            printf("   -i iters        Miller-Rabin iterations (default: 25).\n");
+            printf("   -m KiB          Input size for the file benchmarks (default: 64).\n");
+            printf("   -t threads      Worker threads for keygen, the batch and the file benchmarks (default: 1).\n");
+            printf("   -s seed         Random seed (default: time(NULL)).\n");
+            printf("   -f format       Output format, csv or json (default: csv).\n");
+            printf("   -o outfile      Output file (default: stdout).\n");
+            return 0;
+        }
+    }
+
+    out = outfile_path == NULL ? stdout : fopen(outfile_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Invalid outfile.\n");
+        return 1;
+    }
+    randstate_init(seed);
+
+    if (json) {
+        fprintf(out, "[");
+    } else {
+        fprintf(out, "op,impl,bits,ops,ops_per_s,p50_us,p90_us,p99_us,mb_per_s\n");
+    }
+    if (only_bits != 0) {
+        run_size(only_bits, reps, iters, threads, file_kib * 1024);
+    } else {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            run_size(sizes[i], reps, iters, threads, file_kib * 1024);
+        }
+    }
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    randstate_clear();
+    return 0;
+}
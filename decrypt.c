@@ -1,12 +1,14 @@
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "stats.h"
+#include "threadpool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:r:S:vh"
 
 int main(int argc, char **argv) {
 
@@ -15,32 +17,69 @@ int main(int argc, char **argv) {
     char *infile_path = NULL;
     char *outfile_path = NULL;
     char *private_key_path = "rsa.priv";
+    char *stats_path = NULL;
+
+    rsa_file_opts opts = { .threads = 1 };
 
     bool verbose = false;
+    bool range = false;
+    uint64_t range_offset = 0, range_length = 0;
+    char *end = NULL;
     int opt = 0;
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
         case 'i': infile_path = optarg; break;
         case 'o': outfile_path = optarg; break;
+        case 't':
+            if (!pool_parse_threads(optarg, &opts.threads)) {
+                fprintf(stderr, "Invalid number of threads.\n");
+                return 1;
+            }
+            break;
         case 'n': private_key_path = optarg; break;
+        case 'S': stats_path = optarg; break;
+        case 'r':
+            range = true;
+            // both numbers must be plain decimal, as strtoull would also take a sign or nothing at all
+            range_offset = strtoull(optarg, &end, 10);
+            if (optarg[0] < '0' || optarg[0] > '9' || *end != ':' || end[1] < '0' || end[1] > '9') {
+                fprintf(stderr, "Invalid range, expected offset:length.\n");
+                return 1;
+            }
+            range_length = strtoull(end + 1, &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "Invalid range, expected offset:length.\n");
+                return 1;
+            }
+            break;
         case 'v': verbose = true; break;
         case 'h':
             printf("SYNOPSIS\n");
             printf("   Decrypts data using RSA decryption.\n");
             printf("   Encrypted data is encrypted by the encrypt program.\n\n");
             printf("USAGE\n");
-            printf("   ./decrypt [-hv] [-i infile] [-o outfile] -n privkey\n\n");
+            printf("   ./decrypt [-hv] [-i infile] [-o outfile] [-t threads] [-r offset:length] "
+                   "[-S statsfile] -n privkey\n\n");
             printf("OPTIONS\n");
             printf("   -h              Display program help and usage.\n");
             printf("   -v              Display verbose program output.\n");
             printf("   -i infile       Input file of data to decrypt (default: stdin).\n");
             printf("   -o outfile      Output file for decrypted data (default: stdout).\n");
+            printf("   -t threads      Worker threads for block exponentiation, 1 to %d (default: 1).\n",
+                POOL_MAX_THREADS);
+            printf("   -r off:len      Only decrypt len bytes of plaintext starting at off; needs a file\n");
+            printf("                   written with encrypt -x.\n");
             printf("   -n pbfile       Private key file (default: rsa.priv).\n");
+            printf("   -S statsfile    Write counters and timings as JSON to statsfile (- for stdout).\n");
             return 0;
         }
     }
 
+    if (stats_path != NULL) {
+        stats_enable();
+    }
+
     //Get private key
     private_key = fopen(private_key_path, "r");
 
@@ -52,14 +91,29 @@ int main(int argc, char **argv) {
     // initialize rsa variables
     mpz_t n, d;
     mpz_inits(n, d, NULL);
+    rsa_crt crt;
+    rsa_crt_init(&crt);
 
     // using private key file, read in all information to the initialized variables
-    rsa_read_priv(d, n, private_key);
+    // key files from older versions only hold n and d, so fall back to the full-width path
+    bool has_crt = rsa_read_priv(n, d, &crt, private_key);
+    fclose(private_key);
+    if (mpz_cmp_ui(n, 1) <= 0) {
+        fprintf(stderr, "Invalid private key.\n");
+        return 1;
+    }
 
     // print verbose stats
     if (verbose) {
-        gmp_printf("s (%zu bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
-        gmp_printf("n (%zu bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        gmp_printf("n (%zu bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
+        gmp_printf("d (%zu bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        if (has_crt) {
+            gmp_printf("p (%zu bits) = %Zd\n", mpz_sizeinbase(crt.p, 2), crt.p);
+            gmp_printf("q (%zu bits) = %Zd\n", mpz_sizeinbase(crt.q, 2), crt.q);
+            for (uint32_t i = 0; i < crt.extra; i++) {
+                gmp_printf("r (%zu bits) = %Zd\n", mpz_sizeinbase(crt.r[i], 2), crt.r[i]);
+            }
+        }
     }
 
     // Open files
@@ -72,14 +126,33 @@ int main(int argc, char **argv) {
     }
 
     // encrypt files using rsa.c
-    rsa_decrypt_file(infile, outfile, d, n);
+    // the ciphertext format (hex lines, binary or hybrid container) is detected by rsa_decrypt_file
+    int status = 0;
+    rsa_key_ctx ctx;
+    rsa_key_ctx_init(&ctx, n, d, has_crt ? &crt : NULL);
+    if (range) {
+        if (!rsa_decrypt_range_ctx(&ctx, infile, outfile, range_offset, range_length)) {
+            fprintf(stderr, "Ciphertext has no usable block index for this key, or outfile could not be written.\n");
+            status = 1;
+        }
+    } else if (!rsa_decrypt_file_ctx(&ctx, infile, outfile, &opts)) {
+        fprintf(stderr,
+            "Ciphertext was not written for this key or is damaged, or outfile could not be written.\n");
+        status = 1;
+    }
 
     //close both files
     fclose(infile);
     fclose(outfile);
+    if (stats_path != NULL && !stats_write(stats_path, "decrypt")) {
+        fprintf(stderr, "Unable to write stats.\n");
+        status = 1;
+    }
 
     //clear the remaining mpz variables
     mpz_clears(n, d, NULL);
+    rsa_crt_clear(&crt);
+    rsa_key_ctx_clear(&ctx);
 
-    return 0;
+    return status;
 }
@@ -1,12 +1,14 @@
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "stats.h"
+#include "threadpool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:S:bkxvh"
 
 int main(int argc, char **argv) {
 
@@ -15,6 +17,9 @@ int main(int argc, char **argv) {
     char *infile_path = NULL;
     char *outfile_path = NULL;
     char *public_key_path = "rsa.pub";
+    char *stats_path = NULL;
+
+    rsa_file_opts opts = { .threads = 1, .binary = false, .hybrid = false, .index = false };
 
     bool verbose = false;
     int opt = 0;
@@ -23,24 +28,50 @@ int main(int argc, char **argv) {
         switch (opt) {
         case 'i': infile_path = optarg; break;
         case 'o': outfile_path = optarg; break;
+        case 't':
+            if (!pool_parse_threads(optarg, &opts.threads)) {
+                fprintf(stderr, "Invalid number of threads.\n");
+                return 1;
+            }
+            break;
+        case 'b': opts.binary = true; break;
+        case 'k': opts.hybrid = true; break;
+        case 'x': opts.index = true; break;
         case 'n': public_key_path = optarg; break;
+        case 'S': stats_path = optarg; break;
         case 'v': verbose = true; break;
         case 'h':
             printf("SYNOPSIS\n");
             printf("   Encrypts data using RSA encryption.\n");
             printf("   Encrypted data is decrypted by the decrypt program.\n\n");
             printf("USAGE\n");
-            printf("   ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey\n\n");
+            printf("   ./encrypt [-hv] [-i infile] [-o outfile] [-t threads] [-b] [-k] [-x] [-S statsfile] "
+                   "-n pubkey\n\n");
             printf("OPTIONS\n");
             printf("   -h              Display program help and usage.\n");
             printf("   -v              Display verbose program output.\n");
             printf("   -i infile       Input file of data to encrypt (default: stdin).\n");
             printf("   -o outfile      Output file for encrypted data (default: stdout).\n");
+            printf("   -t threads      Worker threads for block exponentiation, 1 to %d (default: 1).\n",
+                POOL_MAX_THREADS);
+            printf("   -b              Write the compact binary ciphertext format.\n");
+            printf("   -k              Hybrid mode: encrypt a random session key with RSA and the data "
+                   "with ChaCha20-Poly1305.\n");
+            printf("   -x              Append a block index (implies -b) so decrypt -r can read ranges.\n");
             printf("   -n pbfile       Public key file (default: rsa.pub).\n");
+            printf("   -S statsfile    Write counters and timings as JSON to statsfile (- for stdout).\n");
             return 0;
         }
     }
 
+    if (opts.index && opts.hybrid) {
+        fprintf(stderr, "A block index needs the RSA block format, not hybrid mode.\n");
+        return 1;
+    }
+    if (stats_path != NULL) {
+        stats_enable();
+    }
+
     //Get public key
     public_key = fopen(public_key_path, "r");
 
@@ -50,16 +81,26 @@ int main(int argc, char **argv) {
     }
 
     // initialize rsa variables
-    char username_str[] = "";
+    char username_str[RSA_KEY_MAX_USER + 1] = "";
     mpz_t n, e, s, username;
     mpz_inits(n, e, s, username, NULL);
 
     // using public key file, read in all information to the initialized variables
-    rsa_read_pub(n, e, s, username_str, public_key);
+    // a binary key whose signature was checked when it was written need not be verified again
+    bool verified = rsa_read_pub(n, e, s, username_str, public_key);
+    fclose(public_key);
+    if (mpz_cmp_ui(n, 1) <= 0) {
+        fprintf(stderr, "Invalid public key.\n");
+        return 1;
+    }
+
+    // build the key context once; it serves both the signature check and every block
+    rsa_key_ctx ctx;
+    rsa_key_ctx_init(&ctx, n, e, NULL);
 
     // Change the username to a mpz of base 62
     mpz_set_str(username, username_str, 62);
-    if (!rsa_verify(username, s, e, n)) {
+    if (!verified && !rsa_verify_ctx(&ctx, username, s)) {
         fprintf(stderr, "Unable to verify signature.\n");
         return 0;
     }
@@ -82,12 +123,21 @@ int main(int argc, char **argv) {
     }
 
     // encrypt files using rsa.c
-    rsa_encrypt_file(infile, outfile, n, e); // printing 1
+    int status = 0;
+    if (!rsa_encrypt_file_ctx(&ctx, infile, outfile, &opts)) {
+        fprintf(stderr, "Unable to create a session key or write outfile.\n");
+        status = 1;
+    }
     //close both files
     fclose(infile);
     fclose(outfile);
+    if (stats_path != NULL && !stats_write(stats_path, "encrypt")) {
+        fprintf(stderr, "Unable to write stats.\n");
+        status = 1;
+    }
     //clear the remaining mpz variables
     mpz_clears(s, n, e, username, NULL);
+    rsa_key_ctx_clear(&ctx);
 
-    return 0;
+    return status;
 }
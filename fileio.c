@@ -0,0 +1,234 @@
+#include "fileio.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Returns whether the stream is backed by a regular file.
+// IN: file (stream)
+// OUT: bool (true for a regular file)
+static bool is_regular(FILE *file) {
+    struct stat st;
+    return fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Sets up reading from file. With map set and a regular file behind the stream, the file is mapped and
+// reading continues from the stream's current position (so bytes already consumed through stdio stay consumed).
+// IN: in (input), file (stream), map (whether mapping is wanted)
+// OUT: in (ready input)
+void io_in_open(io_in *in, FILE *file, bool map) {
+    in->file = file;
+    in->map = NULL;
+    in->map_size = 0;
+    in->pos = 0;
+
+    struct stat st;
+    off_t start = ftello(file);
+    if (!map || start < 0 || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size <= start) {
+        return;
+    }
+    void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (p == MAP_FAILED) {
+        return;
+    }
+    madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+    in->map = (const uint8_t *) p;
+    in->map_size = (size_t) st.st_size;
+    in->pos = (size_t) start;
+}
+
+// Sets up reading len bytes of memory in place.
+// IN: in (input), data (bytes), len (number of bytes)
+// OUT: in (ready input)
+void io_in_mem(io_in *in, const uint8_t *data, size_t len) {
+    in->file = NULL;
+    in->map = data;
+    in->map_size = len;
+    in->pos = 0;
+}
+
+// Returns the next n bytes of input, or fewer at the end of the input. From a mapping the result points into
+// the mapping and nothing is copied; from a stream the bytes are read into buf, which must hold n bytes.
+// IN: in (input), buf (buffer for stream input), n (bytes wanted), got (bytes returned)
+// OUT: const uint8_t * (the bytes, valid until the next call for stream input), got (number of bytes)
+const uint8_t *io_next(io_in *in, uint8_t *buf, size_t n, size_t *got) {
+    if (in->map == NULL && in->file != NULL) {
+        uint64_t start = stats_clock();
+        *got = fread(buf, sizeof(uint8_t), n, in->file);
+        STAT_TIME(STAT_IO_NS, start);
+        STAT_ADD(STAT_BYTES_IN, *got);
+        return buf;
+    }
+    size_t left = in->map_size - in->pos;
+    *got = n < left ? n : left;
+    const uint8_t *p = in->map + in->pos;
+    in->pos += *got;
+    STAT_ADD(STAT_BYTES_IN, *got);
+    return p;
+}
+
+// Releases the mapping, if any, leaving the stream positioned after the bytes consumed.
+// IN: in (input)
+// OUT: N/A
+void io_in_close(io_in *in) {
+    if (in->map != NULL && in->file != NULL) {
+        munmap((void *) in->map, in->map_size);
+        fseeko(in->file, (off_t) in->pos, SEEK_SET);
+    }
+    in->map = NULL;
+}
+
+// Sets up writing to file. Output for a regular file bypasses stdio, so the stream is flushed first.
+// IN: out (output), file (stream)
+// OUT: out (ready output)
+void io_out_open(io_out *out, FILE *file) {
+    out->file = file;
+    out->fd = -1;
+    out->len = 0;
+    out->cap = IO_STREAM_BUF_SIZE;
+    out->external = false;
+    out->failed = false;
+    if (is_regular(file) && fflush(file) == 0) {
+        out->fd = fileno(file);
+        out->cap = IO_BUF_SIZE;
+    }
+    void *p = NULL;
+    if (posix_memalign(&p, IO_BUF_ALIGN, out->cap) != 0) {
+        p = malloc(out->cap);
+    }
+    out->buf = (uint8_t *) p;
+}
+
+// Sets up writing to memory, starting in buf when it is given. Once the output outgrows buf (or from the
+// first byte when buf is NULL) it moves to a malloc'd buffer that doubles as needed, so the bytes always end
+// up contiguous in out->buf.
+// IN: out (output), buf (caller's buffer, may be NULL), cap (size of buf)
+// OUT: out (ready output)
+void io_out_mem(io_out *out, uint8_t *buf, size_t cap) {
+    out->file = NULL;
+    out->fd = -1;
+    out->buf = buf;
+    out->len = 0;
+    out->cap = buf != NULL ? cap : 0;
+    out->external = buf != NULL;
+    out->failed = false;
+}
+
+// Grows the buffer of output to memory to hold at least need bytes, keeping its contents.
+// IN: out (output to memory), need (bytes needed)
+// OUT: out (larger buffer)
+static void io_grow(io_out *out, size_t need) {
+    size_t cap = out->cap > 0 ? 2 * out->cap : IO_STREAM_BUF_SIZE;
+    cap = cap > need ? cap : need;
+    uint8_t *p = (uint8_t *) (out->external ? malloc(cap) : realloc(out->buf, cap));
+    if (out->external && p != NULL) {
+        memcpy(p, out->buf, out->len);
+    }
+    out->buf = p;
+    out->cap = cap;
+    out->external = false;
+}
+
+// Returns room for n more bytes at the end of the output, flushing or growing the buffer as needed.
+// The bytes only become part of the output once committed with io_commit.
+// IN: out (output), n (bytes needed)
+// OUT: uint8_t * (n writable bytes)
+uint8_t *io_reserve(io_out *out, size_t n) {
+    if (out->len + n > out->cap && out->file == NULL) {
+        io_grow(out, out->len + n);
+        return out->buf + out->len;
+    }
+    if (out->len + n > out->cap) {
+        io_flush(out);
+    }
+    if (n > out->cap) {
+        free(out->buf);
+        out->cap = n;
+        void *p = NULL;
+        if (posix_memalign(&p, IO_BUF_ALIGN, out->cap) != 0) {
+            p = malloc(out->cap);
+        }
+        out->buf = (uint8_t *) p;
+    }
+    return out->buf + out->len;
+}
+
+// Appends the first n bytes of the last reservation to the output.
+// IN: out (output), n (bytes written into the reservation)
+// OUT: out (updated output)
+void io_commit(io_out *out, size_t n) {
+    out->len += n;
+}
+
+// Appends n bytes to the output.
+// IN: out (output), data (bytes), n (number of bytes)
+// OUT: out (updated output)
+void io_write(io_out *out, const void *data, size_t n) {
+    memcpy(io_reserve(out, n), data, n);
+    io_commit(out, n);
+}
+
+// Hands the buffered bytes to the kernel or the stream, retrying interrupted writes. A failed write marks the
+// output as failed, and the bytes it could not take are dropped.
+// IN: out (output)
+// OUT: out (empty buffer, failed set on a write error)
+void io_flush(io_out *out) {
+    if (out->file == NULL) {
+        return; // output to memory stays in the buffer
+    }
+    uint64_t start = stats_clock();
+    STAT_ADD(STAT_BYTES_OUT, out->len);
+    if (out->fd < 0) {
+        if (fwrite(out->buf, sizeof(uint8_t), out->len, out->file) != out->len) {
+            out->failed = true;
+        }
+        out->len = 0;
+        STAT_TIME(STAT_IO_NS, start);
+        return;
+    }
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t w = write(out->fd, out->buf + done, out->len - done);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            out->failed = true;
+            break;
+        }
+        done += (size_t) w;
+    }
+    out->len = 0;
+    STAT_TIME(STAT_IO_NS, start);
+}
+
+// Flushes the output and frees its buffer, bringing the stream's position in line with the descriptor.
+// Output to memory keeps its buffer: out->buf and out->len are the result, and out->buf is the caller's
+// to free unless it is still the buffer passed to io_out_mem.
+// A stream is flushed too, so that its write errors show up here rather than at fclose.
+// IN: out (output)
+// OUT: bool (false if any write to the file or stream failed)
+bool io_out_close(io_out *out) {
+    if (out->file == NULL) {
+        STAT_ADD(STAT_BYTES_OUT, out->len);
+        return true;
+    }
+    io_flush(out);
+    if (out->fd >= 0) {
+        fseeko(out->file, lseek(out->fd, 0, SEEK_CUR), SEEK_SET);
+    } else if (fflush(out->file) != 0) {
+        out->failed = true;
+    }
+    free(out->buf);
+    out->buf = NULL;
+    return !out->failed;
+}
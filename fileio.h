@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Output is assembled in page-aligned buffers of IO_BUF_SIZE bytes before being handed to the kernel
+// in one write; streams that are not regular files use IO_STREAM_BUF_SIZE so pipes still see output promptly.
+#define IO_BUF_SIZE        (1 << 20)
+#define IO_STREAM_BUF_SIZE 8192
+#define IO_BUF_ALIGN       4096
+
+// Input of the file functions. A regular file is mapped read-only from the stream's current position and
+// read in place; anything else (a pipe or a terminal) is read through the stdio stream into the caller's buffer.
+// Input from memory (io_in_mem) has no stream and is read in place like a mapping.
+typedef struct {
+    FILE *file; // NULL for input from memory
+    const uint8_t *map; // mapping of the whole file, NULL when reading through the stream
+    size_t map_size; // bytes mapped
+    size_t pos; // offset of the next unread byte in the mapping
+} io_in;
+
+// Output of the file functions: bytes are gathered in buf and flushed with write(2) to a regular file's
+// descriptor, or with fwrite to any other stream. Output to memory (io_out_mem) has no stream: buf only grows
+// and is never flushed, and io_out_close leaves the bytes in buf for the caller.
+typedef struct {
+    FILE *file; // NULL for output to memory
+    int fd; // descriptor of a regular file, -1 to write through the stream
+    uint8_t *buf;
+    size_t len; // bytes waiting in buf
+    size_t cap; // size of buf
+    bool external; // buf belongs to the caller and is replaced, not reallocated, when it fills
+    bool failed; // a write to the file or stream failed, so the output is incomplete
+} io_out;
+
+void io_in_open(io_in *in, FILE *file, bool map);
+
+void io_in_mem(io_in *in, const uint8_t *data, size_t len);
+
+const uint8_t *io_next(io_in *in, uint8_t *buf, size_t n, size_t *got);
+
+void io_in_close(io_in *in);
+
+void io_out_open(io_out *out, FILE *file);
+
+void io_out_mem(io_out *out, uint8_t *buf, size_t cap);
+
+uint8_t *io_reserve(io_out *out, size_t n);
+
+void io_commit(io_out *out, size_t n);
+
+void io_write(io_out *out, const void *data, size_t n);
+
+void io_flush(io_out *out);
+
+bool io_out_close(io_out *out);
@@ -1,6 +1,8 @@
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "stats.h"
+#include "threadpool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,8 +11,158 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
 
-#define OPTIONS "b:i:n:d:s:vh"
+#define OPTIONS "b:e:i:P:m:n:d:s:t:N:o:p:S:Bvh"
+
+// Fewest bits of n per prime. Two primes split n at random down to a quarter each, so this keeps every
+// prime wide enough for the sieve.
+#define MIN_PRIME_BITS (2 * SIEVE_MIN_BITS)
+
+// Batch keys draw from random streams BATCH_STREAM + index, above the 32-bit stream numbers
+// make_primes hands to its own workers, so no two keys share a stream.
+#define BATCH_STREAM (1ULL << 32)
+
+// Batch key generation job shared by the pool workers.
+typedef struct {
+    const char *outdir;
+    const char *username;
+    uint64_t bits, iters, exponent;
+    uint32_t primes; // primes in each modulus
+    bool binary; // write the binary key format
+    uint64_t *n_bits; // per key: size of the generated modulus
+    bool *failed; // per key: its files could not be written
+} Batch;
+
+// Writes a key pair as hex or binary key files. A binary public key records whether its signature
+// checks out, so encrypt can skip verifying it.
+// IN: n e s (public key), d crt (private key), m (username as a number), username, binary (format),
+//     public_key private_key (target files)
+// OUT: public_key private_key (key files)
+static void write_keys(mpz_t n, mpz_t e, mpz_t s, mpz_t d, rsa_crt *crt, mpz_t m, char *username,
+    bool binary, FILE *public_key, FILE *private_key) {
+    if (binary) {
+        rsa_write_pub_bin(n, e, s, username, rsa_verify(m, s, e, n), public_key);
+        rsa_write_priv_bin(n, d, crt, private_key);
+    } else {
+        rsa_write_pub(n, e, s, username, public_key);
+        rsa_write_priv(n, d, crt, private_key);
+    }
+}
+
+// Generates, signs and writes key pair 'index' of a batch as outdir/keyNNNNNN.pub and .priv.
+// Each key has its own random stream, so the keys for a seed do not depend on the number of threads.
+// IN: arg (Batch), index (key number), worker (thread id, unused)
+// OUT: key files, n_bits[index], failed[index]
+static void batch_key(void *arg, uint64_t index, uint32_t worker) {
+    Batch *b = (Batch *) arg;
+    (void) worker;
+    randstate_init_stream(BATCH_STREAM + index);
+
+    mpz_t n, e, d, m, s, primes[RSA_MAX_PRIMES];
+    mpz_inits(n, e, d, m, s, NULL);
+    for (uint32_t i = 0; i < b->primes; i++) {
+        mpz_init(primes[i]);
+    }
+    rsa_crt crt;
+    rsa_crt_init(&crt);
+    mpz_set_ui(e, b->exponent);
+    rsa_make_pub_primes(primes, b->primes, n, e, b->bits, b->iters, 1);
+    rsa_make_priv_primes(d, e, primes, b->primes);
+    rsa_make_crt_primes(&crt, d, primes, b->primes);
+    mpz_set_str(m, b->username, 62);
+    rsa_sign_crt(s, m, &crt);
+    b->n_bits[index] = mpz_sizeinbase(n, 2);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/key%06lu.pub", b->outdir, (unsigned long) index);
+    FILE *public_key = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/key%06lu.priv", b->outdir, (unsigned long) index);
+    FILE *private_key = fopen(path, "w");
+    b->failed[index] = public_key == NULL || private_key == NULL;
+    if (!b->failed[index]) {
+        fchmod(fileno(private_key), S_IRUSR | S_IWUSR);
+        write_keys(n, e, s, d, &crt, m, (char *) b->username, b->binary, public_key, private_key);
+    }
+    if (public_key != NULL) {
+        fclose(public_key);
+    }
+    if (private_key != NULL) {
+        fclose(private_key);
+    }
+
+    mpz_clears(n, e, d, m, s, NULL);
+    for (uint32_t i = 0; i < b->primes; i++) {
+        mpz_clear(primes[i]);
+    }
+    rsa_crt_clear(&crt);
+    randstate_clear();
+}
+
+// Generates count key pairs into outdir on a pool of worker threads, writes outdir/manifest.csv
+// listing them in order and reports the aggregate rate.
+// IN: outdir (output directory, created if missing), count (number of keys), threads (worker threads),
+//     bits iters exponent primes binary (as for a single key), verbose (print each key)
+// OUT: int (exit status)
+static int batch_keygen(const char *outdir, uint64_t count, uint32_t threads, uint64_t bits,
+    uint64_t iters, uint64_t exponent, uint32_t primes, bool binary, bool verbose) {
+    if (mkdir(outdir, S_IRWXU) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Invalid output directory.\n");
+        return 1;
+    }
+    const char *username = getenv("USER");
+    Batch b = { outdir, username != NULL ? username : "", bits, iters, exponent, primes, binary,
+        (uint64_t *) calloc(count, sizeof(uint64_t)), (bool *) calloc(count, sizeof(bool)) };
+    Pool *pool = b.n_bits != NULL && b.failed != NULL ? pool_create(threads) : NULL;
+    if (pool == NULL) {
+        fprintf(stderr, "Unable to start worker threads.\n");
+        free(b.n_bits);
+        free(b.failed);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pool_run(pool, batch_key, &b, count);
+    pool_delete(&pool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    int status = 0;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/manifest.csv", outdir);
+    FILE *manifest = fopen(path, "w");
+    if (manifest == NULL) {
+        fprintf(stderr, "Invalid output directory.\n");
+        status = 1;
+    } else {
+        fprintf(manifest, "index,pubfile,privfile,bits\n");
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        if (b.failed[i]) {
+            fprintf(stderr, "Unable to write key %lu.\n", (unsigned long) i);
+            status = 1;
+            continue;
+        }
+        if (manifest != NULL) {
+            fprintf(manifest, "%lu,key%06lu.pub,key%06lu.priv,%lu\n", (unsigned long) i,
+                (unsigned long) i, (unsigned long) i, (unsigned long) b.n_bits[i]);
+        }
+        if (verbose) {
+            printf("key%06lu: n (%lu bits)\n", (unsigned long) i, (unsigned long) b.n_bits[i]);
+        }
+    }
+    if (manifest != NULL) {
+        fclose(manifest);
+    }
+    printf("%lu keys in %.3f s (%.2f keys/sec)\n", (unsigned long) count, seconds,
+        seconds > 0 ? count / seconds : 0);
+
+    free(b.n_bits);
+    free(b.failed);
+    return status;
+}
 
 int main(int argc, char **argv) {
 
@@ -22,36 +174,120 @@ int main(int argc, char **argv) {
     char *priv_file_path = "rsa.priv";
     uint64_t bits = 256;
     uint64_t confidence = 50;
+    int64_t bpsw_rounds = -1;
+    bool iters_given = false;
     uint64_t seed = time(NULL);
+    uint32_t threads = 1;
+    uint64_t exponent = RSA_DEFAULT_EXP;
+    uint32_t nprimes = 2;
+    uint64_t count = 0;
+    char *outdir = ".";
+    char *pool_path = NULL;
+    char *stats_path = NULL;
 
+    bool binary = false;
     bool verbose = false;
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
         case 'b': bits = atoi(optarg); break;
-        case 'i': confidence = atoi(optarg); break;
+        case 'e': exponent = strtoull(optarg, NULL, 10); break;
+        case 'i':
+            confidence = atoi(optarg);
+            iters_given = true;
+            break;
+        case 'P': bpsw_rounds = atoi(optarg); break;
+        case 'm': nprimes = atoi(optarg); break;
         case 'n': pub_file_path = optarg; break;
         case 'd': priv_file_path = optarg; break;
         case 's': seed = atoi(optarg); break;
+        case 't':
+            if (!pool_parse_threads(optarg, &threads)) {
+                fprintf(stderr, "Invalid number of threads.\n");
+                return 1;
+            }
+            break;
+        case 'N': count = strtoull(optarg, NULL, 10); break;
+        case 'o': outdir = optarg; break;
+        case 'p': pool_path = optarg; break;
+        case 'S': stats_path = optarg; break;
+        case 'B': binary = true; break;
         case 'v': verbose = true; break;
         case 'h':
             printf("SYNOPSIS\n");
             printf("   Generates an RSA public/private key pair.\n\n");
             printf("USAGE\n");
-            printf("   ./keygen [-hv] [-b bits] -n pbfile -d pvfile\n\n");
+            printf("   ./keygen [-hvB] [-b bits] [-e exponent] [-i confidence | -P rounds] [-m primes] "
+                   "[-t threads] [-p poolfile] [-S statsfile] -n pbfile -d pvfile\n");
+            printf("   ./keygen [-hvB] [-b bits] [-e exponent] [-i confidence | -P rounds] [-m primes] "
+                   "[-t threads] [-p poolfile] [-S statsfile] -N count [-o outdir]\n\n");
             printf("OPTIONS\n");
             printf("   -h              Display program help and usage.\n");
             printf("   -v              Display verbose program output.\n");
-            printf("   -b bits         Minimum bits needed for public key n (default: 256).\n");
+            printf("   -B              Write the binary key format, which loads faster.\n");
+            printf("   -b bits         Minimum bits needed for public key n, at least %d per prime "
+                   "(default: 256).\n", MIN_PRIME_BITS);
+            printf("   -e exponent     Public exponent, odd and at least 3, or 0 for a random one "
+                   "(default: 65537).\n");
             printf(
                 "   -i confidence   Miller-Rabin iterations for testing primes (default: 50).\n");
+            printf("   -P rounds       Test primes with Baillie-PSW plus rounds random Miller-Rabin "
+                   "iterations instead.\n");
+            printf("   -m primes       Primes in the modulus, 2 to %d; more primes generate and decrypt faster "
+                   "(default: 2).\n", RSA_MAX_PRIMES);
             printf("   -n pbfile       Public key file (default: rsa.pub).\n");
             printf("   -d pvfile       Private key file (default: rsa.priv).\n");
             printf("   -s seed         Random seed for testing.\n");
+            printf("   -t threads      Worker threads searching for primes, or generating keys with -N, "
+                   "1 to %d (default: 1).\n", POOL_MAX_THREADS);
+            printf("   -N count        Generate count key pairs as outdir/keyNNNNNN.pub and .priv plus "
+                   "outdir/manifest.csv.\n");
+            printf("   -o outdir       Output directory for -N (default: .).\n");
+            printf("   -p poolfile     Take primes from a pool filled by primepool, searching only once it "
+                   "runs dry.\n");
+            printf("   -S statsfile    Write counters and timings as JSON to statsfile (- for stdout).\n");
             return 0;
         }
     }
 
+    if (exponent != 0 && (exponent < 3 || exponent % 2 == 0)) {
+        fprintf(stderr, "Invalid exponent.\n");
+        return 1;
+    }
+    if (nprimes < 2 || nprimes > RSA_MAX_PRIMES) {
+        fprintf(stderr, "Invalid number of primes.\n");
+        return 1;
+    }
+    if (bits < MIN_PRIME_BITS * nprimes) {
+        fprintf(stderr, "bits must be at least %d per prime.\n", MIN_PRIME_BITS);
+        return 1;
+    }
+    if (iters_given && bpsw_rounds >= 0) {
+        fprintf(stderr, "Use either -i or -P, not both.\n");
+        return 1;
+    }
+    if (stats_path != NULL) {
+        stats_enable();
+    }
+    if (bpsw_rounds >= 0) {
+        prime_test_bpsw(true);
+        confidence = (uint64_t) bpsw_rounds;
+    }
+    if (pool_path != NULL) {
+        rsa_use_prime_pool(pool_path);
+    }
+
+    if (count > 0) {
+        randstate_init(seed);
+        int status = batch_keygen(outdir, count, threads, bits, confidence, exponent, nprimes, binary, verbose);
+        randstate_clear();
+        if (stats_path != NULL && !stats_write(stats_path, "keygen")) {
+            fprintf(stderr, "Unable to write stats.\n");
+            status = 1;
+        }
+        return status;
+    }
+
     //Open public key and private key files
     public_key = fopen(pub_file_path, "w+");
     if (public_key == NULL) {
@@ -68,34 +304,40 @@ int main(int argc, char **argv) {
     int privfd = fileno(private_key);
     fchmod(privfd, S_IRUSR | S_IWUSR);
 
-    // Initialize random state
+    // Initialize random state; prime search workers derive their own streams from the seed
     randstate_init(seed);
-    srand(seed);
 
     // Make public and private keys
-    mpz_t n, e, p, q, d, m, s, d_temp;
-    mpz_inits(n, e, p, q, d, m, s, d_temp, NULL);
-    rsa_make_pub(p, q, n, e, bits, confidence);
-    rsa_make_priv(d, e, p, q);
+    mpz_t n, e, d, m, s, d_temp, primes[RSA_MAX_PRIMES];
+    mpz_inits(n, e, d, m, s, d_temp, NULL);
+    for (uint32_t i = 0; i < nprimes; i++) {
+        mpz_init(primes[i]);
+    }
+    rsa_crt crt;
+    rsa_crt_init(&crt);
+    mpz_set_ui(e, exponent);
+    rsa_make_pub_primes(primes, nprimes, n, e, bits, confidence, threads);
+    rsa_make_priv_primes(d, e, primes, nprimes);
+    rsa_make_crt_primes(&crt, d, primes, nprimes);
 
     mpz_set(d_temp, d);
 
     // Get username
     char *username = strdup(getenv("USER"));
     mpz_set_str(m, username, 62); //set username of size 62
-    rsa_sign(s, m, d, n);
+    rsa_sign_crt(s, m, &crt);
 
     //write to public and private key files respectively
 
-    rsa_write_pub(n, e, s, username, public_key);
-    rsa_write_priv(n, d_temp, private_key);
+    write_keys(n, e, s, d_temp, &crt, m, username, binary, public_key, private_key);
 
     // print verbose stats
     if (verbose) {
         printf("user = %s\n", username);
         gmp_printf("s (%zu bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
-        gmp_printf("s (%zu bits) = %Zd\n", mpz_sizeinbase(s, 2), p);
-        gmp_printf("s (%zu bits) = %Zd\n", mpz_sizeinbase(s, 2), q);
+        for (uint32_t i = 0; i < nprimes; i++) {
+            gmp_printf("s (%zu bits) = %Zd\n", mpz_sizeinbase(s, 2), primes[i]);
+        }
         gmp_printf("n (%zu bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("e (%zu bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
         gmp_printf("s (%zu bits) = %Zd\n", mpz_sizeinbase(s, 2), d);
@@ -105,10 +347,20 @@ int main(int argc, char **argv) {
     fclose(public_key);
     fclose(private_key);
 
+    int status = 0;
+    if (stats_path != NULL && !stats_write(stats_path, "keygen")) {
+        fprintf(stderr, "Unable to write stats.\n");
+        status = 1;
+    }
+
     //clear the remaining mpz variables
     randstate_clear();
-    mpz_clears(n, e, p, q, d, m, s, d_temp, NULL);
+    mpz_clears(n, e, d, m, s, d_temp, NULL);
+    for (uint32_t i = 0; i < nprimes; i++) {
+        mpz_clear(primes[i]);
+    }
+    rsa_crt_clear(&crt);
     free(username);
     username = NULL;
-    return 0;
+    return status;
 }
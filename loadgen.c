@@ -0,0 +1,236 @@
+#include "proto.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "s:n:m:c:r:l:f:o:kh"
+
+// Operation names accepted by -m, in the order of their PROTO_ values.
+static const char *op_names[] = { "encrypt", "decrypt", "sign", "verify", "ping" };
+
+// One client connection of the load: it sends the same request requests times, one at a time, and
+// records the latency of each.
+typedef struct {
+    pthread_t thread;
+    const char *socket_path;
+    proto_frame frame; // request header
+    const uint8_t *body; // request body, shared by all connections
+    uint64_t requests;
+    double *lat; // latency of each request in seconds
+    uint64_t errors; // requests answered with an error status, or lost with the connection
+} Conn;
+
+// Returns a monotonic timestamp in seconds.
+// IN: N/A
+// OUT: double (seconds)
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// qsort comparator for latencies.
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Sends one request on a fresh connection and waits for its response; used to prepare the payload of the load.
+// IN: socket_path (rsad socket), frame (request header), body (request body), reply (response header),
+//     out cap (response body buffer)
+// OUT: reply out cap (response), bool (false if rsad could not be reached)
+static bool request_once(const char *socket_path, proto_frame *frame, const uint8_t *body, proto_frame *reply,
+    uint8_t **out, size_t *cap) {
+    int fd = proto_connect(socket_path);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = proto_send(fd, frame, body) && proto_recv(fd, reply, out, cap) == 1;
+    close(fd);
+    return ok;
+}
+
+// Connection thread: connects, then sends requests back to back, each after the previous response.
+// IN: arg (Conn)
+// OUT: NULL
+static void *conn_main(void *arg) {
+    Conn *c = (Conn *) arg;
+    uint8_t *out = NULL;
+    size_t cap = 0;
+    int fd = proto_connect(c->socket_path);
+    for (uint64_t i = 0; i < c->requests; i++) {
+        double start = now();
+        proto_frame reply;
+        c->frame.id = (uint32_t) i;
+        if (fd < 0 || !proto_send(fd, &c->frame, c->body) || proto_recv(fd, &reply, &out, &cap) != 1) {
+            c->errors += c->requests - i;
+            break;
+        }
+        c->lat[i] = now() - start;
+        if (reply.status != PROTO_OK) {
+            c->errors++;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(out);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    char *socket_path = PROTO_DEFAULT_SOCKET;
+    char *outfile_path = NULL;
+    uint8_t op = PROTO_ENCRYPT;
+    uint8_t key = 0;
+    uint8_t flags = 0;
+    uint32_t conns = 4;
+    uint64_t requests = 1000;
+    size_t length = 16;
+    bool json = false;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 's': socket_path = optarg; break;
+        case 'n': key = (uint8_t) atoi(optarg); break;
+        case 'm':
+            op = 0;
+            for (uint8_t i = 0; i < sizeof(op_names) / sizeof(op_names[0]); i++) {
+                if (strcmp(optarg, op_names[i]) == 0) {
+                    op = PROTO_ENCRYPT + i;
+                }
+            }
+            if (op == 0) {
+                fprintf(stderr, "Unknown operation %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c': conns = atoi(optarg); break;
+        case 'r': requests = strtoull(optarg, NULL, 10); break;
+        case 'l': length = strtoull(optarg, NULL, 10); break;
+        case 'f': json = strcmp(optarg, "json") == 0; break;
+        case 'o': outfile_path = optarg; break;
+        case 'k': flags |= PROTO_FLAG_HYBRID; break;
+        case 'h':
+            printf("SYNOPSIS\n");
+            printf("   Drives rsad with concurrent connections and reports requests/sec and latency.\n\n");
+            printf("USAGE\n");
+            printf("   ./loadgen [-hk] [-s socket] [-n key] [-m operation] [-c connections] [-r requests] "
+                   "[-l bytes] [-f csv|json] [-o outfile]\n\n");
+            printf("OPTIONS\n");
+            printf("   -h              Display program help and usage.\n");
+            printf("   -s socket       Socket path of rsad (default: %s).\n", PROTO_DEFAULT_SOCKET);
+            printf("   -n key          Key slot on the daemon (default: 0).\n");
+            printf("   -m operation    encrypt, decrypt, sign, verify or ping (default: encrypt).\n");
+            printf("   -k              Encrypt in hybrid mode (also for the ciphertext decrypt replays).\n");
+            printf("   -c connections  Concurrent connections, one thread each (default: 4).\n");
+            printf("   -r requests     Requests per connection (default: 1000).\n");
+            printf("   -l bytes        Plaintext or message size; sign and verify need it below the key's "
+                   "(default: 16).\n");
+            printf("   -f csv|json     Output format (default: csv).\n");
+            printf("   -o outfile      Output file (default: stdout).\n");
+            return 0;
+        }
+    }
+    if (conns < 1 || requests < 1) {
+        fprintf(stderr, "Need at least one connection and one request.\n");
+        return 1;
+    }
+
+    // random plaintext or message; decrypt and verify replay a ciphertext or signature made from it first
+    uint8_t *body = (uint8_t *) malloc(length > 0 ? length : 1);
+    srand((unsigned) time(NULL));
+    for (size_t i = 0; i < length; i++) {
+        body[i] = (uint8_t) rand();
+    }
+    uint32_t body_len = (uint32_t) length;
+    if (op == PROTO_DECRYPT || op == PROTO_VERIFY) {
+        proto_frame setup = { body_len, 0, op == PROTO_DECRYPT ? PROTO_ENCRYPT : PROTO_SIGN, key, flags };
+        proto_frame reply;
+        uint8_t *out = NULL;
+        size_t cap = 0;
+        if (!request_once(socket_path, &setup, body, &reply, &out, &cap)) {
+            fprintf(stderr, "%s: Unable to connect.\n", socket_path);
+            return 1;
+        }
+        if (reply.status != PROTO_OK) {
+            fprintf(stderr, "Unable to prepare the requests: %s.\n", proto_status_str(reply.status));
+            return 1;
+        }
+        if (op == PROTO_VERIFY) {
+            // signature first, then the message
+            out = (uint8_t *) realloc(out, reply.length + length + 1);
+            memcpy(out + reply.length, body, length);
+            body_len = reply.length + (uint32_t) length;
+        } else {
+            body_len = reply.length;
+        }
+        free(body);
+        body = out;
+    }
+
+    Conn *c = (Conn *) calloc(conns, sizeof(Conn));
+    double start = now();
+    for (uint32_t i = 0; i < conns; i++) {
+        c[i].socket_path = socket_path;
+        c[i].frame = (proto_frame) { body_len, 0, op, key, flags };
+        c[i].body = body;
+        c[i].requests = requests;
+        c[i].lat = (double *) calloc(requests, sizeof(double));
+        pthread_create(&c[i].thread, NULL, conn_main, &c[i]);
+    }
+    uint64_t total = 0, errors = 0;
+    double *lat = (double *) calloc(conns * requests, sizeof(double));
+    for (uint32_t i = 0; i < conns; i++) {
+        pthread_join(c[i].thread, NULL);
+        errors += c[i].errors;
+        for (uint64_t j = 0; j < requests; j++) {
+            if (c[i].lat[j] > 0) {
+                lat[total++] = c[i].lat[j];
+            }
+        }
+        free(c[i].lat);
+    }
+    double seconds = now() - start;
+    free(c);
+    free(body);
+
+    if (total == 0) {
+        fprintf(stderr, "%s: No requests were answered.\n", socket_path);
+        free(lat);
+        return 1;
+    }
+    qsort(lat, total, sizeof(double), cmp_double);
+    double p50 = lat[(total - 1) * 50 / 100] * 1e6, p90 = lat[(total - 1) * 90 / 100] * 1e6,
+           p99 = lat[(total - 1) * 99 / 100] * 1e6, p999 = lat[(total - 1) * 999 / 1000] * 1e6;
+    double rate = total / seconds;
+
+    FILE *out = outfile_path == NULL ? stdout : fopen(outfile_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Invalid outfile.\n");
+        free(lat);
+        return 1;
+    }
+    if (json) {
+        fprintf(out,
+            "{\"op\": \"%s\", \"connections\": %u, \"bytes\": %zu, \"requests\": %lu, \"errors\": %lu, "
+            "\"seconds\": %.6f, \"req_per_s\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+            "\"p999_us\": %.3f}\n",
+            op_names[op - PROTO_ENCRYPT], conns, length, (unsigned long) total, (unsigned long) errors, seconds,
+            rate, p50, p90, p99, p999);
+    } else {
+        fprintf(out, "op,connections,bytes,requests,errors,seconds,req_per_s,p50_us,p90_us,p99_us,p999_us\n");
+        fprintf(out, "%s,%u,%zu,%lu,%lu,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f\n", op_names[op - PROTO_ENCRYPT], conns,
+            length, (unsigned long) total, (unsigned long) errors, seconds, rate, p50, p90, p99, p999);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(lat);
+    return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,262 @@
+#include "mbpow.h"
+
+#include "numtheory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && GMP_NUMB_BITS == 64
+#include <immintrin.h>
+#define MB_KERNEL 1
+#else
+#define MB_KERNEL 0
+#endif
+
+#define MB_MASK ((1ULL << 52) - 1)
+
+static bool enabled = true;
+
+// Turns the multi-buffer kernel on or off for contexts initialized from now on, so the scalar path can be
+// compared against it.
+// IN: enable (whether the kernel may be used)
+// OUT: N/A
+void mb_enable(bool enable) {
+    enabled = enable;
+}
+
+// Returns whether the multi-buffer kernel is enabled and the CPU has AVX-512 IFMA.
+// IN: N/A
+// OUT: bool (kernel usable)
+bool mb_available(void) {
+#if MB_KERNEL
+    return enabled && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma");
+#else
+    return false;
+#endif
+}
+
+// Allocates words zeroed 64-bit words aligned for vector loads.
+// IN: words (number of words)
+// OUT: uint64_t * (buffer, NULL if out of memory)
+static uint64_t *mb_alloc(size_t words) {
+    void *p = NULL;
+    if (posix_memalign(&p, 64, words * sizeof(uint64_t)) != 0) {
+        return NULL;
+    }
+    memset(p, 0, words * sizeof(uint64_t));
+    return (uint64_t *) p;
+}
+
+// Splits a into limbs radix-2^52 limbs, writing limb j to rp[j * stride]. a must fit in the limbs.
+// IN: rp (destination), stride (distance between limbs), a (value), limbs (number of limbs)
+// OUT: rp (limbs of a)
+static void split52(uint64_t *rp, size_t stride, mpz_t a, size_t limbs) {
+    const mp_limb_t *ap = mpz_limbs_read(a);
+    size_t an = mpz_size(a);
+    for (size_t j = 0; j < limbs; j++) {
+        size_t w = 52 * j / 64, sh = 52 * j % 64;
+        uint64_t v = w < an ? ap[w] >> sh : 0;
+        if (sh > 12 && w + 1 < an) {
+            v |= ap[w + 1] << (64 - sh);
+        }
+        rp[j * stride] = v & MB_MASK;
+    }
+}
+
+// Joins limbs radix-2^52 limbs read from xp[j * stride] into out.
+// IN: out (value), xp (limbs), stride (distance between limbs), limbs (number of limbs)
+// OUT: out (joined value)
+static void join52(mpz_t out, const uint64_t *xp, size_t stride, size_t limbs) {
+    size_t words = (52 * limbs + 63) / 64;
+    mp_limb_t *op = mpz_limbs_write(out, words);
+    memset(op, 0, words * sizeof(mp_limb_t));
+    for (size_t j = 0; j < limbs; j++) {
+        size_t w = 52 * j / 64, sh = 52 * j % 64;
+        uint64_t v = xp[j * stride];
+        op[w] |= v << sh;
+        if (sh > 12) {
+            op[w + 1] |= v >> (64 - sh);
+        }
+    }
+    mpz_limbs_finish(out, words);
+}
+
+// Prepares a multi-buffer context for modulus n. The context is only ready when the kernel is available and
+// n is odd and at most MB_MAX_BITS bits; mb_pow must not be called otherwise.
+// IN: mb (context), n (modulus)
+// OUT: mb (initialized context)
+void mb_init(mb_ctx *mb, mpz_t n) {
+    mpz_inits(mb->modulus, mb->t, NULL);
+    mpz_set(mb->modulus, n);
+    size_t bits = mpz_sizeinbase(n, 2);
+    mb->limbs = (bits + 2 + 51) / 52;
+    mb->ready = false;
+    mb->n = mb->r2 = mb->one = mb->table = mb->acc = mb->x = NULL;
+    if (!mb_available() || mpz_even_p(n) || mpz_cmp_ui(n, 1) <= 0 || bits > MB_MAX_BITS) {
+        return;
+    }
+    size_t vec = mb->limbs * MB_LANES;
+    mb->n = mb_alloc(mb->limbs);
+    mb->r2 = mb_alloc(vec);
+    mb->one = mb_alloc(vec);
+    mb->table = mb_alloc(MONT_TABLE_SIZE * vec);
+    mb->acc = mb_alloc(vec);
+    mb->x = mb_alloc(vec);
+    if (mb->n == NULL || mb->r2 == NULL || mb->one == NULL || mb->table == NULL || mb->acc == NULL
+        || mb->x == NULL) {
+        return;
+    }
+
+    split52(mb->n, 1, n, mb->limbs);
+    mpz_set_ui(mb->t, 1);
+    mpz_mul_2exp(mb->t, mb->t, 2 * 52 * mb->limbs);
+    mpz_mod(mb->t, mb->t, n);
+    for (size_t lane = 0; lane < MB_LANES; lane++) {
+        split52(mb->r2 + lane, MB_LANES, mb->t, mb->limbs);
+        mb->one[lane] = 1;
+    }
+    // k0 = -n^-1 mod 2^52, by Newton iteration on the lowest limb
+    uint64_t n0 = mpz_getlimbn(n, 0);
+    uint64_t inv = n0;
+    for (int i = 0; i < 6; i++) {
+        inv *= 2 - n0 * inv;
+    }
+    mb->k0 = -inv & MB_MASK;
+    mb->ready = true;
+}
+
+// Clears the memory used by a multi-buffer context.
+// IN: mb (context)
+// OUT: N/A
+void mb_clear(mb_ctx *mb) {
+    free(mb->n);
+    free(mb->r2);
+    free(mb->one);
+    free(mb->table);
+    free(mb->acc);
+    free(mb->x);
+    mpz_clears(mb->modulus, mb->t, NULL);
+}
+
+#if MB_KERNEL
+// Montgomery multiplication of MB_LANES pairs at once: rp = ap * bp * R^-1 mod n lane by lane, with inputs below
+// 2n giving a result below 2n. Limb products are accumulated unnormalized in 64-bit words, one limb of bp per pass,
+// and the carries are only propagated at the end. rp may alias ap or bp.
+// IN: mb (ready context), rp (products), ap bp (factors in Montgomery form)
+// OUT: rp (products in Montgomery form, normalized limbs)
+__attribute__((target("avx512f,avx512ifma"))) static void mb_mul(
+    mb_ctx *mb, uint64_t *rp, const uint64_t *ap, const uint64_t *bp) {
+    size_t limbs = mb->limbs;
+    __m512i t[2 * MB_MAX_LIMBS];
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i mask = _mm512_set1_epi64((long long) MB_MASK);
+    const __m512i k0 = _mm512_set1_epi64((long long) mb->k0);
+    for (size_t j = 0; j < 2 * limbs; j++) {
+        t[j] = zero;
+    }
+    for (size_t i = 0; i < limbs; i++) {
+        // t[i..] += a * b[i], then the multiple of n clearing limb i, whose high part moves up to limb i + 1
+        __m512i *ti = t + i;
+        __m512i b = _mm512_load_si512((const void *) (bp + i * MB_LANES));
+        for (size_t j = 0; j < limbs; j++) {
+            __m512i a = _mm512_load_si512((const void *) (ap + j * MB_LANES));
+            ti[j] = _mm512_madd52lo_epu64(ti[j], a, b);
+            ti[j + 1] = _mm512_madd52hi_epu64(ti[j + 1], a, b);
+        }
+        __m512i q = _mm512_madd52lo_epu64(zero, ti[0], k0);
+        for (size_t j = 0; j < limbs; j++) {
+            __m512i nj = _mm512_set1_epi64((long long) mb->n[j]);
+            ti[j] = _mm512_madd52lo_epu64(ti[j], q, nj);
+            ti[j + 1] = _mm512_madd52hi_epu64(ti[j + 1], q, nj);
+        }
+        ti[1] = _mm512_add_epi64(ti[1], _mm512_srli_epi64(ti[0], 52));
+    }
+    __m512i carry = zero;
+    for (size_t j = 0; j < limbs; j++) {
+        __m512i v = _mm512_add_epi64(t[limbs + j], carry);
+        _mm512_store_si512((void *) (rp + j * MB_LANES), _mm512_and_si512(v, mask));
+        carry = _mm512_srli_epi64(v, 52);
+    }
+}
+#else
+static void mb_mul(mb_ctx *mb, uint64_t *rp, const uint64_t *ap, const uint64_t *bp) {
+    (void) mb;
+    (void) rp;
+    (void) ap;
+    (void) bp;
+}
+#endif
+
+// Computes out[i] = base[i]^exponent mod n for i < count (at most MB_LANES), with the same sliding window as
+// mont_pow run on all lanes at once. The results equal those of the scalar routines.
+// IN: mb (ready context), out (outputs), base (numbers raised), count (number of lanes used), exponent (power)
+// OUT: out (outputs of modular exponentiation)
+void mb_pow(mb_ctx *mb, mpz_t *out, mpz_t *base, uint32_t count, mpz_t exponent) {
+    if (mpz_sgn(exponent) <= 0) {
+        for (uint32_t lane = 0; lane < count; lane++) {
+            mpz_set_ui(out[lane], 1);
+            mpz_mod(out[lane], out[lane], mb->modulus);
+        }
+        return;
+    }
+    size_t vec = mb->limbs * MB_LANES;
+    for (uint32_t lane = 0; lane < MB_LANES; lane++) {
+        mpz_set_ui(mb->t, 0);
+        if (lane < count) {
+            mpz_mod(mb->t, base[lane], mb->modulus);
+        }
+        split52(mb->x + lane, MB_LANES, mb->t, mb->limbs);
+    }
+
+    size_t bits = mpz_sizeinbase(exponent, 2);
+    int w = mont_window(bits);
+    int entries = 1 << (w - 1);
+
+    // table[k] = base^(2k+1) in Montgomery form; acc holds base^2 while the table is built
+    uint64_t *acc = mb->acc;
+    mb_mul(mb, mb->table, mb->x, mb->r2);
+    if (entries > 1) {
+        mb_mul(mb, acc, mb->table, mb->table);
+        for (int k = 1; k < entries; k++) {
+            mb_mul(mb, mb->table + k * vec, mb->table + (k - 1) * vec, acc);
+        }
+    }
+
+    bool started = false;
+    int64_t i = (int64_t) bits - 1;
+    while (i >= 0) {
+        if (mpz_tstbit(exponent, i) == 0) {
+            mb_mul(mb, acc, acc, acc);
+            i--;
+            continue;
+        }
+        // longest window of at most w bits ending in a set bit
+        int64_t low = i - w + 1 > 0 ? i - w + 1 : 0;
+        while (mpz_tstbit(exponent, low) == 0) {
+            low++;
+        }
+        uint64_t value = 0;
+        for (int64_t k = i; k >= low; k--) {
+            value = (value << 1) | mpz_tstbit(exponent, k);
+        }
+        if (started) {
+            for (int64_t k = i; k >= low; k--) {
+                mb_mul(mb, acc, acc, acc);
+            }
+            mb_mul(mb, acc, acc, mb->table + (value >> 1) * vec);
+        } else {
+            memcpy(acc, mb->table + (value >> 1) * vec, vec * sizeof(uint64_t));
+            started = true;
+        }
+        i = low - 1;
+    }
+
+    // leaving Montgomery form gives at most n, which is n only for a zero result
+    mb_mul(mb, mb->x, acc, mb->one);
+    for (uint32_t lane = 0; lane < count; lane++) {
+        join52(out[lane], mb->x + lane, MB_LANES, mb->limbs);
+        if (mpz_cmp(out[lane], mb->modulus) >= 0) {
+            mpz_sub(out[lane], out[lane], mb->modulus);
+        }
+    }
+}
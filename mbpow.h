@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// Multi-buffer modular exponentiation: up to MB_LANES exponentiations under the same modulus and exponent
+// run side by side, one per 64-bit lane of an AVX-512 register, on numbers held in radix-2^52 limbs and
+// multiplied with the AVX-512 IFMA instructions. Without IFMA support no context becomes ready and callers
+// keep to their scalar path.
+#define MB_LANES 8
+
+// Groups of fewer blocks than this are cheaper to exponentiate one at a time on the scalar path.
+#define MB_MIN_LANES 3
+
+// Largest modulus handled, and the radix-2^52 limbs needed to hold 4 times it.
+#define MB_MAX_BITS  4096
+#define MB_MAX_LIMBS ((MB_MAX_BITS + 2 + 51) / 52)
+
+// Multi-buffer context for a fixed modulus n, with R = 2^(52 * limbs) > 4n. Vectors of limbs are stored
+// limb by limb, each limb being MB_LANES consecutive words, one per lane.
+typedef struct {
+    bool ready; // the kernel is available and n suits it
+    size_t limbs; // radix-2^52 limbs per number
+    uint64_t k0; // -n^-1 mod 2^52
+    uint64_t *n; // modulus, limbs words
+    uint64_t *r2; // R^2 mod n in every lane, one vector
+    uint64_t *one; // 1 in every lane, one vector
+    uint64_t *table; // odd powers of the bases: MONT_TABLE_SIZE vectors
+    uint64_t *acc; // running products, one vector
+    uint64_t *x; // bases on the way in and results on the way out, one vector
+    mpz_t modulus, t; // n, and scratch for the conversions
+} mb_ctx;
+
+void mb_enable(bool enable);
+
+bool mb_available(void);
+
+void mb_init(mb_ctx *mb, mpz_t n);
+
+void mb_clear(mb_ctx *mb);
+
+void mb_pow(mb_ctx *mb, mpz_t *out, mpz_t *base, uint32_t count, mpz_t exponent);
@@ -1,62 +1,244 @@
 #include "randstate.h"
 #include "numtheory.h"
-//
+#include "stats.h"
+#include "threadpool.h"
 
-//Computes the greatest common divisor of a and b, storing the value of the computed divisor in d
-// IN: a, b (dividents), d (divisor)
-// OUT: d (divisor)
-void gcd(mpz_t d, mpz_t a, mpz_t b) {
-    //create temp mpz variables so as not to modify d, a, or b
-    mpz_t a_temp, b_temp, temp;
-    mpz_inits(a_temp, b_temp, temp, NULL);
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static _Atomic uint64_t alloc_count;
+static void *(*gmp_alloc)(size_t);
+static void *(*gmp_realloc)(void *, size_t, size_t);
+static void (*gmp_free)(void *, size_t);
 
-    mpz_set(a_temp, a);
-    mpz_set(b_temp, b);
+// GMP allocation hook that counts the call before handing it to the default allocator.
+static void *counting_alloc(size_t size) {
+    atomic_fetch_add(&alloc_count, 1);
+    return gmp_alloc(size);
+}
+
+// GMP reallocation hook that counts the call before handing it to the default allocator.
+static void *counting_realloc(void *ptr, size_t old_size, size_t new_size) {
+    atomic_fetch_add(&alloc_count, 1);
+    return gmp_realloc(ptr, old_size, new_size);
+}
 
-    while (mpz_cmp_ui(b_temp, 0) != 0) { //step 1
-        mpz_set(temp, b_temp); //step 2
-        mpz_mod(b_temp, a_temp, b_temp); //step 3
-        mpz_set(a_temp, temp); //step 4
+// Turns counting of GMP heap allocations and reallocations on or off. The count is process wide.
+// IN: enable (whether to count)
+// OUT: N/A
+void numtheory_count_allocs(bool enable) {
+    if (enable && gmp_alloc == NULL) {
+        mp_get_memory_functions(&gmp_alloc, &gmp_realloc, &gmp_free);
+        mp_set_memory_functions(counting_alloc, counting_realloc, gmp_free);
+    } else if (!enable && gmp_alloc != NULL) {
+        mp_set_memory_functions(gmp_alloc, gmp_realloc, gmp_free);
+        gmp_alloc = NULL;
     }
+}
 
-    mpz_set(d, a_temp); //step 5
-    //free mpz variables
-    mpz_clears(a_temp, b_temp, temp, NULL);
+// Returns the number of GMP allocations and reallocations counted so far.
+// IN: N/A
+// OUT: uint64_t (allocation count)
+uint64_t numtheory_allocs(void) {
+    return atomic_load(&alloc_count);
 }
 
-// Computes the inverse i of a modulo n. In the event that a modular inverse cannot be found, set i to 0.
-// IN: i (inverse) of  a (mod left side) and b (mod right side)
-// OUT: i (inverse)
-void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
-    mpz_t r, r_prime, t, t_prime, q;
-    mpz_inits(r, r_prime, t, t_prime, q, NULL);
-    mpz_set(r, n); //step 1
-    mpz_set(r_prime, a);
-    mpz_set_ui(t, 0); //step 2
-    mpz_set_ui(t_prime, 1);
-    while (mpz_cmp_ui(r_prime, 0) != 0) { // step 3
-        mpz_fdiv_q(q, r, r_prime); //step 4
+// Sets up the first regs registers of a workspace, sized for numbers of up to bits bits, and optionally its
+// Montgomery context and sieve buffers. The parts left out are marked absent for numtheory_ws_clear.
+// IN: ws (workspace), bits (largest operand size expected), regs (registers needed),
+//     mont (set up the Montgomery context), sieve (set up the sieve buffers)
+// OUT: ws (initialized workspace)
+static void ws_init_parts(numtheory_ws *ws, uint64_t bits, int regs, bool mont, bool sieve) {
+    mp_bitcnt_t size = 2 * bits + 4 * GMP_NUMB_BITS; // room for a double-width product plus carries
+    for (int i = 0; i < regs; i++) {
+        mpz_init2(ws->r[i], size);
+    }
+    ws->regs = regs;
+    ws->has_mont = mont;
+    if (mont) {
+        mont_init2(&ws->mont, size);
+    }
+    ws->res = sieve ? (uint32_t *) calloc(SIEVE_PRIMES, sizeof(uint32_t)) : NULL;
+    ws->composite = sieve ? (uint8_t *) calloc(SIEVE_WINDOW, sizeof(uint8_t)) : NULL;
+}
+
+// Sets up a workspace whose registers and buffers are sized for numbers of up to bits bits,
+// so the _ws routines never allocate while their operands stay within that size.
+// IN: ws (workspace), bits (largest operand size expected)
+// OUT: ws (initialized workspace)
+void numtheory_ws_init(numtheory_ws *ws, uint64_t bits) {
+    ws_init_parts(ws, bits, WS_REGS, true, true);
+}
+
+// Clears the memory used by a workspace.
+// IN: ws (workspace)
+// OUT: N/A
+void numtheory_ws_clear(numtheory_ws *ws) {
+    for (int i = 0; i < ws->regs; i++) {
+        mpz_clear(ws->r[i]);
+    }
+    if (ws->has_mont) {
+        mont_clear(&ws->mont);
+    }
+    free(ws->res);
+    free(ws->composite);
+}
+
+// Returns the 64 bits of x starting at bit shift.
+// IN: x (number), shift (lowest bit returned)
+// OUT: uint64_t (x >> shift, truncated to 64 bits)
+static uint64_t top_bits(mpz_t x, mp_bitcnt_t shift) {
+    size_t i = shift / GMP_NUMB_BITS;
+    unsigned got = GMP_NUMB_BITS - shift % GMP_NUMB_BITS;
+    uint64_t v = (uint64_t) mpz_getlimbn(x, i) >> (shift % GMP_NUMB_BITS);
+    while (got < 64 && ++i < mpz_size(x)) {
+        v |= (uint64_t) mpz_getlimbn(x, i) << got;
+        got += GMP_NUMB_BITS;
+    }
+    return v;
+}
+
+// Computes r = a * x + b * y for single-word signed cofactors a and b. r must not alias x or y.
+// IN: r (result), x y (numbers), a b (cofactors)
+// OUT: r (linear combination)
+static void combine(mpz_t r, mpz_t x, int64_t a, mpz_t y, int64_t b) {
+    mpz_mul_ui(r, x, (unsigned long) (a < 0 ? -a : a));
+    if (a < 0) {
+        mpz_neg(r, r);
+    }
+    if (b < 0) {
+        mpz_submul_ui(r, y, (unsigned long) -b);
+    } else {
+        mpz_addmul_ui(r, y, (unsigned long) b);
+    }
+}
+
+// Bits of the leading words Lehmer's algorithm works on, leaving headroom for the cofactors in an int64_t.
+#define LEHMER_BITS 62
+
+// Runs Euclid's algorithm on u >= v >= 0 until v is 0, leaving the gcd in u, with Lehmer's speedup
+// (Knuth, TAOCP vol. 2, 4.5.2 algorithm L): the quotients are found from the leading 62 bits of u and v
+// while both bounds on them agree, and the whole run is applied to the full numbers as one 2x2 matrix of
+// single-word cofactors. Once u fits in a word, the rest runs on machine words. When s is not NULL, the
+// cofactors s and s2 of u and v are carried along, so that s ends as the cofactor of the gcd.
+// Uses ws->r[0..1] as scratch, so none of the arguments may be those registers.
+// IN: ws (workspace), u v (numbers), s s2 (cofactors of u and v, or NULL)
+// OUT: u (gcd), v (0), s (cofactor of the gcd)
+static void lehmer_ws(numtheory_ws *ws, mpz_t u, mpz_t v, mpz_t s, mpz_t s2) {
+    mpz_ptr t = ws->r[0], w = ws->r[1];
+    while (mpz_sgn(v) != 0) {
+        size_t bits = mpz_sizeinbase(u, 2);
+        if (bits <= LEHMER_BITS) {
+            // the numbers fit in words, so finish there and only apply the cofactor of the gcd
+            uint64_t a = mpz_get_ui(u), b = mpz_get_ui(v);
+            int64_t x = 1, y = 0, x2 = 0, y2 = 1;
+            while (b != 0) {
+                uint64_t q = a / b, r = a - q * b;
+                int64_t tx = x - (int64_t) q * x2, ty = y - (int64_t) q * y2;
+                a = b;
+                b = r;
+                x = x2;
+                y = y2;
+                x2 = tx;
+                y2 = ty;
+            }
+            if (s != NULL) {
+                combine(t, s, x, s2, y);
+                mpz_swap(s, t);
+            }
+            mpz_set_ui(u, a);
+            mpz_set_ui(v, 0);
+            return;
+        }
+
+        mp_bitcnt_t shift = bits - LEHMER_BITS;
+        int64_t uh = (int64_t) top_bits(u, shift), vh = (int64_t) top_bits(v, shift);
+        int64_t a = 1, b = 0, c = 0, d = 1;
+        while (vh + c != 0 && vh + d != 0) {
+            // the quotient of the leading words is only trusted when both bounds on it agree
+            int64_t q = (uh + a) / (vh + c);
+            if (q != (uh + b) / (vh + d)) {
+                break;
+            }
+            int64_t tmp = a - q * c;
+            a = c;
+            c = tmp;
+            tmp = b - q * d;
+            b = d;
+            d = tmp;
+            tmp = uh - q * vh;
+            uh = vh;
+            vh = tmp;
+        }
 
-        mpz_t r_temp, r_prime_temp, t_temp, t_prime_temp;
-        mpz_inits(r_temp, r_prime_temp, t_temp, t_prime_temp, NULL);
+        if (b == 0) {
+            // not even one quotient was certain, so take a full division step
+            mpz_fdiv_qr(w, t, u, v);
+            mpz_swap(u, v);
+            mpz_swap(v, t);
+            if (s != NULL) {
+                mpz_submul(s, w, s2);
+                mpz_swap(s, s2);
+            }
+            continue;
+        }
+        combine(t, u, a, v, b);
+        combine(w, u, c, v, d);
+        mpz_swap(u, t);
+        mpz_swap(v, w);
+        if (s != NULL) {
+            combine(t, s, a, s2, b);
+            combine(w, s, c, s2, d);
+            mpz_swap(s, t);
+            mpz_swap(s2, w);
+        }
+    }
+}
 
-        mpz_set(r_temp, r_prime);
-        mpz_mul(r_prime_temp, q, r_prime);
-        mpz_sub(r_prime_temp, r, r_prime_temp);
-        mpz_set(r, r_temp);
-        mpz_set(r_prime, r_prime_temp);
+// Computes the greatest common divisor of a and b, storing the value of the computed divisor in d
+// IN: ws (workspace), a, b (dividents), d (divisor)
+// OUT: d (divisor)
+void gcd_ws(numtheory_ws *ws, mpz_t d, mpz_t a, mpz_t b) {
+    //work on workspace registers so as not to modify d, a, or b
+    mpz_ptr u = ws->r[2], v = ws->r[3];
 
-        mpz_set(t_temp, t_prime);
-        mpz_mul(t_prime_temp, q, t_prime);
-        mpz_sub(t_prime_temp, t, t_prime_temp);
-        mpz_set(t, t_temp);
-        mpz_set(t_prime, t_prime_temp);
-        mpz_clears(r_temp, r_prime_temp, t_temp, t_prime_temp, NULL);
+    mpz_abs(u, a);
+    mpz_abs(v, b);
+    if (mpz_cmp(u, v) < 0) {
+        mpz_swap(u, v);
     }
+    lehmer_ws(ws, u, v, NULL, NULL);
+
+    mpz_set(d, u);
+}
+
+// Computes the greatest common divisor of a and b, storing the value of the computed divisor in d
+// IN: a, b (dividents), d (divisor)
+// OUT: d (divisor)
+void gcd(mpz_t d, mpz_t a, mpz_t b) {
+    numtheory_ws ws;
+    ws_init_parts(&ws, mpz_sizeinbase(a, 2) + mpz_sizeinbase(b, 2), 4, false, false);
+    gcd_ws(&ws, d, a, b);
+    numtheory_ws_clear(&ws);
+}
+
+// Computes the inverse i of a modulo n. In the event that a modular inverse cannot be found, set i to 0.
+// Runs the extended Euclidean algorithm on n and a mod n with Lehmer's speedup, tracking only the
+// cofactor of a.
+// IN: ws (workspace), i (inverse) of  a (mod left side) and b (mod right side)
+// OUT: i (inverse)
+void mod_inverse_ws(numtheory_ws *ws, mpz_t i, mpz_t a, mpz_t n) {
+    mpz_ptr r = ws->r[2], r_prime = ws->r[3], t = ws->r[4], t_prime = ws->r[5];
+    mpz_set(r, n);
+    mpz_mod(r_prime, a, n);
+    mpz_set_ui(t, 0);
+    mpz_set_ui(t_prime, 1);
+    lehmer_ws(ws, r, r_prime, t, t_prime);
 
     if (mpz_cmp_ui(r, 1) > 0) {
         mpz_set_ui(i, 0);
-        mpz_clears(r, r_prime, t, t_prime, q, NULL);
         return;
     }
 
@@ -65,14 +247,23 @@ void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
     }
 
     mpz_set(i, t);
-    mpz_clears(r, r_prime, t, t_prime, q, NULL);
 }
 
-// First* function that performs fast modular exponentiation, computing base raised to the exponent power modulo modulus, and storing the computed result in out.
+// Computes the inverse i of a modulo n. In the event that a modular inverse cannot be found, set i to 0.
+// IN: i (inverse) of  a (mod left side) and b (mod right side)
+// OUT: i (inverse)
+void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
+    numtheory_ws ws;
+    ws_init_parts(&ws, mpz_sizeinbase(a, 2) + mpz_sizeinbase(n, 2), 6, false, false);
+    mod_inverse_ws(&ws, i, a, n);
+    numtheory_ws_clear(&ws);
+}
+
+// Textbook right-to-left square-and-multiply, computing base raised to the exponent power modulo modulus and storing the result in out.
+// Kept as a reference for pow_mod; every step does a full mpz_mod division.
 // IN: out (output), base (number raised), exponent (base raised to this power), modulus (base mod)
 // OUT: out (output of modular exponentiation)
-// * two seperate functions, as this one causes keygen.c to enter an infinite loop, but works with encrypt and decrypt (does not modify exponent)
-void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
+void pow_mod_basic(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
     mpz_t v, p, temp_exponent;
     mpz_inits(v, p, temp_exponent, NULL);
 
@@ -80,7 +271,7 @@ void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
     mpz_set_ui(v, 1); // step 1
     mpz_set(p, base); //step 2
     while (mpz_cmp_ui(temp_exponent, 0) > 0) { //step 3
-        if (mpz_odd_p(temp_exponent) > 0 != 0) { //step 4
+        if (mpz_odd_p(temp_exponent) != 0) { //step 4
             mpz_mul(v, v, p); //step 5
             mpz_mod(v, v, modulus);
         }
@@ -93,122 +284,797 @@ void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
     mpz_clears(v, p, temp_exponent, NULL);
 }
 
-// Second* function that performs fast modular exponentiation, computing base raised to the exponent power modulo modulus,and storing the computed result in out.
+// Allocates a Montgomery context with its variables sized for moduli of up to bits / 2 bits; mont_set picks the modulus.
+// IN: mc (context), bits (capacity of each variable)
+// OUT: mc (allocated context)
+void mont_init2(mont_ctx *mc, mp_bitcnt_t bits) {
+    mpz_init2(mc->n, bits / 2);
+    mpz_init2(mc->t, bits);
+    mpz_init2(mc->u, bits);
+    mpz_init2(mc->acc, bits);
+    mpz_init2(mc->sq, bits);
+    for (int i = 0; i < MONT_TABLE_SIZE; i++) {
+        mpz_init2(mc->table[i], bits);
+    }
+    mc->odd = false;
+}
+
+// Points a Montgomery context at modulus n. For an odd modulus R = 2^rbits with rbits a whole number of limbs,
+// so reductions only need single-limb multiply-adds; an even modulus falls back to plain division.
+// IN: mc (context), n (modulus)
+// OUT: mc (context for n)
+void mont_set(mont_ctx *mc, mpz_t n) {
+    mpz_set(mc->n, n);
+    mc->odd = mpz_odd_p(n) != 0 && mpz_cmp_ui(n, 1) > 0;
+    mc->fixed = false;
+    mc->limbs = mpz_size(n);
+    mc->rbits = mc->limbs * GMP_NUMB_BITS;
+    if (!mc->odd) {
+        return;
+    }
+    // ninv = -n^-1 mod 2^GMP_NUMB_BITS, by Newton iteration on the lowest limb
+    mp_limb_t n0 = mpz_getlimbn(n, 0);
+    mp_limb_t inv = n0; // correct to 3 bits for any odd n0
+    for (int i = 0; i < 6; i++) {
+        inv *= 2 - n0 * inv;
+    }
+    mc->ninv = -inv;
+}
+
+// Prepares a Montgomery context for modulus n.
+// IN: mc (context), n (modulus)
+// OUT: mc (initialized context)
+void mont_init(mont_ctx *mc, mpz_t n) {
+    mont_init2(mc, 2 * mpz_sizeinbase(n, 2) + 2 * GMP_NUMB_BITS);
+    mont_set(mc, n);
+}
+
+// Clears the memory used by a Montgomery context.
+// IN: mc (context)
+// OUT: N/A
+void mont_clear(mont_ctx *mc) {
+    mpz_clears(mc->n, mc->t, mc->u, mc->acc, mc->sq, NULL);
+    for (int i = 0; i < MONT_TABLE_SIZE; i++) {
+        mpz_clear(mc->table[i]);
+    }
+}
+
+// Montgomery reduction: replaces t (0 <= t < n * R) with t * R^-1 mod n, one limb of t at a time.
+// IN: mc (context), t (value to reduce)
+// OUT: t (reduced value)
+static void mont_redc(mont_ctx *mc, mpz_t t) {
+    if (!mc->odd) {
+        mpz_mod(t, t, mc->n);
+        return;
+    }
+    size_t nl = mc->limbs;
+    size_t tl = mpz_size(t);
+    const mp_limb_t *np = mpz_limbs_read(mc->n);
+    mp_limb_t *tp = mpz_limbs_modify(t, 2 * nl);
+    for (size_t i = tl; i < 2 * nl; i++) {
+        tp[i] = 0;
+    }
+    // clear the low limbs one at a time, parking each carry in the limb just cleared
+    for (size_t i = 0; i < nl; i++) {
+        mp_limb_t q = tp[i] * mc->ninv;
+        tp[i] = mpn_addmul_1(tp + i, np, nl, q);
+    }
+    // t / R = high half + parked carries, which is below 2n
+    mp_limb_t carry = mpn_add_n(tp, tp + nl, tp, nl);
+    if (carry != 0 || mpn_cmp(tp, np, nl) >= 0) {
+        mpn_sub_n(tp, tp, np, nl);
+    }
+    mpz_limbs_finish(t, nl);
+}
+
+// Montgomery multiplication: out = a * b * R^-1 mod n. out may alias a or b.
+// IN: mc (context), out (product), a b (factors in Montgomery form)
+// OUT: out (product in Montgomery form)
+static void mont_mul(mont_ctx *mc, mpz_t out, mpz_t a, mpz_t b) {
+    if (a == b) {
+        mpz_mul(mc->t, a, a);
+    } else {
+        mpz_mul(mc->t, a, b);
+    }
+    mont_redc(mc, mc->t);
+    mpz_swap(out, mc->t);
+}
+
+// Converts a into Montgomery form: out = a * R mod n.
+// IN: mc (context), out (converted value), a (value)
+// OUT: out (a in Montgomery form)
+static void mont_to(mont_ctx *mc, mpz_t out, mpz_t a) {
+    if (!mc->odd) {
+        mpz_mod(out, a, mc->n);
+        return;
+    }
+    mpz_mul_2exp(out, a, mc->rbits);
+    mpz_mod(out, out, mc->n);
+}
+
+// Picks the sliding window width for an exponent of the given number of bits.
+// IN: bits (exponent size)
+// OUT: int (window width, at most MONT_WINDOW_MAX)
+int mont_window(size_t bits) {
+    if (bits > 671) {
+        return 6;
+    }
+    if (bits > 239) {
+        return 5;
+    }
+    if (bits > 79) {
+        return 4;
+    }
+    if (bits > 23) {
+        return 3;
+    }
+    return 1;
+}
+
+// Switches mont_pow on the context to the fixed-width mpn backend, if the modulus is odd and at most
+// MONT_FIXED_MAX_LIMBS limbs long. Repointing the context with mont_set switches it back.
+// IN: mc (context)
+// OUT: bool (whether the fixed-width backend is in use)
+bool mont_use_fixed(mont_ctx *mc) {
+    mc->fixed = mc->odd && mc->limbs <= MONT_FIXED_MAX_LIMBS;
+    return mc->fixed;
+}
+
+// Copies the value of a into nl limbs at rp, padding with zero limbs. a must fit in nl limbs.
+// IN: rp (destination), a (value), nl (width in limbs)
+// OUT: rp (limbs of a)
+static inline void fixed_load(mp_limb_t *rp, mpz_t a, size_t nl) {
+    size_t al = mpz_size(a);
+    mpn_copyi(rp, mpz_limbs_read(a), al);
+    for (size_t i = al; i < nl; i++) {
+        rp[i] = 0;
+    }
+}
+
+// Montgomery reduction on limb arrays: rp = tp * R^-1 mod n for the 2 * nl limbs at tp, which are overwritten.
+// IN: rp (result, nl limbs), tp (value below n * R), np (modulus), ninv (-n^-1 mod 2^GMP_NUMB_BITS), nl (width)
+// OUT: rp (reduced value)
+static inline __attribute__((always_inline)) void fixed_redc(
+    mp_limb_t *rp, mp_limb_t *tp, const mp_limb_t *np, mp_limb_t ninv, size_t nl) {
+    for (size_t i = 0; i < nl; i++) {
+        mp_limb_t q = tp[i] * ninv;
+        tp[i] = mpn_addmul_1(tp + i, np, nl, q);
+    }
+    mp_limb_t carry = mpn_add_n(rp, tp + nl, tp, nl);
+    if (carry != 0 || mpn_cmp(rp, np, nl) >= 0) {
+        mpn_sub_n(rp, rp, np, nl);
+    }
+}
+
+// Montgomery multiplication on limb arrays: rp = ap * bp * R^-1 mod n. rp may alias ap or bp.
+// IN: rp (product), ap bp (factors in Montgomery form), tp (scratch of 2 * nl limbs), np ninv nl (as for fixed_redc)
+// OUT: rp (product in Montgomery form)
+static inline __attribute__((always_inline)) void fixed_mul(mp_limb_t *rp, const mp_limb_t *ap,
+    const mp_limb_t *bp, mp_limb_t *tp, const mp_limb_t *np, mp_limb_t ninv, size_t nl) {
+    if (ap == bp) {
+        mpn_sqr(tp, ap, nl);
+    } else {
+        mpn_mul_n(tp, ap, bp, nl);
+    }
+    fixed_redc(rp, tp, np, ninv, nl);
+}
+
+// The body of mont_pow on the fixed-width backend: the same sliding window, with the table, the running product
+// and the scratch product in stack arrays instead of mpz_t variables. Inlined into callers passing a constant nl,
+// so each width gets its own copy.
+// IN: mc (context with a modulus of nl limbs), out (output), base (number raised), exponent (positive power)
+// OUT: out (output of modular exponentiation)
+static inline __attribute__((always_inline)) void fixed_pow(
+    mont_ctx *mc, mpz_t out, mpz_t base, mpz_t exponent, size_t nl) {
+    mp_limb_t table[MONT_TABLE_SIZE][MONT_FIXED_MAX_LIMBS];
+    mp_limb_t acc[MONT_FIXED_MAX_LIMBS], sq[MONT_FIXED_MAX_LIMBS];
+    mp_limb_t t[2 * MONT_FIXED_MAX_LIMBS];
+    const mp_limb_t *np = mpz_limbs_read(mc->n);
+    mp_limb_t ninv = mc->ninv;
+
+    size_t bits = mpz_sizeinbase(exponent, 2);
+    int w = mont_window(bits);
+    int entries = 1 << (w - 1);
+
+    // table[k] = base^(2k+1) in Montgomery form
+    mpz_mod(mc->u, base, mc->n);
+    mont_to(mc, mc->t, mc->u);
+    fixed_load(table[0], mc->t, nl);
+    if (entries > 1) {
+        fixed_mul(sq, table[0], table[0], t, np, ninv, nl);
+        for (int k = 1; k < entries; k++) {
+            fixed_mul(table[k], table[k - 1], sq, t, np, ninv, nl);
+        }
+    }
+
+    bool started = false;
+    int64_t i = (int64_t) bits - 1;
+    while (i >= 0) {
+        if (mpz_tstbit(exponent, i) == 0) {
+            fixed_mul(acc, acc, acc, t, np, ninv, nl);
+            i--;
+            continue;
+        }
+        // longest window of at most w bits ending in a set bit
+        int64_t low = i - w + 1 > 0 ? i - w + 1 : 0;
+        while (mpz_tstbit(exponent, low) == 0) {
+            low++;
+        }
+        uint64_t value = 0;
+        for (int64_t k = i; k >= low; k--) {
+            value = (value << 1) | mpz_tstbit(exponent, k);
+        }
+        if (started) {
+            for (int64_t k = i; k >= low; k--) {
+                fixed_mul(acc, acc, acc, t, np, ninv, nl);
+            }
+            fixed_mul(acc, acc, table[value >> 1], t, np, ninv, nl);
+        } else {
+            mpn_copyi(acc, table[value >> 1], nl);
+            started = true;
+        }
+        i = low - 1;
+    }
+
+    // leave Montgomery form
+    mpn_copyi(t, acc, nl);
+    mpn_zero(t + nl, nl);
+    fixed_redc(acc, t, np, ninv, nl);
+    mpn_copyi(mpz_limbs_write(out, nl), acc, nl);
+    mpz_limbs_finish(out, nl);
+}
+
+// Runs mont_pow on the fixed-width backend, through the copy specialized for the modulus width when there is one.
+// IN: mc (context with the fixed-width backend), out (output), base (number raised), exponent (positive power)
+// OUT: out (output of modular exponentiation)
+static void mont_pow_fixed(mont_ctx *mc, mpz_t out, mpz_t base, mpz_t exponent) {
+    switch (mc->limbs) {
+    case 8: fixed_pow(mc, out, base, exponent, 8); break;
+    case 16: fixed_pow(mc, out, base, exponent, 16); break;
+    case 24: fixed_pow(mc, out, base, exponent, 24); break;
+    case 32: fixed_pow(mc, out, base, exponent, 32); break;
+    case 48: fixed_pow(mc, out, base, exponent, 48); break;
+    case 64: fixed_pow(mc, out, base, exponent, 64); break;
+    default: fixed_pow(mc, out, base, exponent, mc->limbs); break;
+    }
+}
+
+// Computes base raised to the exponent power modulo the context's modulus with a left-to-right sliding window
+// over a table of the odd powers base^1, base^3, ..., base^(2^w - 1) kept in Montgomery form.
+// IN: mc (context), out (output), base (number raised), exponent (non-negative power)
+// OUT: out (output of modular exponentiation)
+void mont_pow(mont_ctx *mc, mpz_t out, mpz_t base, mpz_t exponent) {
+    if (mpz_sgn(exponent) <= 0) {
+        mpz_set_ui(out, 1);
+        mpz_mod(out, out, mc->n);
+        return;
+    }
+    if (mc->fixed) {
+        mont_pow_fixed(mc, out, base, exponent);
+        return;
+    }
+    size_t bits = mpz_sizeinbase(exponent, 2);
+    int w = mont_window(bits);
+    int entries = 1 << (w - 1);
+
+    // table[k] = base^(2k+1) in Montgomery form
+    mpz_mod(mc->u, base, mc->n);
+    mont_to(mc, mc->table[0], mc->u);
+    if (entries > 1) {
+        mont_mul(mc, mc->sq, mc->table[0], mc->table[0]);
+        for (int k = 1; k < entries; k++) {
+            mont_mul(mc, mc->table[k], mc->table[k - 1], mc->sq);
+        }
+    }
+
+    mpz_ptr acc = mc->acc;
+    bool started = false;
+    int64_t i = (int64_t) bits - 1;
+    while (i >= 0) {
+        if (mpz_tstbit(exponent, i) == 0) {
+            mont_mul(mc, acc, acc, acc);
+            i--;
+            continue;
+        }
+        // longest window of at most w bits ending in a set bit
+        int64_t low = i - w + 1 > 0 ? i - w + 1 : 0;
+        while (mpz_tstbit(exponent, low) == 0) {
+            low++;
+        }
+        uint64_t value = 0;
+        for (int64_t k = i; k >= low; k--) {
+            value = (value << 1) | mpz_tstbit(exponent, k);
+        }
+        if (started) {
+            for (int64_t k = i; k >= low; k--) {
+                mont_mul(mc, acc, acc, acc);
+            }
+            mont_mul(mc, acc, acc, mc->table[value >> 1]);
+        } else {
+            mpz_set(acc, mc->table[value >> 1]);
+            started = true;
+        }
+        i = low - 1;
+    }
+
+    mont_redc(mc, acc); // leave Montgomery form
+    mpz_set(out, acc);
+}
+
+// Performs fast modular exponentiation, computing base raised to the exponent power modulo modulus, and storing the computed result in out.
+// Uses Montgomery multiplication with a sliding window; the exponent is never modified.
+// IN: ws (workspace), out (output), base (number raised), exponent (base raised to this power), modulus (base mod)
+// OUT: out (output of modular exponentiation)
+void pow_mod_ws(numtheory_ws *ws, mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
+    mont_set(&ws->mont, modulus);
+    mont_pow(&ws->mont, out, base, exponent);
+}
+
+// Performs fast modular exponentiation, computing base raised to the exponent power modulo modulus, and storing the computed result in out.
 // IN: out (output), base (number raised), exponent (base raised to this power), modulus (base mod)
 // OUT: out (output of modular exponentiation)
-// * two seperate functions, as this one breaks encrypt and decrypt (naturally), but allows keygen.c to run somehow (DOES modify exponent)
-void pow_mod2(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
-    mpz_t v, p, temp_exponent;
-    mpz_inits(v, p, temp_exponent, NULL);
+void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
+    mont_ctx mc;
+    mont_init(&mc, modulus);
+    mont_pow(&mc, out, base, exponent);
+    mont_clear(&mc);
+}
 
-    mpz_set(temp_exponent, exponent);
-    mpz_set_ui(v, 1); // step 1
-    mpz_set(p, base); //step 2
-    while (mpz_cmp_ui(exponent, 0) > 0) { //step 3
-        if (mpz_odd_p(exponent) != 0) { //step 4
-            mpz_mul(v, v, p); //step 5
-            mpz_mod(v, v, modulus);
+static bool bpsw = false;
+
+// Selects the primality test run by is_prime and the prime searches: Baillie-PSW followed by iters random
+// Miller-Rabin rounds, or (the default) iters random Miller-Rabin rounds alone. Set it before any search starts.
+// IN: enable (whether to use Baillie-PSW)
+// OUT: N/A
+void prime_test_bpsw(bool enable) {
+    bpsw = enable;
+}
+
+// Runs one Miller-Rabin round on n with witness a. Expects ws->r[0] = n - 1 = 2^s * ws->r[1] with ws->r[1] odd,
+// and ws->mont set to n.
+// IN: ws (workspace), n (number to test), a (witness), s (power of two in n - 1)
+// OUT: bool (false if a proves n composite)
+static bool mr_round(numtheory_ws *ws, mpz_t n, mpz_t a, mp_bitcnt_t s) {
+    mpz_ptr n_minus_1 = ws->r[0], r = ws->r[1], y = ws->r[3];
+    mont_ctx *mc = &ws->mont;
+    STAT_ADD(STAT_MR_ROUNDS, 1);
+
+    mont_pow(mc, y, a, r); //4
+
+    if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp(y, n_minus_1) != 0) { //5
+        mp_bitcnt_t j = 1; //6
+        while (j <= s - 1 && mpz_cmp(y, n_minus_1) != 0) { //7
+            mpz_mul(mc->t, y, y); //8
+            mpz_mod(y, mc->t, n);
+            if (mpz_cmp_ui(y, 1) == 0) { //9
+                return false; //10
+            }
+            j++; //11
         }
-        mpz_mul(p, p, p); //step 6
-        mpz_mod(p, p, modulus);
+        if (mpz_cmp(y, n_minus_1) != 0) { // 12
+            return false; //13
+        }
+    }
+    return true;
+}
 
-        mpz_div_ui(exponent, exponent, 2); // step 7
+// Halves x modulo the odd number n, for x in [0, n).
+// IN: x (number), n (modulus)
+// OUT: x (x / 2 mod n)
+static void half_mod(mpz_t x, mpz_t n) {
+    if (mpz_odd_p(x)) {
+        mpz_add(x, x, n);
     }
-    mpz_set(out, v); //step 8
-    mpz_clears(v, p, temp_exponent, NULL);
+    mpz_tdiv_q_2exp(x, x, 1);
+}
+
+// Strong Lucas probable-prime test of the odd number n > 3 with Selfridge's parameters: D is the first of
+// 5, -7, 9, -11, ... with Jacobi symbol (D/n) = -1, P = 1 and Q = (1 - D) / 4. Writing n + 1 = 2^s * d with d odd,
+// n passes if U_d = 0 or V_(d * 2^r) = 0 (mod n) for some r < s. Uses ws->r[0..4].
+// IN: ws (workspace), n (number to test)
+// OUT: bool (false if n is certainly composite)
+static bool strong_lucas(numtheory_ws *ws, mpz_t n) {
+    int64_t D = 5;
+    for (;;) {
+        int j = mpz_si_kronecker((long) D, n);
+        if (j == -1) {
+            break;
+        }
+        if (j == 0 && mpz_cmp_ui(n, (unsigned long) (D < 0 ? -D : D)) != 0) {
+            return false; // |D| is a proper factor
+        }
+        // no suitable D exists for a square, which would otherwise loop forever
+        if (D == 13 && mpz_perfect_square_p(n)) {
+            return false;
+        }
+        D = D > 0 ? -(D + 2) : -D + 2;
+    }
+
+    mpz_ptr d = ws->r[0], u = ws->r[1], v = ws->r[2], qk = ws->r[3], q = ws->r[4];
+    mpz_ptr t = ws->mont.t, t2 = ws->mont.u;
+    mpz_add_ui(d, n, 1);
+    mp_bitcnt_t s = mpz_scan1(d, 0);
+    mpz_tdiv_q_2exp(d, d, s);
+    mpz_set_si(q, (1 - D) / 4);
+    mpz_mod(q, q, n);
+
+    // U_1 = 1, V_1 = P = 1, Q^1, then left to right over the bits of d
+    mpz_set_ui(u, 1);
+    mpz_set_ui(v, 1);
+    mpz_set(qk, q);
+    for (int64_t i = (int64_t) mpz_sizeinbase(d, 2) - 2; i >= 0; i--) {
+        // k -> 2k: U_2k = U_k V_k, V_2k = V_k^2 - 2 Q^k
+        mpz_mul(t, u, v);
+        mpz_mod(u, t, n);
+        mpz_mul(t, v, v);
+        mpz_submul_ui(t, qk, 2);
+        mpz_mod(v, t, n);
+        mpz_mul(t, qk, qk);
+        mpz_mod(qk, t, n);
+        if (mpz_tstbit(d, i)) {
+            // k -> k + 1: U_k+1 = (P U_k + V_k) / 2, V_k+1 = (D U_k + P V_k) / 2
+            mpz_add(t2, u, v);
+            mpz_mod(t2, t2, n);
+            mpz_mul_si(t, u, (long) D);
+            mpz_add(t, t, v);
+            mpz_mod(v, t, n);
+            half_mod(v, n);
+            mpz_swap(u, t2);
+            half_mod(u, n);
+            mpz_mul(t, qk, q);
+            mpz_mod(qk, t, n);
+        }
+    }
+
+    if (mpz_sgn(u) == 0) {
+        return true;
+    }
+    for (mp_bitcnt_t r = 0; r < s; r++) {
+        if (mpz_sgn(v) == 0) {
+            return true;
+        }
+        mpz_mul(t, v, v);
+        mpz_submul_ui(t, qk, 2);
+        mpz_mod(v, t, n);
+        mpz_mul(t, qk, qk);
+        mpz_mod(qk, t, n);
+    }
+    return false;
 }
 
 // Conducts the Miller-Rabin primality test to indicate whether or not n is prime using iters number of Miller-Rabin iterations.
-// IN: n (number to test), iters (number of Miller-Rabin iterations to test)
+// With prime_test_bpsw enabled, n must first pass Baillie-PSW: a Miller-Rabin round with witness 2, which rejects
+// nearly every composite, and a strong Lucas test, run after the iters random rounds.
+// IN: ws (workspace), n (number to test), iters (number of Miller-Rabin iterations to test)
 // OUT: bool (whether or not the number in question is prime (generally))
-bool is_prime(mpz_t n, uint64_t iters) {
-    //2 is the only non-odd prime.
-    if (mpz_cmp_ui(n, 2) == 0) {
+bool is_prime_ws(numtheory_ws *ws, mpz_t n, uint64_t iters) {
+    //2 and 3 are the only primes too small to pick a witness for.
+    if (mpz_cmp_ui(n, 2) == 0 || mpz_cmp_ui(n, 3) == 0) {
         return true;
     }
-    //check if the number is divisible by 2 before step 1, if it's divisible by 2 then it's certainly not prime.
-    mpz_t temp;
-    mpz_init(temp);
-    mpz_mod_ui(temp, n, 2);
-    if (mpz_cmp_ui(temp, 0) == 0 || (mpz_cmp_ui(n, 1) <= 0)) {
-        mpz_clear(temp);
+    //if the number is divisible by 2 then it's certainly not prime.
+    if (mpz_even_p(n) || (mpz_cmp_ui(n, 1) <= 0)) {
         return false;
     }
-    mpz_clear(temp);
 
-    mpz_t s, sfrac, r, base, mod_temp;
-    mpz_inits(s, sfrac, r, base, mod_temp, NULL);
-    mpz_sub_ui(base, n, 1);
-    mpz_set_ui(sfrac, 2);
-    mpz_set_ui(s, 1);
+    //1: n - 1 = 2^s * r with r odd
+    mpz_ptr n_minus_1 = ws->r[0], r = ws->r[1], a = ws->r[2], range = ws->r[4];
+    mpz_sub_ui(n_minus_1, n, 1);
+    mp_bitcnt_t s = mpz_scan1(n_minus_1, 0);
+    mpz_tdiv_q_2exp(r, n_minus_1, s);
+    mpz_sub_ui(range, n, 3); // witnesses are drawn from [2, n - 2]
 
-    mpz_div(r, base, sfrac);
-    mpz_mod_ui(mod_temp, r, 2);
+    mont_set(&ws->mont, n);
+    if (bpsw) {
+        mpz_set_ui(a, 2);
+        if (!mr_round(ws, n, a, s)) {
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < iters; i++) { //2
+        mpz_urandomm(a, state, range); //3
+        mpz_add_ui(a, a, 2);
+        if (!mr_round(ws, n, a, s)) {
+            return false;
+        }
+    }
+    return !bpsw || strong_lucas(ws, n);
+}
 
-    while (mpz_cmp_ui(mod_temp, 0) == 0) {
-        mpz_mul_ui(sfrac, sfrac, 2);
-        mpz_add_ui(s, s, 1);
-        mpz_div(r, base, sfrac);
-        mpz_mod_ui(mod_temp, r, 2);
+// Conducts the Miller-Rabin primality test to indicate whether or not n is prime using iters number of Miller-Rabin iterations.
+// IN: n (number to test), iters (number of Miller-Rabin iterations to test)
+// OUT: bool (whether or not the number in question is prime (generally))
+bool is_prime(mpz_t n, uint64_t iters) {
+    numtheory_ws ws;
+    ws_init_parts(&ws, mpz_sizeinbase(n, 2), 5, true, false);
+    bool prime = is_prime_ws(&ws, n, iters);
+    numtheory_ws_clear(&ws);
+    return prime;
+}
+
+static uint32_t small_primes[SIEVE_PRIMES];
+static pthread_once_t small_primes_once = PTHREAD_ONCE_INIT;
+
+// Fills small_primes with the first SIEVE_PRIMES odd primes using the sieve of Eratosthenes.
+// IN: N/A
+// OUT: small_primes (table of odd primes)
+static void small_primes_init(void) {
+    uint32_t limit = 32768; // more than enough to hold SIEVE_PRIMES primes
+    uint8_t *composite = (uint8_t *) calloc(limit, sizeof(uint8_t));
+    uint32_t count = 0;
+    for (uint32_t i = 3; i < limit && count < SIEVE_PRIMES; i += 2) {
+        if (composite[i]) {
+            continue;
+        }
+        small_primes[count++] = i;
+        for (uint32_t j = i * i; j < limit; j += 2 * i) {
+            composite[j] = 1;
+        }
+    }
+    free(composite);
+}
+
+// Marks the candidates base + 2k, 0 <= k < SIEVE_WINDOW, that have a small prime factor.
+// IN: res (base mod each small prime), composite (window bitmap)
+// OUT: composite (1 for every candidate divisible by a small prime)
+static void sieve_window(const uint32_t *res, uint8_t *composite) {
+    memset(composite, 0, SIEVE_WINDOW);
+    for (uint32_t i = 0; i < SIEVE_PRIMES; i++) {
+        uint32_t sp = small_primes[i];
+        // first k with base + 2k = 0 (mod sp): k = -res * 2^-1 (mod sp)
+        uint64_t k = (uint64_t) ((sp - res[i]) % sp) * ((sp + 1) / 2) % sp;
+        for (; k < SIEVE_WINDOW; k += sp) {
+            composite[k] = 1;
+        }
+    }
+}
+
+// Draws a random odd number of exactly bits bits with the top two bits set, so that the product of two such
+// numbers has exactly the sum of their widths.
+// IN: out (random number), bits (width, at least 2)
+// OUT: out (random number)
+static void random_candidate(mpz_t out, uint64_t bits) {
+    mpz_urandomb(out, state, bits);
+    mpz_setbit(out, bits - 1);
+    mpz_setbit(out, bits - 2);
+    mpz_setbit(out, 0);
+}
+
+// Tests the unsieved candidates of one window in order, stopping at the first prime.
+// The search is abandoned as soon as *best drops below window, meaning an earlier window already holds a prime.
+// IN: ws (workspace), out (prime found), start (first candidate of the window), res (start mod each small prime),
+//     bits (prime width), iters (num Miller-Rabin iterations), best (lowest window with a prime, may be NULL),
+//     window (number of this window)
+// OUT: out (prime found), int (1 if found, 0 if not, -1 if the window runs past 'bits' bits first)
+static int search_window(numtheory_ws *ws, mpz_t out, mpz_t start, const uint32_t *res, uint64_t bits,
+    uint64_t iters, _Atomic uint64_t *best, uint64_t window) {
+    sieve_window(res, ws->composite);
+    for (uint64_t k = 0; k < SIEVE_WINDOW; k++) {
+        if (ws->composite[k]) {
+            continue;
+        }
+        mpz_add_ui(out, start, 2 * k);
+        if (mpz_sizeinbase(out, 2) != bits) {
+            return -1;
+        }
+        if (best != NULL && atomic_load(best) < window) {
+            return 0;
+        }
+        STAT_ADD(STAT_CANDIDATES, 1);
+        if (is_prime_ws(ws, out, iters)) {
+            return 1;
+        }
     }
-    //1
-    mpz_clears(sfrac, base, mod_temp, NULL);
+    return 0;
+}
 
-    for (uint32_t i = 0; i < iters; i++) { //2
+// Generates a new prime number stored in p of exactly 'bits' bits, using iters for prime testing
+// Starting from a random odd base, windows of SIEVE_WINDOW odd candidates are sieved against the small prime table;
+// the residues of the base are stepped along with the window, and only the survivors go to Miller-Rabin.
+// IN: ws (workspace), p (prime stored), bits (number of bits of prime generated), iters (num Miller-Rabin iterations)
+// OUT: p (new prime)
+void make_prime_ws(numtheory_ws *ws, mpz_t p, uint64_t bits, uint64_t iters) {
+    if (bits < 2) {
+        bits = 2;
+    }
+    mpz_ptr candidate = ws->r[5], base = ws->r[6];
 
-        // 3
-        mpz_t a, y;
-        mpz_inits(a, y, NULL);
-        //printf("aa\n"); infinite loop from pow_mod
+    // too narrow for the sieve to be worth it, or for small primes to be ruled out as factors of candidates
+    if (bits < SIEVE_MIN_BITS) {
         do {
-            mpz_urandomm(a, state, n);
-        } while (mpz_cmp_ui(a, 2) < 0 || mpz_cmp(a, n) > 0);
-
-        pow_mod2(y, a, r, n); //4
-
-        if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp_ui(y, mpz_get_ui(n) - 1) != 0) { //5
-            mpz_t j;
-            mpz_init(j);
-            mpz_set_ui(j, 1); //6
-
-            while (mpz_cmp_ui(j, mpz_get_ui(s) - 1) <= 0
-                   && mpz_cmp_ui(y, mpz_get_ui(n) - 1) != 0) { //7
-                mpz_t
-                    two_temp; // must create temporary mpz variable two, as pow_mod takes in mpz_t, not uint
-                mpz_init(two_temp);
-                mpz_set_ui(two_temp, 2);
-                pow_mod2(y, y, two_temp, n); //8
-                mpz_clear(two_temp);
-                if (mpz_cmp_ui(y, 1) == 0) { //9
-                    mpz_clears(s, r, a, y, j, NULL);
-                    return false; //10
-                }
-                mpz_add_ui(j, j, 1); //11
-            }
-            if (mpz_cmp_ui(y, mpz_get_ui(n) - 1) != 0) { // 12
-                mpz_clears(s, r, a, y, j, NULL);
-                return false; //13
+            mpz_urandomb(candidate, state, bits - 1);
+            mpz_setbit(candidate, bits - 1);
+            STAT_ADD(STAT_CANDIDATES, 1);
+        } while (!is_prime_ws(ws, candidate, iters));
+        mpz_set(p, candidate);
+        return;
+    }
+
+    pthread_once(&small_primes_once, small_primes_init);
+    uint32_t *res = ws->res;
+    int found = -1;
+    while (found != 1) {
+        random_candidate(base, bits);
+        for (uint32_t i = 0; i < SIEVE_PRIMES; i++) {
+            res[i] = mpz_fdiv_ui(base, small_primes[i]);
+        }
+        // walk windows until a prime turns up or the search runs past 'bits' bits
+        while ((found = search_window(ws, candidate, base, res, bits, iters, NULL, 0)) == 0) {
+            mpz_add_ui(base, base, 2 * SIEVE_WINDOW);
+            for (uint32_t i = 0; i < SIEVE_PRIMES; i++) {
+                res[i] = (res[i] + 2 * SIEVE_WINDOW) % small_primes[i];
             }
-            mpz_clear(j);
         }
-        mpz_clears(a, y, NULL);
     }
-    mpz_clears(s, r, NULL);
-    return true;
+    mpz_set(p, candidate);
 }
 
-// Generates a new prime number stored in p of at least 'bits' bits, using iters for prime testing
-// IN: p (prime stored), bits (min number of bits of prime generated), iters (num Miller-Rabin iterations)
+// Generates a new prime number stored in p of exactly 'bits' bits, using iters for prime testing
+// IN: p (prime stored), bits (number of bits of prime generated), iters (num Miller-Rabin iterations)
 // OUT: p (new prime)
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-    mpz_t randomNum;
-    mpz_init(randomNum);
-    mpz_urandomb(randomNum, state, bits);
+    numtheory_ws ws;
+    ws_init_parts(&ws, bits, WS_REGS, true, bits >= SIEVE_MIN_BITS);
+    make_prime_ws(&ws, p, bits, iters);
+    numtheory_ws_clear(&ws);
+}
+
+// One prime being searched for by make_primes.
+typedef struct {
+    uint64_t bits;
+    mpz_t base; // first candidate of window 0
+    uint32_t *res; // base mod each small prime
+    _Atomic uint64_t best; // lowest window known to hold a prime, or UINT64_MAX
+    uint64_t overflow; // lowest window known to run past 'bits' bits, or UINT64_MAX
+    mpz_t prime; // first prime of window 'best'
+} PrimeSlot;
+
+// Search shared by the make_primes workers. Windows are handed out round-robin over the slots in increasing order.
+typedef struct {
+    PrimeSlot *slots;
+    uint32_t count;
+    uint64_t iters;
+    uint64_t next; // next window to hand out: slot next % count, window next / count
+    uint64_t stream; // random stream number of the first worker
+    pthread_mutex_t lock;
+} PrimeSearch;
+
+// Returns the lowest window of slot that decides its outcome.
+// IN: slot (prime slot)
+// OUT: uint64_t (window holding the prime or running out of bits, UINT64_MAX while unknown)
+static uint64_t slot_limit(PrimeSlot *slot) {
+    return slot->best < slot->overflow ? slot->best : slot->overflow;
+}
+
+// make_primes worker: claims windows until every slot is decided below the windows still to be handed out.
+// Windows past a slot's decided window are skipped, which is the cancellation once a prime is found.
+// IN: arg (PrimeSearch), index (worker item), worker (thread id)
+// OUT: search slots (updated best windows and primes)
+static void prime_worker(void *arg, uint64_t index, uint32_t worker) {
+    (void) worker;
+    PrimeSearch *ps = (PrimeSearch *) arg;
+    randstate_init_stream(ps->stream + index);
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < ps->count; i++) {
+        bits = ps->slots[i].bits > bits ? ps->slots[i].bits : bits;
+    }
+    numtheory_ws ws;
+    numtheory_ws_init(&ws, bits);
+    uint32_t *res = ws.res;
+    mpz_ptr candidate = ws.r[5], start = ws.r[6];
+
+    while (true) {
+        pthread_mutex_lock(&ps->lock);
+        uint64_t g = ps->next++;
+        uint64_t window = g / ps->count;
+        PrimeSlot *slot = &ps->slots[g % ps->count];
+        // slots too narrow to sieve were solved before the search and have no windows
+        bool done = true;
+        for (uint32_t i = 0; i < ps->count; i++) {
+            done = done && (ps->slots[i].res == NULL || slot_limit(&ps->slots[i]) < window);
+        }
+        bool skip = slot->res == NULL || slot_limit(slot) < window;
+        pthread_mutex_unlock(&ps->lock);
+        if (done) {
+            break;
+        }
+        if (skip) {
+            continue;
+        }
+
+        // residues of this window's start follow from the residues of the base
+        uint64_t offset = 2 * SIEVE_WINDOW * window;
+        mpz_add_ui(start, slot->base, offset);
+        for (uint32_t i = 0; i < SIEVE_PRIMES; i++) {
+            res[i] = (slot->res[i] + offset % small_primes[i]) % small_primes[i];
+        }
+        int found
+            = search_window(&ws, candidate, start, res, slot->bits, ps->iters, &slot->best, window);
+
+        pthread_mutex_lock(&ps->lock);
+        if (found == 1 && window < slot->best) {
+            slot->best = window;
+            mpz_set(slot->prime, candidate);
+        } else if (found == -1 && window < slot->overflow) {
+            slot->overflow = window;
+        }
+        pthread_mutex_unlock(&ps->lock);
+    }
 
-    while (is_prime(randomNum, iters) == false) {
-        mpz_urandomb(randomNum, state, bits);
+    numtheory_ws_clear(&ws);
+    randstate_clear();
+}
+
+// Generates count primes of the given widths at once, using threads workers that race through sieve windows.
+// The result for each prime is always the first prime after its random base, the same as a serial search,
+// so the primes only depend on the calling thread's random state and not on the number of threads.
+// IN: primes (primes stored), bits (width of each prime), count (number of primes), iters (num Miller-Rabin iterations),
+//     threads (worker threads, 0 or 1 searches on the calling thread)
+// OUT: primes (new primes)
+void make_primes(mpz_t *primes, const uint64_t *bits, uint32_t count, uint64_t iters, uint32_t threads) {
+    PrimeSlot *slots = (PrimeSlot *) calloc(count, sizeof(PrimeSlot));
+    bool pending = false;
+    for (uint32_t i = 0; i < count; i++) {
+        slots[i].bits = bits[i] < 2 ? 2 : bits[i];
+        if (slots[i].bits < SIEVE_MIN_BITS) {
+            make_prime(primes[i], slots[i].bits, iters);
+            slots[i].best = 0;
+            continue;
+        }
+        mpz_inits(slots[i].base, slots[i].prime, NULL);
+        slots[i].res = (uint32_t *) calloc(SIEVE_PRIMES, sizeof(uint32_t));
+        slots[i].best = UINT64_MAX;
+        pending = true;
+    }
+    pthread_once(&small_primes_once, small_primes_init);
+
+    Pool *pool = threads > 1 ? pool_create(threads) : NULL;
+    PrimeSearch ps = { slots, count, iters, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    while (pending) {
+        // fresh bases for every prime still missing, drawn in slot order from the caller's stream
+        for (uint32_t i = 0; i < count; i++) {
+            if (slots[i].best == UINT64_MAX) {
+                random_candidate(slots[i].base, slots[i].bits);
+                for (uint32_t j = 0; j < SIEVE_PRIMES; j++) {
+                    slots[i].res[j] = mpz_fdiv_ui(slots[i].base, small_primes[j]);
+                }
+                slots[i].overflow = UINT64_MAX;
+            }
+        }
+        ps.next = 0;
+        ps.stream = gmp_urandomb_ui(state, 32); // workers draw witnesses from streams ps.stream + i
+        if (pool != NULL) {
+            pool_run(pool, prime_worker, &ps, pool_threads(pool));
+        } else {
+            // the worker replaces this thread's state with its stream, so keep the caller's aside
+            gmp_randstate_t saved;
+            gmp_randinit_set(saved, state);
+            gmp_randclear(state);
+            prime_worker(&ps, 0, 0);
+            gmp_randinit_set(state, saved);
+            gmp_randclear(saved);
+        }
+        pending = false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (slots[i].bits < SIEVE_MIN_BITS) {
+                continue;
+            }
+            if (slots[i].best < slots[i].overflow) {
+                mpz_set(primes[i], slots[i].prime);
+            } else {
+                slots[i].best = UINT64_MAX; // search ran out of bits first, start over
+                pending = true;
+            }
+        }
+    }
+    pool_delete(&pool);
+    pthread_mutex_destroy(&ps.lock);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (slots[i].bits >= SIEVE_MIN_BITS) {
+            mpz_clears(slots[i].base, slots[i].prime, NULL);
+            free(slots[i].res);
+        }
     }
-    mpz_set(p, randomNum);
-    mpz_clear(randomNum);
-    return;
+    free(slots);
 }
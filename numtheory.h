@@ -5,12 +5,94 @@
 #include <stdio.h>
 #include <gmp.h>
 
+// make_prime sieves windows of SIEVE_WINDOW odd candidates against the first SIEVE_PRIMES odd primes.
+// Below SIEVE_MIN_BITS bits candidates are drawn directly, as they could be one of the sieving primes.
+#define SIEVE_PRIMES   2048
+#define SIEVE_WINDOW   128
+#define SIEVE_MIN_BITS 24
+
+// Largest sliding window width used by mont_pow and the size of its table of odd powers.
+#define MONT_WINDOW_MAX 6
+#define MONT_TABLE_SIZE (1 << (MONT_WINDOW_MAX - 1))
+
+// Moduli of up to MONT_FIXED_MAX_LIMBS limbs can use the fixed-width mpn backend of mont_pow, which keeps its
+// operands in limb arrays on the stack. Widths of 8, 16, 24, 32, 48 and 64 limbs (512 to 4096 bits, the moduli
+// of common key sizes and their CRT primes) each get a copy of the code specialized for that width.
+#define MONT_FIXED_MAX_LIMBS 64
+
+// Montgomery multiplication context for a fixed modulus n, with R = 2^rbits.
+typedef struct {
+    mpz_t n; // modulus
+    mp_limb_t ninv; // -n^-1 mod 2^GMP_NUMB_BITS
+    size_t limbs; // limbs in n
+    mp_bitcnt_t rbits; // R = 2^rbits, a whole number of limbs covering n
+    bool odd; // Montgomery reduction needs an odd modulus, otherwise plain division is used
+    bool fixed; // mont_pow runs on the fixed-width mpn backend (set by mont_use_fixed)
+    mpz_t t, u; // scratch for products and reductions
+    mpz_t acc, sq; // running product and squared base of mont_pow
+    mpz_t table[MONT_TABLE_SIZE]; // odd powers of the base for the sliding window
+} mont_ctx;
+
+// Number of scratch registers in a numtheory_ws. is_prime_ws uses r[0..4], make_prime_ws r[5..6],
+// gcd_ws r[0..3] and mod_inverse_ws r[0..5].
+#define WS_REGS 7
+
+// Preallocated scratch for the _ws number theory routines, so they do not touch the heap in steady state.
+// A workspace belongs to one thread at a time. numtheory_ws_init sets up every part; the one-shot wrappers
+// (gcd, is_prime, ...) set up only the registers and parts their routine uses.
+typedef struct {
+    mpz_t r[WS_REGS]; // scratch registers
+    int regs; // registers set up, r[0..regs - 1]
+    bool has_mont; // mont is set up
+    mont_ctx mont; // Montgomery context, repointed at each modulus
+    uint32_t *res; // residues of a sieve base mod each small prime, NULL if not set up
+    uint8_t *composite; // sieve window bitmap, NULL if not set up
+} numtheory_ws;
+
+void numtheory_count_allocs(bool enable);
+
+uint64_t numtheory_allocs(void);
+
+void numtheory_ws_init(numtheory_ws *ws, uint64_t bits);
+
+void numtheory_ws_clear(numtheory_ws *ws);
+
 void gcd(mpz_t d, mpz_t a, mpz_t b);
 
+void gcd_ws(numtheory_ws *ws, mpz_t d, mpz_t a, mpz_t b);
+
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n);
 
+void mod_inverse_ws(numtheory_ws *ws, mpz_t i, mpz_t a, mpz_t n);
+
+void mont_init(mont_ctx *mc, mpz_t n);
+
+void mont_init2(mont_ctx *mc, mp_bitcnt_t bits);
+
+void mont_set(mont_ctx *mc, mpz_t n);
+
+void mont_clear(mont_ctx *mc);
+
+bool mont_use_fixed(mont_ctx *mc);
+
+int mont_window(size_t bits);
+
+void mont_pow(mont_ctx *mc, mpz_t out, mpz_t base, mpz_t exponent);
+
 void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
 
+void pow_mod_ws(numtheory_ws *ws, mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
+
+void pow_mod_basic(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
+
+void prime_test_bpsw(bool enable);
+
 bool is_prime(mpz_t n, uint64_t iters);
 
+bool is_prime_ws(numtheory_ws *ws, mpz_t n, uint64_t iters);
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_prime_ws(numtheory_ws *ws, mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_primes(mpz_t *primes, const uint64_t *bits, uint32_t count, uint64_t iters, uint32_t threads);
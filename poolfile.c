@@ -0,0 +1,288 @@
+#include "poolfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// One complete line of a pool file: bytes start to end, end being the offset of its newline.
+typedef struct {
+    size_t start, end;
+} PoolLine;
+
+// Opens the pool file at path and takes an exclusive lock on it. poolfile_take may rename a new file over
+// the pool while others wait for the lock, so a lock won on a file that is no longer at path is given up
+// and the new file locked instead.
+// IN: path (pool file), create (create a missing file)
+// OUT: int (locked descriptor, -1 if the file could not be opened)
+static int pool_lock(const char *path, bool create) {
+    while (true) {
+        int fd = open(path, O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            return -1;
+        }
+        int r;
+        do {
+            r = flock(fd, LOCK_EX);
+        } while (r != 0 && errno == EINTR);
+        struct stat locked, current;
+        if (r == 0 && fstat(fd, &locked) == 0 && stat(path, &current) == 0 && locked.st_dev == current.st_dev
+            && locked.st_ino == current.st_ino) {
+            return fd;
+        }
+        close(fd);
+        if (r != 0) {
+            return -1;
+        }
+    }
+}
+
+// Reads the whole of the locked pool file.
+// IN: fd (locked descriptor), len (size read)
+// OUT: char * (malloc'd contents with a terminating NUL, NULL on a read error), len
+static char *pool_read(int fd, size_t *len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+    char *data = (char *) malloc((size_t) st.st_size + 1);
+    size_t got = 0;
+    while (got < (size_t) st.st_size) {
+        ssize_t r = pread(fd, data + got, (size_t) st.st_size - got, (off_t) got);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        got += (size_t) r;
+    }
+    data[got] = '\0';
+    *len = got;
+    return data;
+}
+
+// Writes n bytes to fd, retrying short and interrupted writes.
+// IN: fd (descriptor), buf (bytes), n (number of bytes)
+// OUT: bool (false on error)
+static bool pool_write(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        buf += w;
+        n -= (size_t) w;
+    }
+    return true;
+}
+
+// Splits data into its complete lines; bytes after the last newline are left out.
+// IN: data len (pool contents), count (number of lines)
+// OUT: PoolLine * (malloc'd lines), count
+static PoolLine *pool_lines(const char *data, size_t len, size_t *count) {
+    size_t cap = 64;
+    PoolLine *lines = (PoolLine *) malloc(cap * sizeof(PoolLine));
+    *count = 0;
+    for (size_t start = 0; start < len;) {
+        const char *nl = (const char *) memchr(data + start, '\n', len - start);
+        if (nl == NULL) {
+            break;
+        }
+        if (*count == cap) {
+            cap *= 2;
+            lines = (PoolLine *) realloc(lines, cap * sizeof(PoolLine));
+        }
+        lines[*count].start = start;
+        lines[*count].end = (size_t) (nl - data);
+        start = lines[(*count)++].end + 1;
+    }
+    return lines;
+}
+
+// Parses one line as a width in decimal, a space and the prime in lowercase hex.
+// IN: data (pool contents), line (line of data), hex (offset of the digits)
+// OUT: uint64_t (width in bits, 0 if the line is malformed), hex
+static uint64_t pool_parse(const char *data, PoolLine line, size_t *hex) {
+    uint64_t bits = 0;
+    size_t i = line.start;
+    for (; i < line.end && data[i] >= '0' && data[i] <= '9' && bits < (1ULL << 32); i++) {
+        bits = 10 * bits + (uint64_t) (data[i] - '0');
+    }
+    if (i == line.start || i + 1 >= line.end || data[i] != ' ') {
+        return 0;
+    }
+    *hex = ++i;
+    for (; i < line.end; i++) {
+        if (!((data[i] >= '0' && data[i] <= '9') || (data[i] >= 'a' && data[i] <= 'f'))) {
+            return 0;
+        }
+    }
+    return bits;
+}
+
+// Appends count primes to the pool file at path, creating it readable by its owner only if it is missing,
+// and syncs it to disk. A line left incomplete by an earlier crash is cut off first.
+// IN: path (pool file), primes (primes to store), count (number of primes)
+// OUT: bool (false if the pool could not be written)
+bool poolfile_add(const char *path, mpz_t *primes, uint32_t count) {
+    int fd = pool_lock(path, true);
+    if (fd < 0) {
+        return false;
+    }
+    size_t len = 0;
+    char *data = pool_read(fd, &len);
+    bool ok = data != NULL;
+    if (ok && len > 0 && data[len - 1] != '\n') {
+        while (len > 0 && data[len - 1] != '\n') {
+            len--;
+        }
+        ok = ftruncate(fd, (off_t) len) == 0;
+    }
+    free(data);
+
+    size_t size = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        size += mpz_sizeinbase(primes[i], 16) + 24;
+    }
+    char *text = (char *) malloc(size + 1);
+    size_t pos = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        pos += (size_t) sprintf(text + pos, "%lu ", (unsigned long) mpz_sizeinbase(primes[i], 2));
+        mpz_get_str(text + pos, 16, primes[i]);
+        pos += strlen(text + pos);
+        text[pos++] = '\n';
+    }
+    ok = ok && lseek(fd, (off_t) len, SEEK_SET) >= 0 && pool_write(fd, text, pos) && fsync(fd) == 0;
+    free(text);
+    close(fd);
+    return ok;
+}
+
+// Takes primes of the given widths out of the pool file at path, the most recently added first. Only the
+// primes handed back are removed: when they are the last lines of the file it is cut short in place,
+// otherwise the rest of the pool is written to path.tmp and renamed over it. Either way the pool on disk
+// has lost the primes before the call returns them, so no prime is ever handed out twice.
+// IN: path (pool file), primes (count initialized numbers), bits (width wanted for each prime),
+//     count (number of primes), taken (count flags)
+// OUT: primes (a prime from the pool wherever taken is set), taken (whether each prime was found),
+//      uint32_t (number of primes taken, 0 if the pool is missing or could not be updated)
+uint32_t poolfile_take(const char *path, mpz_t *primes, const uint64_t *bits, uint32_t count, bool *taken) {
+    memset(taken, 0, count * sizeof(bool));
+    int fd = pool_lock(path, false);
+    if (fd < 0) {
+        return 0;
+    }
+    size_t len = 0, nlines = 0;
+    char *data = pool_read(fd, &len);
+    if (data == NULL) {
+        close(fd);
+        return 0;
+    }
+    PoolLine *lines = pool_lines(data, len, &nlines);
+    bool *used = (bool *) calloc(nlines > 0 ? nlines : 1, sizeof(bool));
+    uint32_t got = 0;
+    size_t first = nlines;
+    for (size_t i = nlines; i-- > 0 && got < count;) {
+        size_t hex = 0;
+        uint64_t width = pool_parse(data, lines[i], &hex);
+        for (uint32_t j = 0; j < count && width > 0; j++) {
+            if (!taken[j] && bits[j] == width) {
+                data[lines[i].end] = '\0';
+                mpz_set_str(primes[j], data + hex, 16);
+                taken[j] = used[i] = true;
+                got++;
+                first = i;
+                break;
+            }
+        }
+    }
+
+    bool ok = true;
+    if (got > 0) {
+        bool tail = true;
+        for (size_t i = first; i < nlines; i++) {
+            tail = tail && used[i];
+        }
+        if (tail) {
+            ok = ftruncate(fd, (off_t) lines[first].start) == 0 && fsync(fd) == 0;
+        } else {
+            // keep the other well-formed lines
+            size_t kept = 0;
+            for (size_t i = 0; i < nlines; i++) {
+                size_t hex = 0;
+                if (!used[i] && pool_parse(data, lines[i], &hex) > 0) {
+                    size_t n = lines[i].end + 1 - lines[i].start;
+                    memmove(data + kept, data + lines[i].start, n);
+                    kept += n;
+                }
+            }
+            size_t n = strlen(path) + 5;
+            char *tmp_path = (char *) malloc(n);
+            snprintf(tmp_path, n, "%s.tmp", path);
+            int tmp = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            ok = tmp >= 0 && pool_write(tmp, data, kept) && fsync(tmp) == 0;
+            if (tmp >= 0) {
+                ok = close(tmp) == 0 && ok;
+            }
+            ok = ok && rename(tmp_path, path) == 0;
+            if (!ok) {
+                unlink(tmp_path);
+            }
+            free(tmp_path);
+        }
+    }
+    if (!ok) {
+        // the primes may still be in the pool, so they are not handed out
+        memset(taken, 0, count * sizeof(bool));
+        got = 0;
+    }
+    free(used);
+    free(lines);
+    free(data);
+    close(fd);
+    return got;
+}
+
+// Counts the primes of each width in the pool file at path, in the order the widths first appear.
+// IN: path (pool file), bits counts (max entries each), max (most widths reported)
+// OUT: bits (widths), counts (primes of each width), size_t (number of widths, 0 if the pool is missing)
+size_t poolfile_count(const char *path, uint64_t *bits, uint64_t *counts, size_t max) {
+    int fd = pool_lock(path, false);
+    if (fd < 0) {
+        return 0;
+    }
+    size_t len = 0, nlines = 0, widths = 0;
+    char *data = pool_read(fd, &len);
+    close(fd);
+    if (data == NULL) {
+        return 0;
+    }
+    PoolLine *lines = pool_lines(data, len, &nlines);
+    for (size_t i = 0; i < nlines; i++) {
+        size_t hex = 0;
+        uint64_t width = pool_parse(data, lines[i], &hex);
+        size_t w = 0;
+        while (w < widths && bits[w] != width) {
+            w++;
+        }
+        if (width == 0 || (w == widths && widths == max)) {
+            continue;
+        }
+        if (w == widths) {
+            bits[widths] = width;
+            counts[widths++] = 0;
+        }
+        counts[w]++;
+    }
+    free(lines);
+    free(data);
+    return widths;
+}
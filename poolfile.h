@@ -0,0 +1,19 @@
+#pragma once
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Prime pool file, filled by primepool ahead of time and drained by keygen. Each line holds one prime as its
+// width in bits and its hex digits, separated by a space. Every access holds an exclusive flock on the file,
+// and taking primes writes the remaining lines to a new file that is renamed over the pool, so a prime is
+// handed out at most once even with several keygens running, and a crash leaves either the old or the new
+// pool. A line cut short by a crash while appending is skipped.
+#define POOLFILE_DEFAULT "primes.pool"
+
+bool poolfile_add(const char *path, mpz_t *primes, uint32_t count);
+
+uint32_t poolfile_take(const char *path, mpz_t *primes, const uint64_t *bits, uint32_t count, bool *taken);
+
+size_t poolfile_count(const char *path, uint64_t *bits, uint64_t *counts, size_t max);
@@ -0,0 +1,192 @@
+#include "numtheory.h"
+#include "poolfile.h"
+#include "randstate.h"
+#include "rsa.h"
+#include "stats.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/random.h>
+
+#define OPTIONS "f:b:c:e:i:P:t:s:S:lvh"
+
+// Most prime widths given with -b, and the widths -l lists.
+#define MAX_WIDTHS 16
+
+// Primes searched for at once and appended to the pool together, so an interrupted run keeps what it found.
+#define CHUNK 16
+
+int main(int argc, char **argv) {
+    char *pool_path = POOLFILE_DEFAULT;
+    char *stats_path = NULL;
+    uint64_t widths[MAX_WIDTHS];
+    uint32_t nwidths = 0;
+    uint64_t count = 100;
+    uint64_t exponent = RSA_DEFAULT_EXP;
+    uint64_t confidence = 50;
+    int64_t bpsw_rounds = -1;
+    bool iters_given = false;
+    uint32_t threads = 1;
+    uint64_t seed = 0;
+    bool seeded = false;
+    bool list = false;
+    bool verbose = false;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'f': pool_path = optarg; break;
+        case 'b':
+            if (nwidths == MAX_WIDTHS) {
+                fprintf(stderr, "Too many prime widths.\n");
+                return 1;
+            }
+            widths[nwidths++] = strtoull(optarg, NULL, 10);
+            break;
+        case 'c': count = strtoull(optarg, NULL, 10); break;
+        case 'e': exponent = strtoull(optarg, NULL, 10); break;
+        case 'i':
+            confidence = atoi(optarg);
+            iters_given = true;
+            break;
+        case 'P': bpsw_rounds = atoi(optarg); break;
+        case 't':
+            if (!pool_parse_threads(optarg, &threads)) {
+                fprintf(stderr, "Invalid number of threads.\n");
+                return 1;
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            seeded = true;
+            break;
+        case 'S': stats_path = optarg; break;
+        case 'l': list = true; break;
+        case 'v': verbose = true; break;
+        case 'h':
+            printf("SYNOPSIS\n");
+            printf("   Generates primes ahead of time into a pool file that keygen -p takes them from.\n\n");
+            printf("USAGE\n");
+            printf("   ./primepool [-hv] [-f poolfile] [-b bits]... [-c count] [-e exponent] "
+                   "[-i confidence | -P rounds] [-t threads] [-S statsfile]\n");
+            printf("   ./primepool -l [-f poolfile]\n\n");
+            printf("OPTIONS\n");
+            printf("   -h              Display program help and usage.\n");
+            printf("   -v              Display verbose program output.\n");
+            printf("   -l              List the primes of each width in the pool and exit.\n");
+            printf("   -f poolfile     Pool file, created if missing (default: %s).\n", POOLFILE_DEFAULT);
+            printf("   -b bits         Width of the primes, repeatable (default: 1024). A key of n bits "
+                   "and m primes takes n/m-bit primes.\n");
+            printf("   -c count        Primes added of each width (default: 100).\n");
+            printf("   -e exponent     Keep only primes p with p - 1 coprime to the public exponent keygen "
+                   "will use, odd and at least 3, or 0 to keep all (default: 65537).\n");
+            printf("   -i confidence   Miller-Rabin iterations for testing primes (default: 50).\n");
+            printf("   -P rounds       Test primes with Baillie-PSW plus rounds random Miller-Rabin "
+                   "iterations instead.\n");
+            printf("   -t threads      Worker threads searching for primes, 1 to %d (default: 1).\n",
+                POOL_MAX_THREADS);
+            printf("   -s seed         Random seed for testing; pools filled with the same seed share "
+                   "primes.\n");
+            printf("   -S statsfile    Write counters and timings as JSON to statsfile (- for stdout).\n");
+            return 0;
+        }
+    }
+
+    if (list) {
+        uint64_t bits[MAX_WIDTHS], counts[MAX_WIDTHS];
+        size_t n = poolfile_count(pool_path, bits, counts, MAX_WIDTHS);
+        for (size_t i = 0; i < n; i++) {
+            printf("%lu bits: %lu primes\n", (unsigned long) bits[i], (unsigned long) counts[i]);
+        }
+        return 0;
+    }
+    if (exponent != 0 && (exponent < 3 || exponent % 2 == 0)) {
+        fprintf(stderr, "Invalid exponent.\n");
+        return 1;
+    }
+    if (iters_given && bpsw_rounds >= 0) {
+        fprintf(stderr, "Use either -i or -P, not both.\n");
+        return 1;
+    }
+    if (nwidths == 0) {
+        widths[nwidths++] = 1024;
+    }
+    for (uint32_t i = 0; i < nwidths; i++) {
+        if (widths[i] < 16) {
+            fprintf(stderr, "Invalid prime width.\n");
+            return 1;
+        }
+    }
+    if (stats_path != NULL) {
+        stats_enable();
+    }
+    if (bpsw_rounds >= 0) {
+        prime_test_bpsw(true);
+        confidence = (uint64_t) bpsw_rounds;
+    }
+    // a pool is only safe if no two runs find the same primes, so the seed comes from the kernel by default
+    if (!seeded && getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    }
+    randstate_init(seed);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mpz_t primes[CHUNK], temp, divisor, e;
+    uint64_t bits[CHUNK];
+    for (uint32_t i = 0; i < CHUNK; i++) {
+        mpz_init(primes[i]);
+    }
+    mpz_inits(temp, divisor, e, NULL);
+    mpz_set_ui(e, exponent);
+    uint64_t total = 0;
+    int status = 0;
+    for (uint32_t w = 0; w < nwidths && status == 0; w++) {
+        uint64_t added = 0;
+        while (added < count) {
+            uint32_t n = count - added < CHUNK ? (uint32_t) (count - added) : CHUNK;
+            for (uint32_t i = 0; i < n; i++) {
+                bits[i] = widths[w];
+            }
+            make_primes(primes, bits, n, confidence, threads);
+            // drop primes keygen would have to discard
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < n; i++) {
+                mpz_sub_ui(temp, primes[i], 1);
+                gcd(divisor, e, temp);
+                if (exponent == 0 || mpz_cmp_ui(divisor, 1) == 0) {
+                    mpz_swap(primes[kept++], primes[i]);
+                }
+            }
+            if (!poolfile_add(pool_path, primes, kept)) {
+                fprintf(stderr, "Unable to write the pool file.\n");
+                status = 1;
+                break;
+            }
+            added += kept;
+            if (verbose) {
+                printf("%lu bits: %lu/%lu primes\n", (unsigned long) widths[w], (unsigned long) added,
+                    (unsigned long) count);
+            }
+        }
+        total += added;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("%lu primes in %.3f s (%.2f primes/sec)\n", (unsigned long) total, seconds,
+        seconds > 0 ? total / seconds : 0);
+
+    if (stats_path != NULL && !stats_write(stats_path, "primepool")) {
+        fprintf(stderr, "Unable to write stats.\n");
+        status = 1;
+    }
+    for (uint32_t i = 0; i < CHUNK; i++) {
+        mpz_clear(primes[i]);
+    }
+    mpz_clears(temp, divisor, e, NULL);
+    randstate_clear();
+    return status;
+}
@@ -0,0 +1,150 @@
+#include "proto.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Connects to the Unix domain socket at path.
+// IN: path (socket path)
+// OUT: int (connected descriptor, -1 on failure)
+int proto_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads exactly n bytes from fd, retrying short and interrupted reads.
+// IN: fd (descriptor), buf (destination), n (bytes wanted)
+// OUT: buf (bytes read), bool (false on end of input or error)
+bool proto_read(int fd, void *buf, size_t n) {
+    uint8_t *p = (uint8_t *) buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        n -= (size_t) r;
+    }
+    return true;
+}
+
+// Writes exactly n bytes to fd, retrying short and interrupted writes.
+// IN: fd (descriptor), buf (source), n (bytes to write)
+// OUT: bool (false on error)
+bool proto_write(int fd, const void *buf, size_t n) {
+    const uint8_t *p = (const uint8_t *) buf;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        n -= (size_t) w;
+    }
+    return true;
+}
+
+// Stores v big-endian in p[0..3].
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+// Loads a big-endian uint32 from p[0..3].
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Sends one frame: the header for frame, then frame->length bytes of body. Small frames go out in one write.
+// IN: fd (connected socket), frame (header fields), body (frame->length bytes, may be NULL when 0)
+// OUT: bool (false on error)
+bool proto_send(int fd, const proto_frame *frame, const void *body) {
+    uint8_t buf[PROTO_HEADER_SIZE + 4096];
+    put_be32(buf, frame->length);
+    put_be32(buf + 4, frame->id);
+    buf[8] = frame->op;
+    buf[9] = frame->key;
+    buf[10] = frame->status;
+    buf[11] = PROTO_VERSION;
+    if (frame->length <= sizeof(buf) - PROTO_HEADER_SIZE) {
+        if (frame->length > 0) {
+            memcpy(buf + PROTO_HEADER_SIZE, body, frame->length);
+        }
+        return proto_write(fd, buf, PROTO_HEADER_SIZE + frame->length);
+    }
+    return proto_write(fd, buf, PROTO_HEADER_SIZE) && proto_write(fd, body, frame->length);
+}
+
+// Receives one frame, growing *body (of *cap bytes, may start as NULL) to hold it.
+// IN: fd (connected socket), frame (header), body (body buffer), cap (size of body buffer)
+// OUT: frame (header fields), body cap (body in a buffer of at least frame->length bytes),
+//      int (1 for a frame, 0 if the peer closed the connection between frames, -1 on a bad or truncated frame)
+int proto_recv(int fd, proto_frame *frame, uint8_t **body, size_t *cap) {
+    uint8_t h[PROTO_HEADER_SIZE];
+    ssize_t r;
+    do {
+        r = read(fd, h, 1);
+    } while (r < 0 && errno == EINTR);
+    if (r == 0) {
+        return 0;
+    }
+    if (r < 0 || !proto_read(fd, h + 1, PROTO_HEADER_SIZE - 1)) {
+        return -1;
+    }
+    frame->length = get_be32(h);
+    frame->id = get_be32(h + 4);
+    frame->op = h[8];
+    frame->key = h[9];
+    frame->status = h[10];
+    if (h[11] != PROTO_VERSION || frame->length > PROTO_MAX_BODY) {
+        return -1;
+    }
+    if (frame->length > *cap || *body == NULL) {
+        size_t size = frame->length > 0 ? frame->length : 1;
+        uint8_t *p = (uint8_t *) realloc(*body, size);
+        if (p == NULL) {
+            return -1;
+        }
+        *body = p;
+        *cap = size;
+    }
+    return proto_read(fd, *body, frame->length) ? 1 : -1;
+}
+
+// Returns a short description of a response status.
+// IN: status (response status)
+// OUT: const char * (description)
+const char *proto_status_str(uint8_t status) {
+    switch (status) {
+    case PROTO_OK: return "ok";
+    case PROTO_ERR_OP: return "unknown operation";
+    case PROTO_ERR_KEY: return "no such key";
+    case PROTO_ERR_INPUT: return "bad input";
+    default: return "unknown status";
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Framed protocol spoken by rsad over a Unix domain socket. Every request and response is a header of
+// PROTO_HEADER_SIZE bytes followed by a body: the body length and the request id as big-endian uint32s,
+// then the operation, the key slot, the flags of a request or the status of a response, and the version.
+// A response carries the id and operation of its request. A connection carries any number of requests,
+// answered in order; a frame of another version or with a body over PROTO_MAX_BODY bytes ends it.
+#define PROTO_HEADER_SIZE 12
+#define PROTO_VERSION     1
+#define PROTO_MAX_BODY    (16 << 20)
+
+// Default socket path of rsad and its clients.
+#define PROTO_DEFAULT_SOCKET "rsad.sock"
+
+// Operations. The bodies are:
+//   PROTO_ENCRYPT  request: plaintext  response: binary (or hybrid, with PROTO_FLAG_HYBRID) container
+//   PROTO_DECRYPT  request: container or hex lines as written by encrypt  response: plaintext
+//   PROTO_SIGN     request: message, a big-endian number below n  response: signature, mod_bytes big-endian
+//   PROTO_VERIFY   request: signature of mod_bytes bytes, then the message  response: one byte, 1 if valid
+//   PROTO_PING     request: anything  response: the same bytes
+enum {
+    PROTO_ENCRYPT = 1,
+    PROTO_DECRYPT = 2,
+    PROTO_SIGN = 3,
+    PROTO_VERIFY = 4,
+    PROTO_PING = 5,
+};
+
+// Request flag: encrypt in hybrid mode.
+#define PROTO_FLAG_HYBRID 0x01
+
+// Response status. Anything but PROTO_OK comes with an empty body.
+enum {
+    PROTO_OK = 0,
+    PROTO_ERR_OP = 1, // unknown operation
+    PROTO_ERR_KEY = 2, // no such key slot, or the slot lacks the half of the key the operation needs
+    PROTO_ERR_INPUT = 3, // body malformed or not decryptable with this key
+};
+
+// Header of a request or response.
+typedef struct {
+    uint32_t length; // body bytes
+    uint32_t id; // chosen by the client, echoed in the response
+    uint8_t op;
+    uint8_t key; // key slot, in the order rsad loaded the keys
+    uint8_t status; // flags of a request, status of a response
+} proto_frame;
+
+int proto_connect(const char *path);
+
+bool proto_read(int fd, void *buf, size_t n);
+
+bool proto_write(int fd, const void *buf, size_t n);
+
+bool proto_send(int fd, const proto_frame *frame, const void *body);
+
+int proto_recv(int fd, proto_frame *frame, uint8_t **body, size_t *cap);
+
+const char *proto_status_str(uint8_t status);
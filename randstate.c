@@ -3,17 +3,40 @@
 #include <gmp.h>
 #include <stdint.h>
 
-gmp_randstate_t state;
+_Thread_local gmp_randstate_t state;
 
-// Initialize the global random state for gmp using seed
+// Seed that the per-thread streams are derived from, set by randstate_init.
+static uint64_t base_seed;
+
+// SplitMix64 finalizer, used to turn (seed, stream) into well separated seeds.
+// IN: x (value to mix)
+// OUT: uint64_t (mixed value)
+static uint64_t mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Initialize the calling thread's random state for gmp using seed, and remember seed as the base for other streams
 // IN: seed (initial seed for the random state)
 // OUT: N/A
 void randstate_init(uint64_t seed) {
+    base_seed = seed;
     gmp_randinit_mt(state);
     gmp_randseed_ui(state, seed);
 }
 
-// Clears the memory used by the global state.
+// Initialize the calling thread's random state as stream number 'stream' of the seed given to randstate_init.
+// The same seed and stream always give the same sequence, whichever thread runs it.
+// IN: stream (stream number)
+// OUT: N/A
+void randstate_init_stream(uint64_t stream) {
+    gmp_randinit_mt(state);
+    gmp_randseed_ui(state, mix64(base_seed ^ mix64(stream + 1)));
+}
+
+// Clears the memory used by the calling thread's state.
 // IN: N/A
 // OUT: N/A
 void randstate_clear(void) {
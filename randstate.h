@@ -3,8 +3,12 @@
 #include <stdint.h>
 #include <gmp.h>
 
-extern gmp_randstate_t state;
+// Every thread has its own random state; it must be set up with randstate_init or
+// randstate_init_stream on that thread before anything on the thread draws from it.
+extern _Thread_local gmp_randstate_t state;
 
 void randstate_init(uint64_t seed);
 
+void randstate_init_stream(uint64_t stream);
+
 void randstate_clear(void);
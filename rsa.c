@@ -1,45 +1,430 @@
+#include "aead.h"
+#include "fileio.h"
 #include "numtheory.h"
+#include "poolfile.h"
 #include "randstate.h"
+#include "rsa.h"
+#include "stats.h"
+#include "threadpool.h"
 
 #include <stdlib.h>
-#include <math.h>
 #include <inttypes.h>
 #include <string.h>
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <errno.h>
+#include <sys/random.h>
 
 // Creates parts of a new RSA public key: two large primes p and q, their product n, and the public exponent e.
-// IN: p (large prime 1), q (large prime 2), n (product of p and q), e (public exponent), nbits(target number of bits), iters (number of Miller-Rabin iterations)
+// IN: p (large prime 1), q (large prime 2), n (product of p and q), e (public exponent), nbits(target number of bits), iters (number of Miller-Rabin iterations),
+//     threads (worker threads searching for p and q, 0 or 1 for the calling thread only),
+//     e (fixed odd public exponent such as 65537, or 0 to pick a random nbits-bit one)
 // OUT: p (large prime 1), q (large prime 2), n (product of p and q), e (public exponent)
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
-    // p_bits = random number between range [nbits/4,(3×nbits)/4).
-    uint64_t max_bits = 3 * nbits / 4;
-    uint64_t min_bits = nbits / 4;
-    uint64_t p_bits = rand() % (max_bits + 1 - min_bits) + min_bits;
-    // q_bits = remaining bits not used by p_bits
-    uint64_t q_bits = nbits - p_bits;
+void rsa_make_pub(
+    mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, uint32_t threads) {
+    mpz_t primes[2];
+    mpz_inits(primes[0], primes[1], NULL);
+    rsa_make_pub_primes(primes, 2, n, e, nbits, iters, threads);
+    mpz_swap(p, primes[0]);
+    mpz_swap(q, primes[1]);
+    mpz_clears(primes[0], primes[1], NULL);
+}
+
+// Pool file rsa_make_pub_primes takes primes from, or NULL to always search for them.
+static const char *prime_pool = NULL;
+
+// Makes rsa_make_pub_primes take its primes from the pool file at path, filled by primepool, and search only
+// for those of a width the pool has run out of. Set it before any key is generated.
+// IN: path (pool file, NULL to search for every prime)
+// OUT: N/A
+void rsa_use_prime_pool(const char *path) {
+    prime_pool = path;
+}
+
+// Gets count primes of the given widths: from the prime pool as far as it has them, the rest by a search.
+// The pool file is not trusted, so a pooled number that is not a prime of its width counts as a miss.
+// IN: primes (count initialized numbers), bits (width of each prime), count (number of primes),
+//     iters (number of Miller-Rabin iterations), threads (worker threads searching for primes)
+// OUT: primes (new primes)
+static void draw_primes(mpz_t *primes, const uint64_t *bits, uint32_t count, uint64_t iters, uint32_t threads) {
+    if (prime_pool == NULL) {
+        make_primes(primes, bits, count, iters, threads);
+        return;
+    }
+    bool taken[RSA_MAX_PRIMES];
+    uint32_t got = poolfile_take(prime_pool, primes, bits, count, taken);
+    for (uint32_t i = 0; i < count; i++) {
+        if (taken[i] && (mpz_sizeinbase(primes[i], 2) != bits[i] || !is_prime(primes[i], iters))) {
+            taken[i] = false;
+            got--;
+        }
+    }
+    STAT_ADD(STAT_POOL_PRIMES, got);
+    if (got == count) {
+        return;
+    }
+    mpz_t rest[RSA_MAX_PRIMES];
+    uint64_t rest_bits[RSA_MAX_PRIMES];
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!taken[i]) {
+            mpz_init(rest[missing]);
+            rest_bits[missing++] = bits[i];
+        }
+    }
+    STAT_ADD(STAT_POOL_MISSES, missing);
+    make_primes(rest, rest_bits, missing, iters, threads);
+    for (uint32_t i = 0, j = 0; i < count; i++) {
+        if (!taken[i]) {
+            mpz_swap(primes[i], rest[j]);
+            mpz_clear(rest[j++]);
+        }
+    }
+}
+
+// Creates parts of a new RSA public key with count primes (2 to RSA_MAX_PRIMES), their product n, and the public
+// exponent e. Two primes split nbits at random; more primes share nbits evenly, so each is smaller and much
+// faster to find, and the private key operations run on smaller moduli through the multi-prime CRT. With a prime
+// pool (rsa_use_prime_pool) two primes share nbits evenly as well, as the pool holds primes of fixed widths.
+// IN: primes (count initialized numbers), count (number of primes), n (modulus), e (public exponent),
+//     nbits (target number of bits), iters (number of Miller-Rabin iterations),
+//     threads (worker threads searching for the primes, 0 or 1 for the calling thread only),
+//     e (fixed odd public exponent such as 65537, or 0 to pick a random nbits-bit one)
+// OUT: primes (distinct primes), n (product of the primes, nbits bits), e (public exponent)
+void rsa_make_pub_primes(
+    mpz_t *primes, uint32_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, uint32_t threads) {
+    uint64_t bits[RSA_MAX_PRIMES];
+    if (count == 2 && prime_pool == NULL) {
+        // p_bits = random number between range [nbits/4,(3×nbits)/4).
+        uint64_t max_bits = 3 * nbits / 4;
+        uint64_t min_bits = nbits / 4;
+        bits[0] = gmp_urandomm_ui(state, max_bits + 1 - min_bits) + min_bits;
+        // q_bits = remaining bits not used by p_bits
+        bits[1] = nbits - bits[0];
+    } else {
+        for (uint32_t i = 0; i < count; i++) {
+            bits[i] = nbits / count + (i < nbits % count);
+        }
+    }
 
     //create primes of specified bit sizes using 'iters' num Miller-Rabin  iterations
+    //all primes are searched for at once; each has exactly its width with its top two bits set, so two of them
+    //always make an nbits-bit n, while the product of more can come up a bit short and is drawn again
+    //with a fixed e the primes are drawn again until e is coprime to the totient
+    bool fixed_e = mpz_sgn(e) != 0;
+    mpz_t temp, totient, divisor;
+    mpz_inits(temp, totient, divisor, NULL);
+    bool retry = false;
     do {
-        make_prime(p, p_bits, iters);
-        make_prime(q, q_bits, iters);
-        // n = p * q as specified
-        mpz_mul(n, p, q);
-    } while (mpz_sizeinbase(n, 2) != nbits);
-    // initialize temporary variables for totient computation
-    mpz_t p_temp, q_temp, totient, divisor;
-    mpz_inits(p_temp, q_temp, totient, divisor, NULL);
-    //subtract 1 from p and q and calculate totient
-    mpz_sub_ui(p_temp, p, 1);
-    mpz_sub_ui(q_temp, q, 1);
-    mpz_mul(totient, p_temp, q_temp);
-    do {
-        mpz_urandomb(e, state, nbits);
-        gcd(divisor, e, totient);
-    } while (mpz_cmp_ui(divisor, 1) != 0); //found coprime of totient (public exponent)
+        draw_primes(primes, bits, count, iters, threads);
+        //multiply the primes into n, and the primes less 1 into the totient
+        mpz_set_ui(n, 1);
+        mpz_set_ui(totient, 1);
+        for (uint32_t i = 0; i < count; i++) {
+            mpz_mul(n, n, primes[i]);
+            mpz_sub_ui(temp, primes[i], 1);
+            mpz_mul(totient, totient, temp);
+        }
+        retry = mpz_sizeinbase(n, 2) != nbits;
+        for (uint32_t i = 0; i < count; i++) {
+            for (uint32_t j = i + 1; j < count; j++) {
+                retry = retry || mpz_cmp(primes[i], primes[j]) == 0;
+            }
+        }
+        if (!retry && fixed_e) {
+            gcd(divisor, e, totient);
+            retry = mpz_cmp_ui(divisor, 1) != 0;
+        }
+        if (retry) {
+            STAT_ADD(STAT_PUB_RETRIES, 1);
+        }
+    } while (retry);
+    if (!fixed_e) {
+        do {
+            mpz_urandomb(e, state, nbits);
+            gcd(divisor, e, totient);
+        } while (mpz_cmp_ui(divisor, 1) != 0); //found coprime of totient (public exponent)
+    }
+
+    mpz_clears(temp, totient, divisor, NULL);
+}
+
+// FNV-1a offset basis, the starting value of a key file checksum.
+#define KEY_FNV_BASIS 0xCBF29CE484222325ULL
+
+// Continues an FNV-1a hash over n more bytes.
+// IN: h (hash so far), p (bytes), n (number of bytes)
+// OUT: uint64_t (updated hash)
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+// Stores v at p as 8 little-endian bytes.
+static void put_le64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t) (v >> (8 * i));
+    }
+}
+
+// Loads 8 little-endian bytes from p.
+static uint64_t get_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// Appends n bytes to a key file being written and to its checksum.
+// IN: out (output), sum (checksum so far), data (bytes), n (number of bytes)
+// OUT: out (updated output), sum (updated checksum)
+static void key_put(io_out *out, uint64_t *sum, const void *data, size_t n) {
+    *sum = fnv1a(*sum, (const uint8_t *) data, n);
+    io_write(out, data, n);
+}
+
+// Appends a little-endian uint64 to a key file being written.
+static void key_put_u64(io_out *out, uint64_t *sum, uint64_t v) {
+    uint8_t b[8];
+    put_le64(b, v);
+    key_put(out, sum, b, sizeof(b));
+}
+
+// Appends a number to a key file being written as its limb count and limbs.
+// IN: out (output), sum (checksum so far), x (number)
+// OUT: out (updated output), sum (updated checksum)
+static void key_put_mpz(io_out *out, uint64_t *sum, mpz_t x) {
+    size_t limbs = mpz_size(x);
+    const mp_limb_t *xp = mpz_limbs_read(x);
+    key_put_u64(out, sum, limbs);
+    for (size_t i = 0; i < limbs; i++) {
+        key_put_u64(out, sum, xp[i]);
+    }
+}
+
+// Writes a binary key file: header, numbers, an optional username and the checksum.
+// IN: out (output), kind (RSA_KEY_PUB or RSA_KEY_PRIV), flags (key flags), fields (numbers, n first),
+//     count (number of numbers), username (public key username, NULL for a private key)
+// OUT: out (binary key file)
+static void key_write_bin(io_out *out, uint8_t kind, uint8_t flags, mpz_ptr *fields, uint8_t count,
+    const char *username) {
+    uint64_t sum = KEY_FNV_BASIS;
+    size_t bits = mpz_sizeinbase(fields[0], 2);
+    uint8_t header[RSA_KEY_HEADER_SIZE] = { 0 };
+    memcpy(header, RSA_KEY_MAGIC, 4);
+    header[4] = RSA_KEY_VERSION;
+    header[5] = kind;
+    header[6] = flags;
+    header[7] = count;
+    uint32_t geometry[3] = { (uint32_t) bits, (uint32_t) (bits >= 2 ? (bits - 2) / 8 : 0),
+        (uint32_t) ((bits + 7) / 8) };
+    for (int i = 0; i < 3; i++) {
+        for (int b = 0; b < 4; b++) {
+            header[8 + 4 * i + b] = (uint8_t) (geometry[i] >> (8 * b));
+        }
+    }
+    key_put(out, &sum, header, sizeof(header));
+    for (uint8_t i = 0; i < count; i++) {
+        key_put_mpz(out, &sum, fields[i]);
+    }
+    if (username != NULL) {
+        size_t len = strlen(username);
+        uint8_t pad[8] = { 0 };
+        key_put_u64(out, &sum, len);
+        key_put(out, &sum, username, len);
+        key_put(out, &sum, pad, (8 - len % 8) % 8);
+    }
+    uint8_t b[8];
+    put_le64(b, sum);
+    io_write(out, b, sizeof(b));
+}
+
+// Returns whether file starts with the binary key magic. A hex key starts with a hex digit, so one byte of
+// lookahead, pushed back for a hex key, tells them apart even on a pipe; a binary key is left just past the magic.
+// IN: file (key file)
+// OUT: bool (binary key file)
+static bool key_is_bin(FILE *file) {
+    int c = getc(file);
+    if (c != RSA_KEY_MAGIC[0]) {
+        ungetc(c, file);
+        return false;
+    }
+    char magic[3];
+    return fread(magic, sizeof(char), 3, file) == 3 && memcmp(magic, RSA_KEY_MAGIC + 1, 3) == 0;
+}
+
+// Reader state for a binary key file: the input, the stream buffer when the file is not mapped, and the
+// running checksum.
+typedef struct {
+    io_in in;
+    uint8_t *buf;
+    size_t cap;
+    uint64_t sum;
+} KeyReader;
 
-    mpz_clears(p_temp, q_temp, totient, divisor, NULL);
+// Returns the next n bytes of a binary key file and adds them to the checksum.
+// IN: kr (reader), n (bytes wanted)
+// OUT: const uint8_t * (the bytes, NULL if the file ends first)
+static const uint8_t *key_get(KeyReader *kr, size_t n) {
+    if (kr->in.map == NULL && n > kr->cap) {
+        free(kr->buf);
+        kr->cap = n;
+        kr->buf = (uint8_t *) malloc(n);
+    }
+    size_t got = 0;
+    const uint8_t *p = io_next(&kr->in, kr->buf, n, &got);
+    if (got != n) {
+        return NULL;
+    }
+    kr->sum = fnv1a(kr->sum, p, n);
+    return p;
+}
+
+// Reads a number from a binary key file, copying its limbs straight into x.
+// IN: kr (reader), x (number)
+// OUT: x (number read), bool (false if the file ends first or the count is implausible)
+static bool key_get_mpz(KeyReader *kr, mpz_t x) {
+    const uint8_t *p = key_get(kr, 8);
+    uint64_t limbs = p != NULL ? get_le64(p) : 0;
+    if (p == NULL || limbs > (1 << 16) || (p = key_get(kr, 8 * limbs)) == NULL) {
+        return false;
+    }
+    if (limbs == 0) {
+        mpz_set_ui(x, 0);
+        return true;
+    }
+    mp_limb_t *xp = mpz_limbs_write(x, limbs);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && GMP_NUMB_BITS == 64
+    memcpy(xp, p, 8 * limbs);
+#else
+    for (uint64_t i = 0; i < limbs; i++) {
+        xp[i] = get_le64(p + 8 * i);
+    }
+#endif
+    mpz_limbs_finish(x, limbs);
+    return true;
+}
+
+// Reads a binary key file from in, positioned just past the magic.
+// Up to count numbers are filled in order; numbers the file holds beyond them are skipped, and ones it does
+// not hold are left alone, so the caller checks the flags and the number stored for optional trailing fields.
+// IN: in (key file input, closed by the call), kind (expected kind), fields (numbers to fill), count (fields wanted),
+//     required (fields the file must hold), flags (key flags), stored (fields the file holds, may be NULL),
+//     username (buffer of RSA_KEY_MAX_USER + 1 bytes for a public key, NULL for a private key)
+// OUT: fields, flags, stored, username (key read), bool (false if the file is damaged or of another kind)
+static bool key_read_bin(io_in *in, uint8_t kind, mpz_ptr *fields, uint8_t count, uint8_t required,
+    uint8_t *flags, uint8_t *stored_out, char *username) {
+    KeyReader kr = { .in = *in, .buf = NULL, .cap = 0,
+        .sum = fnv1a(KEY_FNV_BASIS, (const uint8_t *) RSA_KEY_MAGIC, 4) };
+    const uint8_t *h = key_get(&kr, RSA_KEY_HEADER_SIZE - 4);
+    bool ok = h != NULL && h[0] == RSA_KEY_VERSION && h[1] == kind && h[3] >= required
+              && h[3] <= RSA_KEY_MAX_FIELDS;
+    uint8_t stored = ok ? h[3] : 0;
+    *flags = ok ? h[2] : 0;
+
+    mpz_t skip;
+    mpz_init(skip);
+    for (uint8_t i = 0; ok && i < stored; i++) {
+        ok = key_get_mpz(&kr, i < count ? fields[i] : skip);
+    }
+    mpz_clear(skip);
+    if (ok && username != NULL) {
+        const uint8_t *p = key_get(&kr, 8);
+        uint64_t len = p != NULL ? get_le64(p) : 0;
+        ok = p != NULL && len <= (1 << 16) && (p = key_get(&kr, len + (8 - len % 8) % 8)) != NULL;
+        if (ok) {
+            size_t keep = len < RSA_KEY_MAX_USER ? len : RSA_KEY_MAX_USER;
+            memcpy(username, p, keep);
+            username[keep] = '\0';
+        }
+    }
+    uint64_t sum = kr.sum;
+    const uint8_t *p = ok ? key_get(&kr, 8) : NULL;
+    ok = p != NULL && get_le64(p) == sum;
+
+    io_in_close(&kr.in);
+    free(kr.buf);
+    if (!ok) {
+        for (uint8_t i = 0; i < count; i++) {
+            mpz_set_ui(fields[i], 0);
+        }
+        *flags = 0;
+    }
+    if (stored_out != NULL) {
+        *stored_out = ok ? stored : 0;
+    }
+    return ok;
+}
+
+// Returns whether a key held in memory is in the binary format, setting up in to read it past the magic if so
+// and from the start otherwise.
+// IN: in (input), key (key file contents), len (number of bytes)
+// OUT: in (ready input), bool (binary key file)
+static bool key_mem_open(io_in *in, const uint8_t *key, size_t len) {
+    bool binary = len >= 4 && memcmp(key, RSA_KEY_MAGIC, 4) == 0;
+    io_in_mem(in, binary ? key + 4 : key, binary ? len - 4 : len);
+    return binary;
+}
+
+// Returns the next whitespace-separated token of input read from memory.
+// IN: in (input from memory), len (token length)
+// OUT: const char * (the token, not NUL-terminated, NULL at the end of the input), len (token length)
+static const char *mem_token(io_in *in, size_t *len) {
+    while (in->pos < in->map_size && strchr(" \t\r\n", in->map[in->pos]) != NULL) {
+        in->pos++;
+    }
+    size_t start = in->pos;
+    while (in->pos < in->map_size && strchr(" \t\r\n", in->map[in->pos]) == NULL) {
+        in->pos++;
+    }
+    *len = in->pos - start;
+    return *len > 0 ? (const char *) in->map + start : NULL;
+}
+
+// Returns the value of hex digit c, or -1 if it is not one.
+static int hex_value(char c) {
+    return c >= '0' && c <= '9' ? c - '0'
+           : c >= 'a' && c <= 'f' ? c - 'a' + 10
+           : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                  : -1;
+}
+
+// Reads the next hex number of input read from memory, the way "%Zx" reads one from a stream. The digits are
+// packed into buf and imported, so no NUL-terminated copy is made.
+// IN: in (input from memory), x (number), buf (scratch), cap (size of buf, at least half the digits rounded up)
+// OUT: x (number read), bool (false at the end of the input or if the token is not a hex number that fits)
+static bool mem_hex(io_in *in, mpz_t x, uint8_t *buf, size_t cap) {
+    size_t len = 0;
+    const char *tok = mem_token(in, &len);
+    size_t bytes = (len + 1) / 2;
+    if (tok == NULL || bytes > cap) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        int v = hex_value(tok[len - 1 - i]);
+        if (v < 0) {
+            return false;
+        }
+        uint8_t *b = buf + bytes - 1 - i / 2;
+        *b = i % 2 == 0 ? (uint8_t) v : (uint8_t) (*b | v << 4);
+    }
+    mpz_import(x, bytes, 1, sizeof(uint8_t), 1, 0, buf);
+    return true;
+}
+
+// Appends x as a hex line to output, the way "%Zx\n" prints it.
+// IN: out (output), x (number)
+// OUT: out (updated output)
+static void io_put_hex(io_out *out, mpz_t x) {
+    char *line = (char *) io_reserve(out, mpz_sizeinbase(x, 16) + 2);
+    mpz_get_str(line, 16, x);
+    size_t len = strlen(line);
+    line[len] = '\n';
+    io_commit(out, len + 1);
 }
 
 // Writes a public RSA key to pbfile.
@@ -52,15 +437,97 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
     gmp_fprintf(pbfile, "%s\n", username);
 }
 
-// Read public RSA key from pbfile
-// IN: n, e, s, username (ordered list of desired variables in file), pbfile (target file)
-// OUT: n, e, s, username (ordered list of desired variables from pbfile)
-void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
-    gmp_fscanf(pbfile, "%Zx\n", n);
-    gmp_fscanf(pbfile, "%Zx\n", e);
-    gmp_fscanf(pbfile, "%Zx\n", s);
-    gmp_fscanf(pbfile, "%s\n", username);
-    fclose(pbfile);
+// Read public RSA key from pbfile, in the hex or the binary key format. A damaged binary key reads as zeros.
+// IN: n, e, s, username (ordered list of desired variables in file, username holds RSA_KEY_MAX_USER + 1 bytes),
+//     pbfile (target file, left open)
+// OUT: n, e, s, username (ordered list of desired variables from pbfile),
+//      bool (binary key whose signature was verified when it was written)
+bool rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
+    uint64_t start = stats_clock();
+    bool verified = false;
+    if (key_is_bin(pbfile)) {
+        mpz_ptr fields[3] = { n, e, s };
+        uint8_t flags = 0;
+        io_in in;
+        io_in_open(&in, pbfile, true);
+        verified = key_read_bin(&in, RSA_KEY_PUB, fields, 3, 3, &flags, NULL, username)
+                   && (flags & RSA_KEY_FLAG_VERIFIED);
+    } else {
+        gmp_fscanf(pbfile, "%Zx\n", n);
+        gmp_fscanf(pbfile, "%Zx\n", e);
+        gmp_fscanf(pbfile, "%Zx\n", s);
+        // longer usernames are cut to RSA_KEY_MAX_USER characters, as in the other key readers
+        char format[16];
+        snprintf(format, sizeof(format), "%%%ds", RSA_KEY_MAX_USER);
+        gmp_fscanf(pbfile, format, username);
+    }
+    STAT_TIME(STAT_PARSE_NS, start);
+    return verified;
+}
+
+// Reads a public RSA key held in memory, in the hex or the binary key format, without stdio.
+// IN: n, e, s, username (key, username holds RSA_KEY_MAX_USER + 1 bytes), key (key file contents), len (bytes)
+// OUT: n, e, s, username (key read), verified (binary key whose signature was verified when it was written),
+//      bool (false if the key is damaged or incomplete)
+bool rsa_read_pub_buf(
+    mpz_t n, mpz_t e, mpz_t s, char username[], bool *verified, const uint8_t *key, size_t len) {
+    uint64_t start = stats_clock();
+    io_in in;
+    bool ok = false;
+    *verified = false;
+    if (key_mem_open(&in, key, len)) {
+        mpz_ptr fields[3] = { n, e, s };
+        uint8_t flags = 0;
+        ok = key_read_bin(&in, RSA_KEY_PUB, fields, 3, 3, &flags, NULL, username);
+        *verified = ok && (flags & RSA_KEY_FLAG_VERIFIED);
+    } else {
+        uint8_t *buf = (uint8_t *) malloc(len / 2 + 1);
+        size_t cap = len / 2 + 1, user_len = 0;
+        ok = mem_hex(&in, n, buf, cap) && mem_hex(&in, e, buf, cap) && mem_hex(&in, s, buf, cap);
+        const char *user = ok ? mem_token(&in, &user_len) : NULL;
+        size_t keep = user_len < RSA_KEY_MAX_USER ? user_len : RSA_KEY_MAX_USER;
+        memcpy(username, user != NULL ? user : "", keep);
+        username[keep] = '\0';
+        ok = user != NULL;
+        free(buf);
+    }
+    STAT_TIME(STAT_PARSE_NS, start);
+    return ok;
+}
+
+// Writes a public RSA key to pbfile in the binary key format.
+// IN: n, e, s, username (key), verified (s has been checked against n, e and username), pbfile (target file)
+// OUT: pbfile (updated target file)
+void rsa_write_pub_bin(mpz_t n, mpz_t e, mpz_t s, char username[], bool verified, FILE *pbfile) {
+    mpz_ptr fields[3] = { n, e, s };
+    io_out out;
+    io_out_open(&out, pbfile);
+    key_write_bin(&out, RSA_KEY_PUB, verified ? RSA_KEY_FLAG_VERIFIED : 0, fields, 3, username);
+    io_out_close(&out);
+}
+
+// Writes a public RSA key into memory, in the hex or the binary key format, without stdio.
+// IN: n, e, s, username (key), binary (key format), verified (s has been checked, binary format only),
+//     out (output buffer, see rsa_buf)
+// OUT: out (key file contents)
+void rsa_write_pub_buf(mpz_t n, mpz_t e, mpz_t s, char username[], bool binary, bool verified, rsa_buf *out) {
+    io_out o;
+    io_out_mem(&o, out->data, out->cap);
+    if (binary) {
+        mpz_ptr fields[3] = { n, e, s };
+        key_write_bin(&o, RSA_KEY_PUB, verified ? RSA_KEY_FLAG_VERIFIED : 0, fields, 3, username);
+    } else {
+        io_put_hex(&o, n);
+        io_put_hex(&o, e);
+        io_put_hex(&o, s);
+        size_t len = strlen(username);
+        io_write(&o, username, len);
+        io_write(&o, "\n", 1);
+    }
+    io_out_close(&o);
+    out->data = o.buf;
+    out->len = o.len;
+    out->cap = o.cap;
 }
 
 // Creates a new RSA private key d given primes p and q and public exponent e.
@@ -77,19 +544,245 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
     mpz_clears(p_temp, q_temp, totient, NULL);
 }
 
-// Writes a private RSA key to pbfile.
-// IN: n, d, (ordered list of file inputs), pbfile (target file)
-// OUT: pbfile (updated target file)
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
+// Creates a new RSA private key d given count primes and public exponent e.
+// IN: d (output private key), e (public exponent), primes (primes input), count (number of primes)
+// OUT: d (outputted private key)
+void rsa_make_priv_primes(mpz_t d, mpz_t e, mpz_t *primes, uint32_t count) {
+    mpz_t temp, totient;
+    mpz_inits(temp, totient, NULL);
+
+    mpz_set_ui(totient, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_sub_ui(temp, primes[i], 1);
+        mpz_mul(totient, totient, temp);
+    }
+    mod_inverse(d, e, totient);
+    mpz_clears(temp, totient, NULL);
+}
+
+// Initializes the mpz variables of a CRT private key, with room for every further prime and none in use.
+// IN: crt (CRT key to initialize)
+// OUT: crt (initialized CRT key)
+void rsa_crt_init(rsa_crt *crt) {
+    mpz_inits(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+    crt->extra = 0;
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_inits(crt->r[i], crt->dr[i], crt->tr[i], NULL);
+    }
+}
+
+// Clears the memory used by a CRT private key.
+// IN: crt (CRT key to clear)
+// OUT: N/A
+void rsa_crt_clear(rsa_crt *crt) {
+    mpz_clears(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_clears(crt->r[i], crt->dr[i], crt->tr[i], NULL);
+    }
+}
+
+// Copies a CRT private key.
+// IN: dst (initialized CRT key), src (CRT key)
+// OUT: dst (copy of src)
+static void crt_copy(rsa_crt *dst, rsa_crt *src) {
+    mpz_set(dst->p, src->p);
+    mpz_set(dst->q, src->q);
+    mpz_set(dst->dp, src->dp);
+    mpz_set(dst->dq, src->dq);
+    mpz_set(dst->qinv, src->qinv);
+    dst->extra = src->extra;
+    for (uint32_t i = 0; i < src->extra; i++) {
+        mpz_set(dst->r[i], src->r[i]);
+        mpz_set(dst->dr[i], src->dr[i]);
+        mpz_set(dst->tr[i], src->tr[i]);
+    }
+}
+
+// Computes the CRT components of private key d from the primes p and q.
+// IN: crt (CRT key), d (private key), p q (primes input)
+// OUT: crt (p, q, d mod (p-1), d mod (q-1), q^-1 mod p)
+void rsa_make_crt(rsa_crt *crt, mpz_t d, mpz_t p, mpz_t q) {
+    mpz_set(crt->p, p);
+    mpz_set(crt->q, q);
+    mpz_sub_ui(crt->dp, p, 1);
+    mpz_mod(crt->dp, d, crt->dp);
+    mpz_sub_ui(crt->dq, q, 1);
+    mpz_mod(crt->dq, d, crt->dq);
+    mod_inverse(crt->qinv, crt->q, crt->p);
+    crt->extra = 0;
+}
+
+// Computes the CRT components of private key d from count primes: those of rsa_make_crt for the first two,
+// then dr and tr for each further one.
+// IN: crt (CRT key), d (private key), primes (primes input), count (number of primes, 2 to RSA_MAX_PRIMES)
+// OUT: crt (CRT components)
+void rsa_make_crt_primes(rsa_crt *crt, mpz_t d, mpz_t *primes, uint32_t count) {
+    rsa_make_crt(crt, d, primes[0], primes[1]);
+    mpz_t prod;
+    mpz_init(prod);
+    mpz_mul(prod, primes[0], primes[1]);
+    for (uint32_t i = 2; i < count; i++) {
+        uint32_t j = i - 2;
+        mpz_set(crt->r[j], primes[i]);
+        mpz_sub_ui(crt->dr[j], primes[i], 1);
+        mpz_mod(crt->dr[j], d, crt->dr[j]);
+        mod_inverse(crt->tr[j], prod, primes[i]); // tr = (product of the primes before it)^-1 mod r
+        mpz_mul(prod, prod, primes[i]);
+    }
+    crt->extra = count - 2;
+    mpz_clear(prod);
+}
+
+// Lists the numbers of a private key in file order: n and d, then, with crt, p, q, dp, dq and qinv followed by
+// r, dr and tr for each further prime.
+// IN: fields (RSA_KEY_MAX_FIELDS slots), n d crt (key, crt may be NULL), all (list room for every further prime
+//     crt can hold, to read into, rather than only those in use)
+// OUT: fields (the numbers), uint8_t (number of fields)
+static uint8_t priv_fields(mpz_ptr *fields, mpz_t n, mpz_t d, rsa_crt *crt, bool all) {
+    fields[0] = n;
+    fields[1] = d;
+    if (crt == NULL) {
+        return 2;
+    }
+    fields[2] = crt->p;
+    fields[3] = crt->q;
+    fields[4] = crt->dp;
+    fields[5] = crt->dq;
+    fields[6] = crt->qinv;
+    uint32_t extra = all ? RSA_MAX_PRIMES - 2 : crt->extra;
+    for (uint32_t i = 0; i < extra; i++) {
+        fields[7 + 3 * i] = crt->r[i];
+        fields[8 + 3 * i] = crt->dr[i];
+        fields[9 + 3 * i] = crt->tr[i];
+    }
+    return (uint8_t) (7 + 3 * extra);
+}
+
+// Returns the further primes of a private key whose file held count fields with the CRT components.
+// IN: count (fields read)
+// OUT: uint32_t (primes beyond p and q)
+static uint32_t priv_extra(uint8_t count) {
+    return count >= 10 ? (count - 7) / 3 : 0;
+}
+
+// Writes a private RSA key to pvfile. If crt is given, its components follow n and d, then those of each
+// further prime of a multi-prime key.
+// IN: n, d, crt (ordered list of file inputs, crt may be NULL), pvfile (target file)
+// OUT: pvfile (updated target file)
+void rsa_write_priv(mpz_t n, mpz_t d, rsa_crt *crt, FILE *pvfile) {
     gmp_fprintf(pvfile, "%Zx\n%Zx\n", n, d);
+    if (crt != NULL) {
+        gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", crt->p, crt->q, crt->dp, crt->dq,
+            crt->qinv);
+        for (uint32_t i = 0; i < crt->extra; i++) {
+            gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n", crt->r[i], crt->dr[i], crt->tr[i]);
+        }
+    }
+}
+
+// Writes a private RSA key to pvfile in the binary key format. If crt is given, its components follow n and d.
+// IN: n, d, crt (key, crt may be NULL), pvfile (target file)
+// OUT: pvfile (updated target file)
+void rsa_write_priv_bin(mpz_t n, mpz_t d, rsa_crt *crt, FILE *pvfile) {
+    mpz_ptr fields[RSA_KEY_MAX_FIELDS];
+    uint8_t count = priv_fields(fields, n, d, crt, false);
+    io_out out;
+    io_out_open(&out, pvfile);
+    key_write_bin(&out, RSA_KEY_PRIV, crt != NULL ? RSA_KEY_FLAG_CRT : 0, fields, count, NULL);
+    io_out_close(&out);
+}
+
+// Writes a private RSA key into memory, in the hex or the binary key format, without stdio.
+// If crt is given, its components follow n and d.
+// IN: n, d, crt (key, crt may be NULL), binary (key format), out (output buffer, see rsa_buf)
+// OUT: out (key file contents)
+void rsa_write_priv_buf(mpz_t n, mpz_t d, rsa_crt *crt, bool binary, rsa_buf *out) {
+    mpz_ptr fields[RSA_KEY_MAX_FIELDS];
+    uint8_t count = priv_fields(fields, n, d, crt, false);
+    io_out o;
+    io_out_mem(&o, out->data, out->cap);
+    if (binary) {
+        key_write_bin(&o, RSA_KEY_PRIV, crt != NULL ? RSA_KEY_FLAG_CRT : 0, fields, count, NULL);
+    } else {
+        for (uint8_t i = 0; i < count; i++) {
+            io_put_hex(&o, fields[i]);
+        }
+    }
+    io_out_close(&o);
+    out->data = o.buf;
+    out->len = o.len;
+    out->cap = o.cap;
+}
+
+// Read private RSA key from pvfile, in the hex or the binary key format. Old hex key files only hold n and d;
+// a damaged binary key reads as zeros.
+// IN: n, d, crt (ordered list of desired variables in file, crt may be NULL), pvfile (target file, left open)
+// OUT: n, d, crt (ordered list of desired variables from pvfile, with crt->extra further primes),
+//      bool (whether crt was read)
+bool rsa_read_priv(mpz_t n, mpz_t d, rsa_crt *crt, FILE *pvfile) {
+    bool has_crt = false;
+    uint64_t start = stats_clock();
+    if (crt != NULL) {
+        crt->extra = 0;
+    }
+    if (key_is_bin(pvfile)) {
+        mpz_ptr fields[RSA_KEY_MAX_FIELDS];
+        uint8_t count = priv_fields(fields, n, d, crt, true);
+        uint8_t flags = 0, stored = 0;
+        io_in in;
+        io_in_open(&in, pvfile, true);
+        has_crt = key_read_bin(&in, RSA_KEY_PRIV, fields, count, 2, &flags, &stored, NULL) && crt != NULL
+                  && (flags & RSA_KEY_FLAG_CRT);
+        if (has_crt) {
+            crt->extra = priv_extra(stored < count ? stored : count);
+        }
+    } else {
+        gmp_fscanf(pvfile, "%Zx\n%Zx\n", n, d);
+        if (crt != NULL) {
+            has_crt = gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", crt->p, crt->q, crt->dp,
+                          crt->dq, crt->qinv)
+                      == 5;
+            while (has_crt && crt->extra < RSA_MAX_PRIMES - 2
+                   && gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n", crt->r[crt->extra], crt->dr[crt->extra],
+                          crt->tr[crt->extra])
+                          == 3) {
+                crt->extra++;
+            }
+        }
+    }
+    STAT_TIME(STAT_PARSE_NS, start);
+    return has_crt;
 }
 
-// Read private RSA key from pbfile
-// IN: n, d (ordered list of desired variables in file), pbfile (target file)
-// OUT: n, d (ordered list of desired variables from pbfile)
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
-    gmp_fscanf(pvfile, "%Zx\n%Zx\n", n, d);
-    fclose(pvfile);
+// Reads a private RSA key held in memory, in the hex or the binary key format, without stdio.
+// IN: n, d, crt (key, crt may be NULL), has_crt (whether crt was read), key (key file contents), len (bytes)
+// OUT: n, d, crt (key read, with crt->extra further primes), has_crt (crt given and held by the key),
+//      bool (false if the key is damaged or lacks n or d)
+bool rsa_read_priv_buf(mpz_t n, mpz_t d, rsa_crt *crt, bool *has_crt, const uint8_t *key, size_t len) {
+    uint64_t start = stats_clock();
+    mpz_ptr fields[RSA_KEY_MAX_FIELDS];
+    uint8_t count = priv_fields(fields, n, d, crt, true);
+    uint8_t got = 0;
+    io_in in;
+    bool ok = false;
+    if (key_mem_open(&in, key, len)) {
+        uint8_t flags = 0, stored = 0;
+        ok = key_read_bin(&in, RSA_KEY_PRIV, fields, count, 2, &flags, &stored, NULL);
+        got = ok && (flags & RSA_KEY_FLAG_CRT) ? (stored < count ? stored : count) : 2;
+    } else {
+        uint8_t *buf = (uint8_t *) malloc(len / 2 + 1);
+        while (got < count && mem_hex(&in, fields[got], buf, len / 2 + 1)) {
+            got++;
+        }
+        free(buf);
+        ok = got >= 2;
+    }
+    *has_crt = ok && crt != NULL && got >= 7;
+    if (crt != NULL) {
+        crt->extra = *has_crt ? priv_extra(got) : 0;
+    }
+    STAT_TIME(STAT_PARSE_NS, start);
+    return ok;
 }
 
 // Encrypts ciphertext c with s E(m) = c = m^e*(mod n).
@@ -99,31 +792,6 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
     pow_mod(c, m, e, n);
 }
 
-// Encrypts the contents of infile, writing the encrypted contents to outfile.
-// IN: INFILE, OUTFILE (files to be used), n (modulo), e(pub exponent)
-// OUT: outfile (encrypted file)
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-    size_t log_n = mpz_sizeinbase(n, 2) - 1;
-    size_t x = 0;
-    uint64_t block_size
-        = floor((double) (log_n - 1) / (double) (8)); // calculate block_size (step 1)
-    uint8_t *block = (uint8_t *) calloc(
-        block_size, sizeof(uint8_t)); // dynamically allocate array of block_size bytes (step 2)
-    block[0] = 0xFF; // set zeroth byte (step 3)
-
-    mpz_t m, encrypted;
-    mpz_inits(m, encrypted, NULL);
-
-    while ((x = fread(block + 1, sizeof(uint8_t), block_size - 1, infile)) > 0) {
-        mpz_import(m, x + 1, 1, sizeof(uint8_t), 1, 0, block);
-        rsa_encrypt(encrypted, m, e, n);
-        gmp_fprintf(outfile, "%Zx\n", encrypted);
-    }
-    //free up memory
-    mpz_clears(m, encrypted, NULL);
-    free(block);
-}
-
 // Decrypts ciphertext m with s D(c) = c = c^d*(mod n).$
 // IN: m (ciphertext), c(base), d(exponent), n(mod)$
 // OUT m (encrypted text)$
@@ -131,31 +799,37 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
     pow_mod(m, c, d, n);
 }
 
-// Decrypts the contents of infile, writing the encrypted contents to outfile.$
-// IN: INFILE, OUTFILE (files to be used), n (modulo), d(priv)$
-// OUT: outfile (decrypted file)$
+// Decrypts ciphertext c using the CRT: two half-size exponentiations mod p and mod q recombined with Garner's formula.
+// A multi-prime key then folds in each further prime the same way (RFC 8017, section 5.1.2).
+// IN: m (plaintext), c (ciphertext), crt (CRT private key)
+// OUT: m (decrypted text)
+void rsa_decrypt_crt(mpz_t m, mpz_t c, rsa_crt *crt) {
+    mpz_t m1, m2, h, prod;
+    mpz_inits(m1, m2, h, prod, NULL);
 
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
-    size_t log_n = mpz_sizeinbase(n, 2) - 1;
-    uint64_t block_size
-        = floor((double) (log_n - 1) / (double) (8)); // calculate block_size (step 1)
-    uint8_t *block = (uint8_t *) calloc(
-        block_size, sizeof(uint8_t)); // dynamically allocate array of block_size bytes (step 2)
+    mpz_mod(h, c, crt->p);
+    pow_mod(m1, h, crt->dp, crt->p); // m1 = c^dp mod p
+    mpz_mod(h, c, crt->q);
+    pow_mod(m2, h, crt->dq, crt->q); // m2 = c^dq mod q
 
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
+    mpz_sub(h, m1, m2); // h = qinv * (m1 - m2) mod p
+    mpz_mul(h, h, crt->qinv);
+    mpz_mod(h, h, crt->p);
+    mpz_mul(m, h, crt->q); // m = m2 + h * q
+    mpz_add(m, m, m2);
 
-    while (gmp_fscanf(infile, "%Zx\n", c) > 0) {
-        size_t x = 0;
-        rsa_decrypt(m, c, d, n);
-        block = (uint8_t *) realloc(block, block_size + mpz_sizeinbase(m, 2));
-        mpz_export(block, &x, 1, sizeof(uint8_t), 1, 0, m);
-        fwrite(block + 1, sizeof(uint8_t), x - 1, outfile); // account for 0xFF
+    mpz_mul(prod, crt->p, crt->q);
+    for (uint32_t i = 0; i < crt->extra; i++) {
+        mpz_mod(h, c, crt->r[i]);
+        pow_mod(m1, h, crt->dr[i], crt->r[i]); // m1 = c^dr mod r
+        mpz_sub(h, m1, m); // h = tr * (m1 - m) mod r
+        mpz_mul(h, h, crt->tr[i]);
+        mpz_mod(h, h, crt->r[i]);
+        mpz_addmul(m, h, prod); // m = m + h * (product of the primes before r)
+        mpz_mul(prod, prod, crt->r[i]);
     }
 
-    //free up memory
-    mpz_clears(c, m, NULL);
-    free(block);
+    mpz_clears(m1, m2, h, prod, NULL);
 }
 
 // RSA signing signature s on message m using private key d and public mod n
@@ -165,6 +839,13 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
     pow_mod(s, m, d, n);
 }
 
+// RSA signing signature s on message m using the CRT components of the private key
+// IN: s (signature), m(message), crt (CRT private key)
+// OUT: s (signature)
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_crt *crt) {
+    rsa_decrypt_crt(s, m, crt);
+}
+
 // Performs RSA verification, returning true if signature s is verified and false otherwise.
 // IN: m (message), s (signature), e(exponent), n(mod)
 // OUT: bool (if the message is properly signed)
@@ -179,3 +860,1074 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
     mpz_clear(fdsa);
     return false;
 }
+
+// Builds the per-key context for key (n, exp): block geometry, Montgomery contexts, scratch variables and buffers.
+// The Montgomery contexts use the fixed-width mpn backend when the modulus is small enough for it, and the
+// multi-buffer contexts are ready when the CPU has the kernel for them.
+// exp is e for a public key and d for a private key; crt may be given for a private key to decrypt and sign with the CRT.
+// IN: ctx (context), n (modulus), exp (exponent), crt (CRT private key, may be NULL)
+// OUT: ctx (initialized context)
+void rsa_key_ctx_init(rsa_key_ctx *ctx, mpz_t n, mpz_t exp, rsa_crt *crt) {
+    mpz_inits(ctx->n, ctx->exp, ctx->m1, ctx->m2, ctx->h, NULL);
+    mpz_set(ctx->n, n);
+    mpz_set(ctx->exp, exp);
+    ctx->short_exp = mpz_sizeinbase(exp, 2) <= RSA_SHORT_EXP_BITS;
+
+    // block_size = floor((log2(n) - 1) / 8) in integer arithmetic
+    size_t bits = mpz_sizeinbase(n, 2);
+    ctx->block_size = bits >= 2 ? (bits - 2) / 8 : 0;
+    ctx->mod_bytes = (bits + 7) / 8;
+    ctx->block = (uint8_t *) calloc(ctx->mod_bytes + 1, sizeof(uint8_t));
+    ctx->cblock = (uint8_t *) calloc(ctx->mod_bytes + 1, sizeof(uint8_t));
+
+    mont_init(&ctx->mont_n, n);
+    mont_use_fixed(&ctx->mont_n);
+    mb_init(&ctx->mb_n, n);
+    for (int i = 0; i < MB_LANES; i++) {
+        mpz_init(ctx->lane[i]);
+    }
+    ctx->has_crt = crt != NULL;
+    rsa_crt_init(&ctx->crt);
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_init(ctx->rprod[i]);
+    }
+    if (ctx->has_crt) {
+        crt_copy(&ctx->crt, crt);
+        mont_init(&ctx->mont_p, crt->p);
+        mont_init(&ctx->mont_q, crt->q);
+        mont_use_fixed(&ctx->mont_p);
+        mont_use_fixed(&ctx->mont_q);
+        mb_init(&ctx->mb_p, crt->p);
+        mb_init(&ctx->mb_q, crt->q);
+        for (uint32_t i = 0; i < crt->extra; i++) {
+            mont_init(&ctx->mont_r[i], crt->r[i]);
+            mont_use_fixed(&ctx->mont_r[i]);
+            mb_init(&ctx->mb_r[i], crt->r[i]);
+            mpz_mul(ctx->rprod[i], i == 0 ? crt->p : ctx->rprod[i - 1], i == 0 ? crt->q : crt->r[i - 1]);
+        }
+    }
+}
+
+// Builds a second context for the same key as src, for use by another thread.
+// IN: ctx (context), src (context to copy the key from)
+// OUT: ctx (initialized context)
+void rsa_key_ctx_copy(rsa_key_ctx *ctx, rsa_key_ctx *src) {
+    rsa_key_ctx_init(ctx, src->n, src->exp, src->has_crt ? &src->crt : NULL);
+}
+
+// Clears the memory used by a per-key context.
+// IN: ctx (context)
+// OUT: N/A
+void rsa_key_ctx_clear(rsa_key_ctx *ctx) {
+    if (ctx->has_crt) {
+        mont_clear(&ctx->mont_p);
+        mont_clear(&ctx->mont_q);
+        mb_clear(&ctx->mb_p);
+        mb_clear(&ctx->mb_q);
+        for (uint32_t i = 0; i < ctx->crt.extra; i++) {
+            mont_clear(&ctx->mont_r[i]);
+            mb_clear(&ctx->mb_r[i]);
+        }
+    }
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_clear(ctx->rprod[i]);
+    }
+    mont_clear(&ctx->mont_n);
+    mb_clear(&ctx->mb_n);
+    for (int i = 0; i < MB_LANES; i++) {
+        mpz_clear(ctx->lane[i]);
+    }
+    rsa_crt_clear(&ctx->crt);
+    mpz_clears(ctx->n, ctx->exp, ctx->m1, ctx->m2, ctx->h, NULL);
+    free(ctx->block);
+    free(ctx->cblock);
+}
+
+// Computes out = base^exp mod n by plain left-to-right square-and-multiply for a short exponent such as 65537.
+// With only a handful of multiplications, converting into and out of Montgomery form would cost more than it saves.
+// IN: ctx (context with a short exponent), out (result), base (base)
+// OUT: out (base^exp mod n)
+static void short_pow(rsa_key_ctx *ctx, mpz_t out, mpz_t base) {
+    mpz_mod(ctx->m2, base, ctx->n);
+    mpz_set_ui(ctx->m1, 1);
+    for (mp_bitcnt_t i = mpz_sizeinbase(ctx->exp, 2); i-- > 0;) {
+        mpz_mul(ctx->m1, ctx->m1, ctx->m1);
+        mpz_mod(ctx->m1, ctx->m1, ctx->n);
+        if (mpz_tstbit(ctx->exp, i)) {
+            mpz_mul(ctx->m1, ctx->m1, ctx->m2);
+            mpz_mod(ctx->m1, ctx->m1, ctx->n);
+        }
+    }
+    mpz_set(out, ctx->m1);
+}
+
+// Encrypts m into c = m^e mod n using a public key context.
+// IN: ctx (public key context), c (ciphertext), m (message)
+// OUT: c (encrypted text)
+void rsa_encrypt_ctx(rsa_key_ctx *ctx, mpz_t c, mpz_t m) {
+    if (ctx->short_exp) {
+        short_pow(ctx, c, m);
+        return;
+    }
+    mont_pow(&ctx->mont_n, c, m, ctx->exp);
+}
+
+// Recombines the CRT halves m1 = m mod p and m2 = m mod q of a private key operation into m. m may alias m1.
+// IN: ctx (private key context with the CRT), m (result), m1 m2 (halves)
+// OUT: m (result mod n)
+static void crt_combine(rsa_key_ctx *ctx, mpz_t m, mpz_t m1, mpz_t m2) {
+    rsa_crt *crt = &ctx->crt;
+    mpz_sub(ctx->h, m1, m2); // h = qinv * (m1 - m2) mod p
+    mpz_mul(ctx->h, ctx->h, crt->qinv);
+    mpz_mod(ctx->h, ctx->h, crt->p);
+    mpz_mul(m, ctx->h, crt->q); // m = m2 + h * q
+    mpz_add(m, m, m2);
+}
+
+// Folds mi = m mod r[i] of a multi-prime key into m, the result so far mod the product of the primes before r[i].
+// IN: ctx (private key context with further primes), m (result so far), i (prime), mi (result mod r[i])
+// OUT: m (result mod the product of the primes up to r[i])
+static void crt_combine_extra(rsa_key_ctx *ctx, mpz_t m, uint32_t i, mpz_t mi) {
+    rsa_crt *crt = &ctx->crt;
+    mpz_sub(ctx->h, mi, m); // h = tr * (mi - m) mod r
+    mpz_mul(ctx->h, ctx->h, crt->tr[i]);
+    mpz_mod(ctx->h, ctx->h, crt->r[i]);
+    mpz_addmul(m, ctx->h, ctx->rprod[i]); // m = m + h * (product of the primes before r)
+}
+
+// Decrypts c into m = c^d mod n using a private key context, through the CRT when the context has it.
+// IN: ctx (private key context), m (plaintext), c (ciphertext)
+// OUT: m (decrypted text)
+void rsa_decrypt_ctx(rsa_key_ctx *ctx, mpz_t m, mpz_t c) {
+    if (!ctx->has_crt) {
+        mont_pow(&ctx->mont_n, m, c, ctx->exp);
+        return;
+    }
+    rsa_crt *crt = &ctx->crt;
+    mont_pow(&ctx->mont_p, ctx->m1, c, crt->dp); // m1 = c^dp mod p
+    mont_pow(&ctx->mont_q, ctx->m2, c, crt->dq); // m2 = c^dq mod q
+    if (crt->extra == 0) {
+        crt_combine(ctx, m, ctx->m1, ctx->m2);
+        return;
+    }
+    // m may alias c, which the further primes still need
+    crt_combine(ctx, ctx->m1, ctx->m1, ctx->m2);
+    for (uint32_t i = 0; i < crt->extra; i++) {
+        mont_pow(&ctx->mont_r[i], ctx->m2, c, crt->dr[i]); // m2 = c^dr mod r
+        crt_combine_extra(ctx, ctx->m1, i, ctx->m2);
+    }
+    mpz_set(m, ctx->m1);
+}
+
+// Signs m into s = m^d mod n using a private key context.
+// IN: ctx (private key context), s (signature), m (message)
+// OUT: s (signature)
+void rsa_sign_ctx(rsa_key_ctx *ctx, mpz_t s, mpz_t m) {
+    rsa_decrypt_ctx(ctx, s, m);
+}
+
+// Verifies signature s on m using a public key context.
+// IN: ctx (public key context), m (message), s (signature)
+// OUT: bool (if the message is properly signed)
+bool rsa_verify_ctx(rsa_key_ctx *ctx, mpz_t m, mpz_t s) {
+    if (ctx->short_exp) {
+        short_pow(ctx, ctx->h, s);
+    } else {
+        mont_pow(&ctx->mont_n, ctx->h, s, ctx->exp);
+    }
+    return mpz_cmp(ctx->h, m) == 0;
+}
+
+// Encrypts a group of count blocks (at most MB_LANES), c[i] = m[i]^e mod n, side by side on the multi-buffer
+// kernel when the context has it and the group is large enough to pay for it, otherwise one at a time.
+// IN: ctx (public key context), c (ciphertexts), m (messages), count (number of blocks)
+// OUT: c (encrypted blocks)
+static void encrypt_lanes(rsa_key_ctx *ctx, mpz_t *c, mpz_t *m, uint64_t count) {
+    if (!ctx->mb_n.ready || count < MB_MIN_LANES) {
+        for (uint64_t i = 0; i < count; i++) {
+            rsa_encrypt_ctx(ctx, c[i], m[i]);
+        }
+        return;
+    }
+    mb_pow(&ctx->mb_n, c, m, (uint32_t) count, ctx->exp);
+}
+
+// Decrypts a group of count blocks (at most MB_LANES), m[i] = c[i]^d mod n, as encrypt_lanes does. With the CRT
+// the halves mod p and mod q are each taken for the whole group and then recombined block by block.
+// IN: ctx (private key context), m (plaintexts), c (ciphertexts), count (number of blocks)
+// OUT: m (decrypted blocks)
+static void decrypt_lanes(rsa_key_ctx *ctx, mpz_t *m, mpz_t *c, uint64_t count) {
+    bool ready = ctx->has_crt ? ctx->mb_p.ready && ctx->mb_q.ready : ctx->mb_n.ready;
+    for (uint32_t i = 0; ctx->has_crt && i < ctx->crt.extra; i++) {
+        ready = ready && ctx->mb_r[i].ready;
+    }
+    if (!ready || count < MB_MIN_LANES) {
+        for (uint64_t i = 0; i < count; i++) {
+            rsa_decrypt_ctx(ctx, m[i], c[i]);
+        }
+        return;
+    }
+    if (!ctx->has_crt) {
+        mb_pow(&ctx->mb_n, m, c, (uint32_t) count, ctx->exp);
+        return;
+    }
+    mb_pow(&ctx->mb_p, m, c, (uint32_t) count, ctx->crt.dp);
+    mb_pow(&ctx->mb_q, ctx->lane, c, (uint32_t) count, ctx->crt.dq);
+    for (uint64_t i = 0; i < count; i++) {
+        crt_combine(ctx, m[i], m[i], ctx->lane[i]);
+    }
+    for (uint32_t j = 0; j < ctx->crt.extra; j++) {
+        mb_pow(&ctx->mb_r[j], ctx->lane, c, (uint32_t) count, ctx->crt.dr[j]);
+        for (uint64_t i = 0; i < count; i++) {
+            crt_combine_extra(ctx, m[i], j, ctx->lane[i]);
+        }
+    }
+}
+
+// Exponentiation job shared by the workers of the file and batch functions.
+typedef struct {
+    mpz_t *src; // input blocks (messages for the batch functions)
+    mpz_t *dst; // output blocks, same order as src (signatures, read-only when verifying)
+    rsa_key_ctx **ctxs; // one key context per worker, the first being the caller's
+    uint32_t workers; // number of entries in ctxs
+    uint64_t count; // number of blocks
+    uint8_t *ok; // verification result bitmap
+} BlockJob;
+
+// Allocates and initializes an array of count mpz variables.
+// IN: count (number of variables)
+// OUT: mpz_t * (initialized array, NULL if it could not be allocated)
+static mpz_t *blocks_init(uint64_t count) {
+    mpz_t *blocks = (mpz_t *) calloc(count, sizeof(mpz_t));
+    if (blocks == NULL) {
+        return NULL;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_init(blocks[i]);
+    }
+    return blocks;
+}
+
+// Clears and frees an array of count mpz variables.
+// IN: blocks (array), count (number of variables)
+// OUT: N/A
+static void blocks_clear(mpz_t *blocks, uint64_t count) {
+    if (blocks == NULL) {
+        return;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_clear(blocks[i]);
+    }
+    free(blocks);
+}
+
+// Returns the blocks of group i of a BlockJob: blocks MB_LANES * i onwards, at most MB_LANES of them.
+// IN: job (job), i (group), count (number of blocks in the group)
+// OUT: uint64_t (first block), count (number of blocks)
+static uint64_t group_blocks(BlockJob *job, uint64_t i, uint64_t *count) {
+    uint64_t first = MB_LANES * i;
+    *count = job->count - first < MB_LANES ? job->count - first : MB_LANES;
+    return first;
+}
+
+// Number of groups the blocks of a BlockJob are handed to workers in.
+// IN: count (number of blocks)
+// OUT: uint64_t (number of groups)
+static uint64_t groups(uint64_t count) {
+    return (count + MB_LANES - 1) / MB_LANES;
+}
+
+// Pool work function encrypting group i of a BlockJob.
+static void encrypt_group(void *arg, uint64_t i, uint32_t worker) {
+    BlockJob *job = (BlockJob *) arg;
+    uint64_t count;
+    uint64_t first = group_blocks(job, i, &count);
+    encrypt_lanes(job->ctxs[worker], job->dst + first, job->src + first, count);
+}
+
+// Pool work function decrypting group i of a BlockJob.
+static void decrypt_group(void *arg, uint64_t i, uint32_t worker) {
+    BlockJob *job = (BlockJob *) arg;
+    uint64_t count;
+    uint64_t first = group_blocks(job, i, &count);
+    decrypt_lanes(job->ctxs[worker], job->dst + first, job->src + first, count);
+}
+
+// Pool work function signing the messages of group i of a BlockJob.
+static void sign_group(void *arg, uint64_t i, uint32_t worker) {
+    decrypt_group(arg, i, worker);
+}
+
+// Pool work function verifying signatures 8i to 8i+7 of a BlockJob into byte i of the bitmap.
+// Working a byte at a time keeps workers from writing to the same byte.
+static void verify_byte(void *arg, uint64_t i, uint32_t worker) {
+    BlockJob *job = (BlockJob *) arg;
+    rsa_key_ctx *ctx = job->ctxs[worker];
+    uint8_t bits = 0;
+    for (uint64_t j = 8 * i; j < 8 * i + 8 && j < job->count; j += MB_LANES) {
+        uint64_t count = job->count - j < MB_LANES ? job->count - j : MB_LANES;
+        encrypt_lanes(ctx, ctx->lane, job->dst + j, count);
+        for (uint64_t k = 0; k < count; k++) {
+            if (mpz_cmp(ctx->lane[k], job->src[j + k]) == 0) {
+                bits |= (uint8_t) (1 << ((j + k) % 8));
+            }
+        }
+    }
+    job->ok[i] = bits;
+}
+
+// Returns the number of worker threads requested by opts, 1 meaning serial, at most POOL_MAX_THREADS.
+// IN: opts (file options, may be NULL)
+// OUT: uint32_t (number of threads)
+static uint32_t opts_threads(const rsa_file_opts *opts) {
+    if (opts == NULL || opts->threads <= 1) {
+        return 1;
+    }
+    return opts->threads < POOL_MAX_THREADS ? opts->threads : POOL_MAX_THREADS;
+}
+
+// Tears down what job_init set up, also after it failed part way.
+// IN: job (job), pool (pool handle), batch (blocks per batch)
+// OUT: N/A
+static void job_clear(BlockJob *job, Pool **pool, uint64_t batch) {
+    pool_delete(pool);
+    for (uint32_t w = 1; job->ctxs != NULL && w < job->workers; w++) {
+        if (job->ctxs[w] != NULL) {
+            rsa_key_ctx_clear(job->ctxs[w]);
+            free(job->ctxs[w]);
+        }
+    }
+    free(job->ctxs);
+    if (batch > 0) {
+        blocks_clear(job->src, batch);
+        blocks_clear(job->dst, batch);
+    }
+}
+
+// Sets up the worker pool and per-worker key contexts for a job on ctx. Worker 0 uses ctx itself,
+// so the serial path needs no pool and no extra contexts.
+// IN: job (job to set up), pool (pool handle), ctx (key context), threads (requested threads),
+//     batch (blocks per batch, 0 when the caller supplies the blocks)
+// OUT: job (blocks and contexts), pool (worker pool or NULL when serial),
+//      bool (false if memory ran out, with everything set up so far released)
+static bool job_init(BlockJob *job, Pool **pool, rsa_key_ctx *ctx, uint32_t threads, uint64_t batch) {
+    *pool = threads > 1 ? pool_create(threads) : NULL;
+    job->workers = *pool != NULL ? pool_threads(*pool) : 1;
+    job->src = batch > 0 ? blocks_init(batch) : NULL;
+    job->dst = batch > 0 ? blocks_init(batch) : NULL;
+    job->count = 0;
+    job->ok = NULL;
+    job->ctxs = (rsa_key_ctx **) calloc(job->workers, sizeof(rsa_key_ctx *));
+    bool ok = job->ctxs != NULL && (batch == 0 || (job->src != NULL && job->dst != NULL));
+    if (ok) {
+        job->ctxs[0] = ctx;
+    }
+    for (uint32_t w = 1; ok && w < job->workers; w++) {
+        job->ctxs[w] = (rsa_key_ctx *) malloc(sizeof(rsa_key_ctx));
+        ok = job->ctxs[w] != NULL;
+        if (ok) {
+            rsa_key_ctx_copy(job->ctxs[w], ctx);
+        }
+    }
+    if (!ok) {
+        job_clear(job, pool, batch);
+    }
+    return ok;
+}
+
+// Runs fn over count work items of job (groups of blocks, or bitmap bytes when verifying), on the pool if
+// there is one, otherwise on the calling thread.
+// IN: pool (worker pool, may be NULL), fn (work function), job (blocks), count (number of work items)
+// OUT: job->dst (processed blocks)
+static void run_blocks(Pool *pool, pool_fn fn, BlockJob *job, uint64_t count) {
+    uint64_t start = stats_clock();
+    if (pool != NULL) {
+        pool_run(pool, fn, job, count);
+    } else {
+        for (uint64_t i = 0; i < count; i++) {
+            fn(job, i, 0);
+        }
+    }
+    STAT_TIME(STAT_EXP_NS, start);
+    STAT_ADD(STAT_BLOCKS, job->count);
+}
+
+// Signs count messages with one private key context, s[i] = m[i]^d mod n, spread over threads workers.
+// IN: ctx (private key context), s (signatures), m (messages), count (number of messages), threads (0 or 1: serial)
+// OUT: s (signatures), bool (false if memory for the workers ran out and nothing was signed)
+bool rsa_sign_batch(rsa_key_ctx *ctx, mpz_t *s, mpz_t *m, uint64_t count, uint32_t threads) {
+    BlockJob job;
+    Pool *pool;
+    if (!job_init(&job, &pool, ctx, threads, 0)) {
+        return false;
+    }
+    job.src = m;
+    job.dst = s;
+    job.count = count;
+    run_blocks(pool, sign_group, &job, groups(count));
+    job_clear(&job, &pool, 0);
+    return true;
+}
+
+// Verifies count signatures against one public key context, spread over threads workers.
+// Bit i % 8 of ok[i / 8] is set when s[i] is a valid signature on m[i]; ok holds (count + 7) / 8 bytes.
+// IN: ctx (public key context), m (messages), s (signatures), count (number of pairs), threads (0 or 1: serial), ok (bitmap)
+// OUT: ok (result bitmap), uint64_t (number of valid signatures)
+uint64_t rsa_verify_batch(
+    rsa_key_ctx *ctx, mpz_t *m, mpz_t *s, uint64_t count, uint32_t threads, uint8_t *ok) {
+    BlockJob job;
+    Pool *pool;
+    if (!job_init(&job, &pool, ctx, threads, 0)) {
+        memset(ok, 0, (count + 7) / 8);
+        return 0;
+    }
+    job.src = m;
+    job.dst = s;
+    job.count = count;
+    job.ok = ok;
+    run_blocks(pool, verify_byte, &job, (count + 7) / 8);
+    job_clear(&job, &pool, 0);
+
+    uint64_t valid = 0;
+    for (uint64_t i = 0; i < (count + 7) / 8; i++) {
+        valid += __builtin_popcount(ok[i]);
+    }
+    return valid;
+}
+
+// Writes a container header with the given magic and flags for modulus size mod_bytes to out.
+// IN: out (output), magic (RSA_BIN_MAGIC or RSA_HYBRID_MAGIC), flags (RSA_BIN_FLAG_*), mod_bytes (bytes per ciphertext block)
+// OUT: out (updated output)
+static void bin_write_header(io_out *out, const char *magic, uint8_t flags, size_t mod_bytes) {
+    uint8_t header[RSA_BIN_HEADER_SIZE] = { 0 };
+    memcpy(header, magic, 4);
+    header[4] = RSA_BIN_VERSION;
+    header[5] = flags;
+    for (int i = 0; i < 4; i++) {
+        header[8 + i] = (uint8_t) (mod_bytes >> (8 * (3 - i)));
+    }
+    io_write(out, header, RSA_BIN_HEADER_SIZE);
+}
+
+// Checks a complete container header.
+// IN: header (RSA_BIN_HEADER_SIZE bytes), mod_bytes (expected bytes per ciphertext block), flags (header flags)
+// OUT: int (1 if binary, 2 if hybrid, -1 if the header is damaged or for a different modulus size),
+//      flags (the header's RSA_BIN_FLAG_* bits)
+static int bin_check_header(const uint8_t *header, size_t mod_bytes, uint8_t *flags) {
+    if (header[4] != RSA_BIN_VERSION) {
+        return -1;
+    }
+    *flags = header[5];
+    int kind = memcmp(header, RSA_BIN_MAGIC, 4) == 0      ? 1
+               : memcmp(header, RSA_HYBRID_MAGIC, 4) == 0 ? 2
+                                                          : -1;
+    size_t size = 0;
+    for (int i = 0; i < 4; i++) {
+        size = (size << 8) | header[8 + i];
+    }
+    return size == mod_bytes ? kind : -1;
+}
+
+// Checks whether infile starts with a binary or hybrid container header, consuming it if so.
+// Hex files never start with the magic, so only the first byte is looked at before deciding.
+// IN: infile (ciphertext file), mod_bytes (expected bytes per ciphertext block), flags (header flags)
+// OUT: int (1 if binary, 2 if hybrid, 0 if hex, -1 if the header is damaged or for a different modulus size),
+//      flags (the header's RSA_BIN_FLAG_* bits, 0 for hex)
+static int bin_read_header(FILE *infile, size_t mod_bytes, uint8_t *flags) {
+    *flags = 0;
+    int first = fgetc(infile);
+    if (first == EOF) {
+        return 0;
+    }
+    if (first != RSA_BIN_MAGIC[0]) {
+        ungetc(first, infile);
+        return 0;
+    }
+    uint8_t header[RSA_BIN_HEADER_SIZE];
+    header[0] = (uint8_t) first;
+    if (fread(header + 1, sizeof(uint8_t), RSA_BIN_HEADER_SIZE - 1, infile) != RSA_BIN_HEADER_SIZE - 1) {
+        return -1;
+    }
+    return bin_check_header(header, mod_bytes, flags);
+}
+
+// Like bin_read_header, for input read from memory.
+// IN: in (input from memory), mod_bytes (expected bytes per ciphertext block), flags (header flags)
+// OUT: in (past the header), int (as for bin_read_header), flags (header flags)
+static int bin_read_header_mem(io_in *in, size_t mod_bytes, uint8_t *flags) {
+    *flags = 0;
+    if (in->map_size == 0 || in->map[0] != RSA_BIN_MAGIC[0]) {
+        return 0;
+    }
+    if (in->map_size < RSA_BIN_HEADER_SIZE) {
+        return -1;
+    }
+    in->pos = RSA_BIN_HEADER_SIZE;
+    return bin_check_header(in->map, mod_bytes, flags);
+}
+
+// Writes block c to out either as a hex line or as a fixed-width big-endian binary block,
+// formatting it straight into the output buffer.
+// IN: out (output), c (block), binary (format), mod_bytes (block width)
+// OUT: out (updated output)
+static void write_cipher_block(io_out *out, mpz_t c, bool binary, size_t mod_bytes) {
+    if (!binary) {
+        char *line = (char *) io_reserve(out, mpz_sizeinbase(c, 16) + 2);
+        uint64_t start = stats_clock();
+        mpz_get_str(line, 16, c);
+        size_t len = strlen(line);
+        line[len] = '\n';
+        STAT_TIME(STAT_PARSE_NS, start);
+        io_commit(out, len + 1);
+        return;
+    }
+    uint8_t *buf = io_reserve(out, mod_bytes);
+    uint64_t start = stats_clock();
+    size_t bytes = (mpz_sizeinbase(c, 2) + 7) / 8;
+    memset(buf, 0, mod_bytes - bytes);
+    mpz_export(buf + mod_bytes - bytes, NULL, 1, sizeof(uint8_t), 1, 0, c);
+    STAT_TIME(STAT_PARSE_NS, start);
+    io_commit(out, mod_bytes);
+}
+
+// Reads the next block c from in in the given format. Hex input is always read through the stream, unless
+// it is read from memory.
+// IN: in (ciphertext input), c (block), binary (format), buf (scratch of mod_bytes bytes), mod_bytes (block width)
+// OUT: c (block read), int (1 if a block was read, 0 at end of file, -1 if a binary block is cut short)
+static int read_cipher_block(io_in *in, mpz_t c, bool binary, uint8_t *buf, size_t mod_bytes) {
+    if (!binary && in->file == NULL) {
+        uint64_t start = stats_clock();
+        size_t pos = in->pos;
+        bool read = mem_hex(in, c, buf, mod_bytes);
+        STAT_TIME(STAT_PARSE_NS, start);
+        if (read) {
+            STAT_ADD(STAT_BYTES_IN, in->pos - pos);
+        }
+        return read;
+    }
+    if (!binary) {
+        // reading and parsing a hex line are one call, so all of it counts as parsing
+        uint64_t start = stats_clock();
+        bool read = gmp_fscanf(in->file, "%Zx\n", c) > 0;
+        STAT_TIME(STAT_PARSE_NS, start);
+        if (read) {
+            STAT_ADD(STAT_BYTES_IN, mpz_sizeinbase(c, 16) + 1);
+        }
+        return read;
+    }
+    size_t got = 0;
+    const uint8_t *p = io_next(in, buf, mod_bytes, &got);
+    if (got != mod_bytes) {
+        return got == 0 ? 0 : -1;
+    }
+    uint64_t start = stats_clock();
+    mpz_import(c, mod_bytes, 1, sizeof(uint8_t), 1, 0, p);
+    STAT_TIME(STAT_PARSE_NS, start);
+    return 1;
+}
+
+// Writes a big-endian uint64 to p.
+static void put_be64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t) (v >> (8 * (7 - i)));
+    }
+}
+
+// Reads a big-endian uint64 from p.
+static uint64_t get_be64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// Ends the blocks of an indexed binary container: the all-zero end block, the index entries and the trailer.
+// IN: out (output), index (entries as (plaintext offset, container offset) pairs), entries (number of entries),
+//     blocks (data blocks written), plain_bytes (plaintext length), mod_bytes (block width)
+// OUT: out (updated output)
+static void write_index(io_out *out, uint64_t *index, size_t entries, uint64_t blocks,
+    uint64_t plain_bytes, size_t mod_bytes) {
+    memset(io_reserve(out, mod_bytes), 0, mod_bytes);
+    io_commit(out, mod_bytes);
+    uint64_t index_offset = RSA_BIN_HEADER_SIZE + (blocks + 1) * mod_bytes;
+    for (size_t i = 0; i < 2 * entries; i++) {
+        put_be64(io_reserve(out, 8), index[i]);
+        io_commit(out, 8);
+    }
+    uint8_t *t = io_reserve(out, RSA_INDEX_TRAILER_SIZE);
+    memcpy(t, RSA_INDEX_MAGIC, 4);
+    for (int i = 0; i < 4; i++) {
+        t[4 + i] = (uint8_t) (RSA_INDEX_STRIDE >> (8 * (3 - i)));
+    }
+    put_be64(t + 8, blocks);
+    put_be64(t + 16, plain_bytes);
+    put_be64(t + 24, index_offset);
+    io_commit(out, RSA_INDEX_TRAILER_SIZE);
+}
+
+// Builds the nonce of chunk index: a flag byte marking the final chunk, three zero bytes and the
+// big-endian index, so chunks can be neither reordered nor dropped from the end undetected.
+// IN: nonce (output), index (chunk number), final (last chunk of the stream)
+// OUT: nonce (12-byte nonce)
+static void hybrid_nonce(uint8_t nonce[AEAD_NONCE_BYTES], uint64_t index, bool final) {
+    memset(nonce, 0, AEAD_NONCE_BYTES);
+    nonce[0] = final;
+    for (int i = 0; i < 8; i++) {
+        nonce[4 + i] = (uint8_t) (index >> (8 * (7 - i)));
+    }
+}
+
+// Encrypts in hybrid mode: a random session key from getrandom(2) is wrapped with RSA once,
+// then the data is sealed with ChaCha20-Poly1305 in chunks of up to RSA_HYBRID_CHUNK bytes.
+// Each chunk is a big-endian uint32 length with the top bit marking the final chunk (also the
+// chunk's additional data), the ciphertext and its tag. A file that fills its last chunk exactly
+// ends with an empty final chunk. Chunks are sealed from the input mapping straight into the output buffer.
+// IN: ctx (public key context), in (input), out (output)
+// OUT: out (encrypted file), bool (false if no session key could be drawn or n is too small to wrap it)
+static bool hybrid_encrypt(rsa_key_ctx *ctx, io_in *in, io_out *out) {
+    uint8_t key[AEAD_KEY_BYTES];
+    if (ctx->block_size < 2) {
+        return false;
+    }
+    size_t got = 0;
+    while (got < AEAD_KEY_BYTES) {
+        ssize_t r = getrandom(key + got, AEAD_KEY_BYTES - got, 0);
+        if (r < 0 && errno != EINTR) {
+            return false;
+        }
+        got += r > 0 ? (size_t) r : 0;
+    }
+
+    // wrap the key in as many blocks as it takes, each laid out like a plaintext block
+    bin_write_header(out, RSA_HYBRID_MAGIC, 0, ctx->mod_bytes);
+    size_t per_block = ctx->block_size - 1;
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+    ctx->block[0] = 0xFF;
+    for (size_t off = 0; off < AEAD_KEY_BYTES; off += per_block) {
+        size_t x = AEAD_KEY_BYTES - off < per_block ? AEAD_KEY_BYTES - off : per_block;
+        memcpy(ctx->block + 1, key + off, x);
+        mpz_import(m, x + 1, 1, sizeof(uint8_t), 1, 0, ctx->block);
+        rsa_encrypt_ctx(ctx, c, m);
+        write_cipher_block(out, c, true, ctx->mod_bytes);
+    }
+    mpz_clears(m, c, NULL);
+
+    uint8_t *buf = in->map == NULL ? (uint8_t *) malloc(RSA_HYBRID_CHUNK) : NULL;
+    uint8_t nonce[AEAD_NONCE_BYTES];
+    bool final = false;
+    for (uint64_t index = 0; !final; index++) {
+        size_t x = 0;
+        const uint8_t *p = io_next(in, buf, RSA_HYBRID_CHUNK, &x);
+        final = x < RSA_HYBRID_CHUNK;
+        uint32_t len = (uint32_t) x | (final ? RSA_HYBRID_FINAL : 0);
+        uint8_t *chunk = io_reserve(out, 4 + x + AEAD_TAG_BYTES);
+        for (int i = 0; i < 4; i++) {
+            chunk[i] = (uint8_t) (len >> (8 * (3 - i)));
+        }
+        hybrid_nonce(nonce, index, final);
+        uint64_t start = stats_clock();
+        aead_seal(key, nonce, chunk, 4, p, chunk + 4, x, chunk + 4 + x);
+        STAT_TIME(STAT_AEAD_NS, start);
+        io_commit(out, 4 + x + AEAD_TAG_BYTES);
+    }
+
+    memset(key, 0, sizeof(key));
+    free(buf);
+    return true;
+}
+
+// Decrypts the body of a hybrid container whose header has been read: unwraps the session key,
+// then checks and decrypts each chunk in turn. Only authenticated chunks are written out.
+// IN: ctx (private key context), in (input), out (output)
+// OUT: out (decrypted file), bool (false if the key does not unwrap, a chunk fails its tag or the stream ends early)
+static bool hybrid_decrypt(rsa_key_ctx *ctx, io_in *in, io_out *out) {
+    uint8_t key[AEAD_KEY_BYTES];
+    if (ctx->block_size < 2) {
+        return false;
+    }
+    size_t per_block = ctx->block_size - 1;
+    bool ok = true;
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+    for (size_t off = 0; ok && off < AEAD_KEY_BYTES; off += per_block) {
+        size_t x = AEAD_KEY_BYTES - off < per_block ? AEAD_KEY_BYTES - off : per_block;
+        ok = read_cipher_block(in, c, true, ctx->cblock, ctx->mod_bytes) == 1;
+        if (ok) {
+            rsa_decrypt_ctx(ctx, m, c);
+            ok = (mpz_sizeinbase(m, 2) + 7) / 8 == x + 1;
+        }
+        if (ok) {
+            mpz_export(ctx->block, NULL, 1, sizeof(uint8_t), 1, 0, m);
+            ok = ctx->block[0] == 0xFF;
+            memcpy(key + off, ctx->block + 1, x);
+        }
+    }
+    mpz_clears(m, c, NULL);
+    if (!ok) {
+        return false;
+    }
+
+    uint8_t *buf = in->map == NULL ? (uint8_t *) malloc(RSA_HYBRID_CHUNK + AEAD_TAG_BYTES) : NULL;
+    uint8_t nonce[AEAD_NONCE_BYTES], head[4] = { 0 };
+    bool final = false;
+    for (uint64_t index = 0; ok && !final; index++) {
+        size_t got = 0;
+        const uint8_t *h = io_next(in, head, sizeof(head), &got);
+        ok = got == sizeof(head);
+        uint32_t len = 0;
+        for (int i = 0; ok && i < 4; i++) {
+            len = (len << 8) | h[i];
+        }
+        final = (len & RSA_HYBRID_FINAL) != 0;
+        size_t x = len & ~RSA_HYBRID_FINAL;
+        ok = ok && x <= RSA_HYBRID_CHUNK && (x < RSA_HYBRID_CHUNK || !final);
+        const uint8_t *p = ok ? io_next(in, buf, x + AEAD_TAG_BYTES, &got) : NULL;
+        ok = ok && got == x + AEAD_TAG_BYTES;
+        hybrid_nonce(nonce, index, final);
+        uint8_t *dst = ok ? io_reserve(out, x) : NULL;
+        uint64_t start = stats_clock();
+        ok = ok && aead_open(key, nonce, h, sizeof(head), p, dst, x, p + x);
+        STAT_TIME(STAT_AEAD_NS, start);
+        if (ok) {
+            io_commit(out, x);
+        }
+    }
+
+    memset(key, 0, sizeof(key));
+    free(buf);
+    return ok;
+}
+
+// Encrypts all of in with a public key context, writing the encrypted contents to out.
+// Blocks are read in batches and exponentiated in parallel when opts asks for more than one thread;
+// the output is written in input order, so it is identical to the serial output.
+// With opts->binary the blocks go into the binary container instead of hex lines, and with opts->hybrid
+// only a session key is encrypted with RSA and the data with ChaCha20-Poly1305 (see hybrid_encrypt).
+// IN: ctx (public key context), in (input), out (output), opts (options, may be NULL)
+// OUT: out (encrypted contents), bool (false if hybrid mode could not draw a session key)
+static bool encrypt_io(rsa_key_ctx *ctx, io_in *in, io_out *out, const rsa_file_opts *opts) {
+    if (opts != NULL && opts->hybrid) {
+        return hybrid_encrypt(ctx, in, out);
+    }
+
+    size_t x = 0;
+    size_t block_size = ctx->block_size; // (step 1)
+    uint8_t *block = ctx->block; // (step 2)
+
+    uint32_t threads = opts_threads(opts);
+    uint64_t batch = RSA_BATCH_BLOCKS * threads;
+    BlockJob job;
+    Pool *pool = NULL;
+    if (!job_init(&job, &pool, ctx, threads, batch)) {
+        return false;
+    }
+
+    bool indexed = opts != NULL && opts->index;
+    bool binary = indexed || (opts != NULL && opts->binary);
+    if (binary) {
+        bin_write_header(out, RSA_BIN_MAGIC, indexed ? RSA_BIN_FLAG_INDEX : 0, ctx->mod_bytes);
+    }
+    uint64_t blocks = 0, plain_bytes = 0;
+    size_t entries = 0, cap = 0;
+    uint64_t *index = NULL; // (plaintext offset, container offset) pairs
+
+    uint64_t count = 0;
+    do {
+        count = 0;
+        while (count < batch) {
+            const uint8_t *p = io_next(in, block + 1, block_size - 1, &x);
+            if (x == 0) {
+                break;
+            }
+            // the block is 0xFF followed by the data; import the data in place and set the top byte
+            uint64_t start = stats_clock();
+            mpz_import(job.src[count], x, 1, sizeof(uint8_t), 1, 0, p);
+            for (int b = 0; b < 8; b++) {
+                mpz_setbit(job.src[count], 8 * x + b); // (step 3)
+            }
+            STAT_TIME(STAT_PARSE_NS, start);
+            count++;
+            if (indexed && blocks % RSA_INDEX_STRIDE == 0) {
+                if (entries == cap) {
+                    cap = cap > 0 ? 2 * cap : 64;
+                    index = (uint64_t *) realloc(index, 2 * cap * sizeof(uint64_t));
+                }
+                index[2 * entries] = plain_bytes;
+                index[2 * entries + 1] = RSA_BIN_HEADER_SIZE + blocks * ctx->mod_bytes;
+                entries++;
+            }
+            blocks++;
+            plain_bytes += x;
+        }
+        job.count = count;
+        run_blocks(pool, encrypt_group, &job, groups(count));
+        for (uint64_t i = 0; i < count; i++) {
+            write_cipher_block(out, job.dst[i], binary, ctx->mod_bytes);
+        }
+    } while (count == batch);
+
+    if (indexed) {
+        write_index(out, index, entries, blocks, plain_bytes, ctx->mod_bytes);
+        free(index);
+    }
+    job_clear(&job, &pool, batch);
+    return true;
+}
+
+// Encrypts the contents of infile with a public key context, writing the encrypted contents to outfile
+// (see encrypt_io). A regular input file is mapped and read in place, and output is gathered into large
+// buffers (see fileio.h).
+// IN: ctx (public key context), INFILE, OUTFILE (files to be used), opts (options, may be NULL)
+// OUT: outfile (encrypted file), bool (false if hybrid mode could not draw a session key or outfile could not
+//      be written)
+bool rsa_encrypt_file_ctx(rsa_key_ctx *ctx, FILE *infile, FILE *outfile, const rsa_file_opts *opts) {
+    io_in in;
+    io_out out;
+    io_in_open(&in, infile, true);
+    io_out_open(&out, outfile);
+    bool ok = encrypt_io(ctx, &in, &out, opts);
+    io_in_close(&in);
+    ok = io_out_close(&out) && ok;
+    return ok;
+}
+
+// Encrypts len bytes of memory with a public key context into an output buffer, without stdio. The output is
+// byte for byte what rsa_encrypt_file_ctx writes for the same input and options.
+// IN: ctx (public key context), in (plaintext), len (plaintext bytes), out (output buffer, see rsa_buf),
+//     opts (options, may be NULL)
+// OUT: out (encrypted contents), bool (false if hybrid mode could not draw a session key)
+bool rsa_encrypt_buf_ctx(
+    rsa_key_ctx *ctx, const uint8_t *in, size_t len, rsa_buf *out, const rsa_file_opts *opts) {
+    io_in i;
+    io_out o;
+    io_in_mem(&i, in, len);
+    io_out_mem(&o, out->data, out->cap);
+    bool ok = encrypt_io(ctx, &i, &o, opts);
+    io_out_close(&o);
+    out->data = o.buf;
+    out->len = o.len;
+    out->cap = o.cap;
+    return ok;
+}
+
+// Encrypts the contents of infile, writing the encrypted contents to outfile.
+// IN: INFILE, OUTFILE (files to be used), n (modulo), e(pub exponent), opts (options, may be NULL)
+// OUT: outfile (encrypted file), bool (false if hybrid mode could not draw a session key or outfile could not
+//      be written)
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, const rsa_file_opts *opts) {
+    rsa_key_ctx ctx;
+    rsa_key_ctx_init(&ctx, n, e, NULL);
+    bool ok = rsa_encrypt_file_ctx(&ctx, infile, outfile, opts);
+    rsa_key_ctx_clear(&ctx);
+    return ok;
+}
+
+// Decrypts the rest of in, whose container header (if any) has been read, with a private key context,
+// writing the decrypted contents to out.
+// IN: ctx (private key context), in (input), out (output), binary flags (as returned by bin_read_header),
+//     opts (options, may be NULL)
+// OUT: out (decrypted contents), bool (false if a hybrid container fails authentication or a binary block
+//      is cut short; the complete blocks before it are still written)
+static bool decrypt_io(
+    rsa_key_ctx *ctx, io_in *in, io_out *out, int binary, uint8_t flags, const rsa_file_opts *opts) {
+    if (binary == 2) {
+        return hybrid_decrypt(ctx, in, out);
+    }
+
+    uint32_t threads = opts_threads(opts);
+    uint64_t batch = RSA_BATCH_BLOCKS * threads;
+    BlockJob job;
+    Pool *pool = NULL;
+    if (!job_init(&job, &pool, ctx, threads, batch)) {
+        return false;
+    }
+
+    // an indexed container's blocks end at the all-zero end block, before the index
+    bool indexed = binary == 1 && (flags & RSA_BIN_FLAG_INDEX);
+    bool end = false;
+    int read = 1;
+    uint64_t count = 0;
+    do {
+        count = 0;
+        while (count < batch && !end
+               && (read = read_cipher_block(in, job.src[count], binary, ctx->cblock, ctx->mod_bytes)) > 0) {
+            if (indexed && mpz_sgn(job.src[count]) == 0) {
+                end = true;
+            } else {
+                count++;
+            }
+        }
+        job.count = count;
+        run_blocks(pool, decrypt_group, &job, groups(count));
+        for (uint64_t i = 0; i < count; i++) {
+            // m < n, so it always fits in the mod_bytes block buffer
+            size_t x = 0;
+            uint64_t start = stats_clock();
+            mpz_export(ctx->block, &x, 1, sizeof(uint8_t), 1, 0, job.dst[i]);
+            STAT_TIME(STAT_PARSE_NS, start);
+            if (x > 0) {
+                io_write(out, ctx->block + 1, x - 1); // account for 0xFF
+            }
+        }
+    } while (count == batch && !end);
+
+    job_clear(&job, &pool, batch);
+    return read >= 0;
+}
+
+// Decrypts the contents of infile with a private key context, writing the decrypted contents to outfile.
+// The hex line format and the binary and hybrid containers are accepted; the format is detected from the header.
+// Containers in regular files are mapped and read in place; hex lines are always read through the stream.
+// IN: ctx (private key context), INFILE, OUTFILE (files to be used), opts (options, may be NULL)
+// OUT: outfile (decrypted file), bool (false if infile has a container header for a different key, a hybrid
+//      container fails authentication, a binary container is truncated, or outfile could not be written)
+bool rsa_decrypt_file_ctx(rsa_key_ctx *ctx, FILE *infile, FILE *outfile, const rsa_file_opts *opts) {
+    uint8_t flags = 0;
+    int binary = bin_read_header(infile, ctx->mod_bytes, &flags);
+    if (binary < 0) {
+        return false;
+    }
+    io_in in;
+    io_out out;
+    io_in_open(&in, infile, binary > 0);
+    io_out_open(&out, outfile);
+    bool ok = decrypt_io(ctx, &in, &out, binary, flags, opts);
+    io_in_close(&in);
+    ok = io_out_close(&out) && ok;
+    return ok;
+}
+
+// Decrypts len bytes of memory holding hex lines or a binary or hybrid container with a private key context
+// into an output buffer, without stdio.
+// IN: ctx (private key context), in (ciphertext), len (ciphertext bytes), out (output buffer, see rsa_buf),
+//     opts (options, may be NULL)
+// OUT: out (decrypted contents), bool (false if in has a container header for a different key, a hybrid
+//      container fails authentication, or a binary container is truncated)
+bool rsa_decrypt_buf_ctx(
+    rsa_key_ctx *ctx, const uint8_t *in, size_t len, rsa_buf *out, const rsa_file_opts *opts) {
+    uint8_t flags = 0;
+    io_in i;
+    io_in_mem(&i, in, len);
+    int binary = bin_read_header_mem(&i, ctx->mod_bytes, &flags);
+    if (binary < 0) {
+        out->len = 0;
+        return false;
+    }
+    io_out o;
+    io_out_mem(&o, out->data, out->cap);
+    bool ok = decrypt_io(ctx, &i, &o, binary, flags, opts);
+    io_out_close(&o);
+    out->data = o.buf;
+    out->len = o.len;
+    out->cap = o.cap;
+    return ok;
+}
+
+// Decrypts only bytes [offset, offset + length) of the plaintext of an indexed binary container in a regular
+// file, writing them to outfile. The index gives the container offset of a block at or before offset; from
+// there every block but the last carries block_size - 1 bytes, so the first block needed is found without
+// decrypting anything and only the blocks overlapping the range are exponentiated. The range is clipped to
+// the plaintext length.
+// IN: ctx (private key context), INFILE, OUTFILE (files to be used), offset length (plaintext range)
+// OUT: outfile (decrypted range), bool (false if infile is not an indexed container for this key in a regular file,
+//      its index is damaged, or outfile could not be written)
+bool rsa_decrypt_range_ctx(
+    rsa_key_ctx *ctx, FILE *infile, FILE *outfile, uint64_t offset, uint64_t length) {
+    uint8_t flags = 0;
+    if (bin_read_header(infile, ctx->mod_bytes, &flags) != 1 || !(flags & RSA_BIN_FLAG_INDEX)) {
+        return false;
+    }
+    io_in in;
+    io_in_open(&in, infile, true);
+    if (in.map == NULL || in.pos < RSA_BIN_HEADER_SIZE
+        || in.map_size - in.pos < RSA_INDEX_TRAILER_SIZE) {
+        io_in_close(&in);
+        return false;
+    }
+    // everything below is relative to the start of the container
+    const uint8_t *base = in.map + in.pos - RSA_BIN_HEADER_SIZE;
+    uint64_t size = in.map_size - (in.pos - RSA_BIN_HEADER_SIZE);
+    const uint8_t *t = base + size - RSA_INDEX_TRAILER_SIZE;
+    uint64_t stride = ((uint64_t) t[4] << 24) | ((uint64_t) t[5] << 16) | ((uint64_t) t[6] << 8) | t[7];
+    uint64_t blocks = get_be64(t + 8), plain_bytes = get_be64(t + 16), index_offset = get_be64(t + 24);
+    uint64_t entries = stride > 0 ? (blocks + stride - 1) / stride : 0;
+    uint64_t per_block = ctx->block_size - 1;
+    if (memcmp(t, RSA_INDEX_MAGIC, 4) != 0 || stride == 0 || per_block == 0 || blocks >= size / ctx->mod_bytes
+        || plain_bytes > blocks * per_block
+        || index_offset != RSA_BIN_HEADER_SIZE + (blocks + 1) * ctx->mod_bytes
+        || index_offset + 16 * entries + RSA_INDEX_TRAILER_SIZE != size) {
+        io_in_close(&in);
+        return false;
+    }
+
+    io_out out;
+    io_out_open(&out, outfile);
+    uint64_t end = offset + length < plain_bytes && offset + length >= offset ? offset + length : plain_bytes;
+    if (offset < end) {
+        // last index entry at or before offset
+        const uint8_t *idx = base + index_offset;
+        uint64_t lo = 0, hi = entries;
+        while (hi - lo > 1) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (get_be64(idx + 16 * mid) <= offset) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        uint64_t pt = get_be64(idx + 16 * lo), ct = get_be64(idx + 16 * lo + 8);
+        // the entry must point at a data block, before the end block, holding plaintext at or before offset
+        if (ct < RSA_BIN_HEADER_SIZE || (ct - RSA_BIN_HEADER_SIZE) % ctx->mod_bytes != 0
+            || ct >= index_offset - ctx->mod_bytes || pt > offset) {
+            io_in_close(&in);
+            io_out_close(&out);
+            return false;
+        }
+        uint64_t skip = (offset - pt) / per_block;
+        pt += skip * per_block;
+        ct += skip * ctx->mod_bytes;
+
+        mpz_t c, m;
+        mpz_inits(c, m, NULL);
+        while (pt < end && ct + ctx->mod_bytes <= index_offset - ctx->mod_bytes) {
+            uint64_t start = stats_clock();
+            mpz_import(c, ctx->mod_bytes, 1, sizeof(uint8_t), 1, 0, base + ct);
+            STAT_TIME(STAT_PARSE_NS, start);
+            start = stats_clock();
+            rsa_decrypt_ctx(ctx, m, c);
+            STAT_TIME(STAT_EXP_NS, start);
+            STAT_ADD(STAT_BLOCKS, 1);
+            STAT_ADD(STAT_BYTES_IN, ctx->mod_bytes);
+            size_t x = 0;
+            start = stats_clock();
+            mpz_export(ctx->block, &x, 1, sizeof(uint8_t), 1, 0, m);
+            STAT_TIME(STAT_PARSE_NS, start);
+            uint64_t got = x > 0 ? x - 1 : 0; // account for 0xFF
+            uint64_t from = offset > pt ? offset - pt : 0;
+            uint64_t to = end - pt < got ? end - pt : got;
+            if (from < to) {
+                io_write(&out, ctx->block + 1 + from, to - from);
+            }
+            pt += got;
+            ct += ctx->mod_bytes;
+        }
+        mpz_clears(c, m, NULL);
+    }
+    io_in_close(&in);
+    return io_out_close(&out);
+}
+
+// Decrypts the contents of infile, writing the encrypted contents to outfile.$
+// IN: INFILE, OUTFILE (files to be used), n (modulo), d(priv), crt (CRT key, NULL for the full-width path), opts (options, may be NULL)$
+// OUT: outfile (decrypted file), bool (false if infile has a binary header for a different key, or outfile could
+//      not be written)$
+bool rsa_decrypt_file(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt *crt, const rsa_file_opts *opts) {
+    rsa_key_ctx ctx;
+    rsa_key_ctx_init(&ctx, n, d, crt);
+    bool ok = rsa_decrypt_file_ctx(&ctx, infile, outfile, opts);
+    rsa_key_ctx_clear(&ctx);
+    return ok;
+}
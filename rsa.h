@@ -5,26 +5,208 @@
 #include <stdio.h>
 #include <gmp.h>
 
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
+#include "mbpow.h"
+#include "numtheory.h"
+
+// Most primes in a modulus: p and q, then up to RSA_MAX_PRIMES - 2 more (multi-prime RSA, RFC 8017).
+#define RSA_MAX_PRIMES 4
+
+// Chinese Remainder Theorem components of a private key: the primes p and q,
+// dp = d mod (p-1), dq = d mod (q-1) and qinv = q^-1 mod p. A multi-prime key adds, for each further
+// prime r[i], dr[i] = d mod (r[i]-1) and tr[i] = (p * q * r[0] * ... * r[i-1])^-1 mod r[i], as RFC 8017's
+// otherPrimeInfos do.
+typedef struct {
+    mpz_t p, q, dp, dq, qinv;
+    uint32_t extra; // primes beyond p and q
+    mpz_t r[RSA_MAX_PRIMES - 2], dr[RSA_MAX_PRIMES - 2], tr[RSA_MAX_PRIMES - 2];
+} rsa_crt;
+
+// Per-key state built once from a loaded key and reused for every block: the key material, the block
+// geometry, Montgomery and multi-buffer contexts for n (and p, q with the CRT), scratch variables and block buffers.
+// A context is not shared between threads; rsa_key_ctx_copy makes one for another thread.
+typedef struct {
+    mpz_t n;
+    mpz_t exp; // e for a public key, d for a private key
+    bool short_exp; // exp has at most RSA_SHORT_EXP_BITS bits: skip Montgomery and square-and-multiply directly
+    bool has_crt;
+    rsa_crt crt;
+    size_t block_size; // plaintext block size in bytes, including the leading 0xFF
+    size_t mod_bytes; // ciphertext block size in bytes in the binary format
+    mont_ctx mont_n, mont_p, mont_q;
+    mont_ctx mont_r[RSA_MAX_PRIMES - 2]; // for the further primes of a multi-prime key
+    mb_ctx mb_n, mb_p, mb_q; // multi-buffer contexts, used for groups of blocks when ready
+    mb_ctx mb_r[RSA_MAX_PRIMES - 2];
+    mpz_t rprod[RSA_MAX_PRIMES - 2]; // product of the primes before crt.r[i]
+    mpz_t m1, m2, h; // scratch
+    mpz_t lane[MB_LANES]; // scratch for groups of blocks
+    uint8_t *block; // plaintext block buffer
+    uint8_t *cblock; // ciphertext block buffer
+} rsa_key_ctx;
+
+// Public exponent used by keygen unless another one is asked for.
+#define RSA_DEFAULT_EXP 65537
+
+// Exponents up to this many bits take the short square-and-multiply path in a key context.
+#define RSA_SHORT_EXP_BITS 64
+
+// Blocks read per worker thread in each batch of rsa_encrypt_file and rsa_decrypt_file.
+#define RSA_BATCH_BLOCKS 64
+
+// Binary ciphertext container: a header of RSA_BIN_HEADER_SIZE bytes (the magic, a version byte,
+// a flags byte, two reserved bytes and the block width as a big-endian uint32) followed by blocks
+// of exactly ceil(log2(n) / 8) big-endian bytes, so block i starts at RSA_BIN_HEADER_SIZE + i * width.
+#define RSA_BIN_MAGIC       "RSAB"
+#define RSA_BIN_VERSION     1
+#define RSA_BIN_HEADER_SIZE 12
+
+// Header flag: the binary container has a block index. Its last data block is then followed by an
+// all-zero block (never a valid ciphertext), big-endian (plaintext offset, container offset) uint64
+// pairs for every RSA_INDEX_STRIDE-th block, and a trailer of RSA_INDEX_TRAILER_SIZE bytes: the index
+// magic, the stride as a uint32 and the block count, plaintext length and index offset as uint64s.
+// Container offsets count from the first byte of the header.
+#define RSA_BIN_FLAG_INDEX     0x01
+#define RSA_INDEX_MAGIC        "RSAX"
+#define RSA_INDEX_STRIDE       64
+#define RSA_INDEX_TRAILER_SIZE 32
+
+// Hybrid container: the same header with its own magic, the session key wrapped in
+// ceil(32 / (block_size - 1)) binary RSA blocks, then ChaCha20-Poly1305 chunks of up to
+// RSA_HYBRID_CHUNK bytes, each led by its big-endian length with RSA_HYBRID_FINAL set on the last.
+#define RSA_HYBRID_MAGIC "RSAH"
+#define RSA_HYBRID_CHUNK (64 * 1024)
+#define RSA_HYBRID_FINAL 0x80000000u
+
+// Binary key file: a header of RSA_KEY_HEADER_SIZE bytes (the magic, a version byte, the kind, a flags
+// byte, the number of fields, then the bit length of n, the plaintext block size and the ciphertext block
+// width as little-endian uint32s and four reserved bytes), the fields, and a little-endian uint64 FNV-1a
+// checksum of everything before it. A number is stored as a uint64 limb count followed by its 64-bit
+// limbs, least significant first, so it loads straight into GMP's limbs; the username of a public key
+// is a uint64 length and its bytes padded to a multiple of 8. All integers are little-endian.
+// Public keys hold n, e, s and the username; private keys hold n and d, then p, q, dp, dq and qinv
+// when RSA_KEY_FLAG_CRT is set, then r, dr and tr for each further prime of a multi-prime key. Readers
+// from before multi-prime keys take at most 8 fields, so they refuse such a key instead of decrypting
+// with p and q alone.
+#define RSA_KEY_MAGIC       "RSAK"
+#define RSA_KEY_VERSION     1
+#define RSA_KEY_HEADER_SIZE 24
+#define RSA_KEY_PUB         0
+#define RSA_KEY_PRIV        1
+#define RSA_KEY_MAX_FIELDS  16
+
+// Key flag: the signature s was checked when the file was written, so a load that passes the checksum
+// can skip verifying it again. This trusts whoever wrote the file exactly as far as the key itself.
+#define RSA_KEY_FLAG_VERIFIED 0x01
+
+// Key flag: the private key file holds the CRT components.
+#define RSA_KEY_FLAG_CRT 0x02
+
+// Longest username kept when reading a public key, not counting the terminating NUL.
+#define RSA_KEY_MAX_USER 255
+
+// Options for rsa_encrypt_file and rsa_decrypt_file. Passing NULL selects the defaults.
+typedef struct {
+    uint32_t threads; // worker threads exponentiating blocks (0 or 1: serial)
+    bool binary; // write the binary container instead of hex lines (encryption only)
+    bool hybrid; // wrap a session key with RSA and encrypt the data with it (encryption only)
+    bool index; // append a block index to the binary container (encryption only, implies binary)
+} rsa_file_opts;
+
+// Output buffer of the buffer functions (rsa_*_buf). The output starts in data, of cap bytes; if it does not
+// fit, or data is NULL, it moves to a malloc'd buffer that replaces data and cap. len is the size of the output.
+// So { NULL, 0, 0 } lets the call allocate, and the caller frees data whenever it differs from the buffer
+// it passed in.
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} rsa_buf;
+
+void rsa_make_pub(
+    mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, uint32_t threads);
+
+void rsa_make_pub_primes(
+    mpz_t *primes, uint32_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, uint32_t threads);
+
+void rsa_use_prime_pool(const char *path);
 
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
-void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
+void rsa_write_pub_bin(mpz_t n, mpz_t e, mpz_t s, char username[], bool verified, FILE *pbfile);
+
+bool rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
+
+void rsa_write_pub_buf(mpz_t n, mpz_t e, mpz_t s, char username[], bool binary, bool verified, rsa_buf *out);
+
+bool rsa_read_pub_buf(
+    mpz_t n, mpz_t e, mpz_t s, char username[], bool *verified, const uint8_t *key, size_t len);
 
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
 
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
+void rsa_make_priv_primes(mpz_t d, mpz_t e, mpz_t *primes, uint32_t count);
+
+void rsa_crt_init(rsa_crt *crt);
+
+void rsa_crt_clear(rsa_crt *crt);
 
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
+void rsa_make_crt(rsa_crt *crt, mpz_t d, mpz_t p, mpz_t q);
+
+void rsa_make_crt_primes(rsa_crt *crt, mpz_t d, mpz_t *primes, uint32_t count);
+
+void rsa_write_priv(mpz_t n, mpz_t d, rsa_crt *crt, FILE *pvfile);
+
+void rsa_write_priv_bin(mpz_t n, mpz_t d, rsa_crt *crt, FILE *pvfile);
+
+bool rsa_read_priv(mpz_t n, mpz_t d, rsa_crt *crt, FILE *pvfile);
+
+void rsa_write_priv_buf(mpz_t n, mpz_t d, rsa_crt *crt, bool binary, rsa_buf *out);
+
+bool rsa_read_priv_buf(mpz_t n, mpz_t d, rsa_crt *crt, bool *has_crt, const uint8_t *key, size_t len);
 
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, const rsa_file_opts *opts);
 
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+void rsa_decrypt_crt(mpz_t m, mpz_t c, rsa_crt *crt);
+
+bool rsa_decrypt_file(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt *crt, const rsa_file_opts *opts);
 
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_crt *crt);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
+
+void rsa_key_ctx_init(rsa_key_ctx *ctx, mpz_t n, mpz_t exp, rsa_crt *crt);
+
+void rsa_key_ctx_copy(rsa_key_ctx *ctx, rsa_key_ctx *src);
+
+void rsa_key_ctx_clear(rsa_key_ctx *ctx);
+
+void rsa_encrypt_ctx(rsa_key_ctx *ctx, mpz_t c, mpz_t m);
+
+void rsa_decrypt_ctx(rsa_key_ctx *ctx, mpz_t m, mpz_t c);
+
+void rsa_sign_ctx(rsa_key_ctx *ctx, mpz_t s, mpz_t m);
+
+bool rsa_verify_ctx(rsa_key_ctx *ctx, mpz_t m, mpz_t s);
+
+bool rsa_sign_batch(rsa_key_ctx *ctx, mpz_t *s, mpz_t *m, uint64_t count, uint32_t threads);
+
+uint64_t rsa_verify_batch(
+    rsa_key_ctx *ctx, mpz_t *m, mpz_t *s, uint64_t count, uint32_t threads, uint8_t *ok);
+
+bool rsa_encrypt_file_ctx(rsa_key_ctx *ctx, FILE *infile, FILE *outfile, const rsa_file_opts *opts);
+
+bool rsa_decrypt_file_ctx(rsa_key_ctx *ctx, FILE *infile, FILE *outfile, const rsa_file_opts *opts);
+
+bool rsa_encrypt_buf_ctx(
+    rsa_key_ctx *ctx, const uint8_t *in, size_t len, rsa_buf *out, const rsa_file_opts *opts);
+
+bool rsa_decrypt_buf_ctx(
+    rsa_key_ctx *ctx, const uint8_t *in, size_t len, rsa_buf *out, const rsa_file_opts *opts);
+
+bool rsa_decrypt_range_ctx(
+    rsa_key_ctx *ctx, FILE *infile, FILE *outfile, uint64_t offset, uint64_t length);
@@ -0,0 +1,148 @@
+#include "proto.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS "s:n:m:i:o:g:kh"
+
+// Operation names accepted by -m, in the order of their PROTO_ values.
+static const char *op_names[] = { "encrypt", "decrypt", "sign", "verify", "ping" };
+
+// Returns the protocol operation named by name, or 0 if there is none.
+// IN: name (operation name)
+// OUT: uint8_t (operation)
+static uint8_t op_from_name(const char *name) {
+    for (uint8_t i = 0; i < sizeof(op_names) / sizeof(op_names[0]); i++) {
+        if (strcmp(name, op_names[i]) == 0) {
+            return PROTO_ENCRYPT + i;
+        }
+    }
+    return 0;
+}
+
+// Appends the whole of file to buf (len bytes in use, cap allocated), growing it as needed.
+// IN: file (input), buf len cap (buffer)
+// OUT: buf len cap (buffer holding the file's contents after the earlier bytes), bool (false on a read error)
+static bool read_all(FILE *file, uint8_t **buf, size_t *len, size_t *cap) {
+    while (true) {
+        if (*len == *cap) {
+            *cap = *cap > 0 ? 2 * *cap : 65536;
+            *buf = (uint8_t *) realloc(*buf, *cap);
+        }
+        size_t got = fread(*buf + *len, sizeof(uint8_t), *cap - *len, file);
+        *len += got;
+        if (got == 0) {
+            return !ferror(file);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    char *socket_path = PROTO_DEFAULT_SOCKET;
+    char *infile_path = NULL;
+    char *outfile_path = NULL;
+    char *sigfile_path = NULL;
+    uint8_t op = PROTO_ENCRYPT;
+    uint8_t key = 0;
+    uint8_t flags = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 's': socket_path = optarg; break;
+        case 'n': key = (uint8_t) atoi(optarg); break;
+        case 'm':
+            op = op_from_name(optarg);
+            if (op == 0) {
+                fprintf(stderr, "Unknown operation %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i': infile_path = optarg; break;
+        case 'o': outfile_path = optarg; break;
+        case 'g': sigfile_path = optarg; break;
+        case 'k': flags |= PROTO_FLAG_HYBRID; break;
+        case 'h':
+            printf("SYNOPSIS\n");
+            printf("   Sends one request to rsad and writes the response.\n\n");
+            printf("USAGE\n");
+            printf("   ./rsac [-h] [-s socket] [-n key] [-m operation] [-k] [-g sigfile] [-i infile] "
+                   "[-o outfile]\n\n");
+            printf("OPTIONS\n");
+            printf("   -h              Display program help and usage.\n");
+            printf("   -s socket       Socket path of rsad (default: %s).\n", PROTO_DEFAULT_SOCKET);
+            printf("   -n key          Key slot on the daemon (default: 0).\n");
+            printf("   -m operation    encrypt, decrypt, sign, verify or ping (default: encrypt).\n");
+            printf("   -k              Encrypt in hybrid mode.\n");
+            printf("   -g sigfile      Signature to verify; infile is then the message.\n");
+            printf("   -i infile       Request data (default: stdin).\n");
+            printf("   -o outfile      Response data (default: stdout). verify writes 1 or 0.\n");
+            return 0;
+        }
+    }
+
+    uint8_t *body = NULL;
+    size_t len = 0, cap = 0;
+    if (op == PROTO_VERIFY) {
+        FILE *sigfile = sigfile_path != NULL ? fopen(sigfile_path, "r") : NULL;
+        if (sigfile == NULL) {
+            fprintf(stderr, "Verifying needs a signature file.\n");
+            return 1;
+        }
+        bool ok = read_all(sigfile, &body, &len, &cap);
+        fclose(sigfile);
+        if (!ok) {
+            fprintf(stderr, "Invalid signature file.\n");
+            return 1;
+        }
+    }
+    FILE *infile = infile_path == NULL ? stdin : fopen(infile_path, "r");
+    if (infile == NULL || !read_all(infile, &body, &len, &cap)) {
+        fprintf(stderr, "Invalid infile.\n");
+        return 1;
+    }
+    if (infile != stdin) {
+        fclose(infile);
+    }
+    if (len > PROTO_MAX_BODY) {
+        fprintf(stderr, "Request too large.\n");
+        return 1;
+    }
+
+    int fd = proto_connect(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Unable to connect.\n", socket_path);
+        return 1;
+    }
+    proto_frame frame = { (uint32_t) len, 1, op, key, flags };
+    proto_frame reply;
+    if (!proto_send(fd, &frame, body) || proto_recv(fd, &reply, &body, &cap) != 1) {
+        fprintf(stderr, "No response from rsad.\n");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    if (reply.status != PROTO_OK) {
+        fprintf(stderr, "rsad: %s.\n", proto_status_str(reply.status));
+        free(body);
+        return 1;
+    }
+
+    FILE *outfile = outfile_path == NULL ? stdout : fopen(outfile_path, "w");
+    if (outfile == NULL) {
+        fprintf(stderr, "Invalid outfile.\n");
+        return 1;
+    }
+    int status = 0;
+    if (op == PROTO_VERIFY) {
+        fprintf(outfile, "%d\n", reply.length > 0 && body[0] == 1);
+        status = reply.length > 0 && body[0] == 1 ? 0 : 1;
+    } else {
+        fwrite(body, sizeof(uint8_t), reply.length, outfile);
+    }
+    fclose(outfile);
+    free(body);
+    return status;
+}
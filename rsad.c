@@ -0,0 +1,502 @@
+#include "proto.h"
+#include "rsa.h"
+#include "stats.h"
+#include "threadpool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define OPTIONS "k:s:t:S:vh"
+
+// Key slots are addressed by one byte of the frame header.
+#define MAX_KEYS 256
+
+// Connections accepted but not yet picked up by a worker.
+#define QUEUE_SIZE 1024
+
+// A loaded key. Either half may be missing; the contexts are built once and copied for every worker.
+typedef struct {
+    bool has_pub, has_priv;
+    rsa_key_ctx pub; // n and e, for encrypt and verify
+    rsa_key_ctx priv; // n and d, with the CRT components if the file has them, for decrypt and sign
+} Key;
+
+// State of one worker thread: its own copy of every key context, scratch numbers, and the connection
+// it is serving (-1 when idle) so shutdown can end it.
+typedef struct {
+    pthread_t thread;
+    Key *keys;
+    mpz_t m, s;
+    int fd;
+} Worker;
+
+static Key keys[MAX_KEYS];
+static uint32_t key_count = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Queue of accepted connections, guarded by lock; queued is signalled when one is added or on shutdown.
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static int queue[QUEUE_SIZE];
+static uint32_t queue_head = 0, queue_len = 0;
+static bool stopping = false;
+
+static volatile sig_atomic_t stop_signal = 0;
+// Self-pipe: the signal handler writes a byte to stop_pipe[1] to wake the accept loop polling stop_pipe[0].
+static int stop_pipe[2] = { -1, -1 };
+
+// Signal handler for SIGINT and SIGTERM: asks the accept loop to stop and wakes it.
+static void on_stop(int sig) {
+    (void) sig;
+    int saved = errno;
+    stop_signal = 1;
+    if (write(stop_pipe[1], "", 1) < 0) {
+        // the pipe is full, so the loop has been woken already
+    }
+    errno = saved;
+}
+
+// Loads key slot key_count from a public key file, a private key file, or both. A public key's signature
+// is checked here, once, unless its binary file records that it already was.
+// IN: pub_path priv_path (key files, either may be NULL), verbose (print what was loaded)
+// OUT: keys (new slot), bool (false if a file cannot be read or holds no valid key)
+static bool load_key(const char *pub_path, const char *priv_path, bool verbose) {
+    Key *k = &keys[key_count];
+    k->has_pub = k->has_priv = false;
+    if (pub_path != NULL) {
+        FILE *file = fopen(pub_path, "r");
+        if (file == NULL) {
+            fprintf(stderr, "%s: No such file or directory\n", pub_path);
+            return false;
+        }
+        char username_str[RSA_KEY_MAX_USER + 1] = "";
+        mpz_t n, e, s, username;
+        mpz_inits(n, e, s, username, NULL);
+        bool verified = rsa_read_pub(n, e, s, username_str, file);
+        fclose(file);
+        bool ok = mpz_cmp_ui(n, 1) > 0;
+        if (ok) {
+            rsa_key_ctx_init(&k->pub, n, e, NULL);
+            mpz_set_str(username, username_str, 62);
+            ok = verified || rsa_verify_ctx(&k->pub, username, s);
+            if (!ok) {
+                rsa_key_ctx_clear(&k->pub);
+            }
+        }
+        mpz_clears(n, e, s, username, NULL);
+        if (!ok) {
+            fprintf(stderr, "%s: Invalid public key.\n", pub_path);
+            return false;
+        }
+        k->has_pub = true;
+    }
+    if (priv_path != NULL) {
+        FILE *file = fopen(priv_path, "r");
+        if (file == NULL) {
+            fprintf(stderr, "%s: No such file or directory\n", priv_path);
+            return false;
+        }
+        mpz_t n, d;
+        mpz_inits(n, d, NULL);
+        rsa_crt crt;
+        rsa_crt_init(&crt);
+        bool has_crt = rsa_read_priv(n, d, &crt, file);
+        fclose(file);
+        bool ok = mpz_cmp_ui(n, 1) > 0 && (!k->has_pub || mpz_cmp(n, k->pub.n) == 0);
+        if (ok) {
+            rsa_key_ctx_init(&k->priv, n, d, has_crt ? &crt : NULL);
+        }
+        mpz_clears(n, d, NULL);
+        rsa_crt_clear(&crt);
+        if (!ok) {
+            fprintf(stderr, "%s: Invalid private key.\n", priv_path);
+            return false;
+        }
+        k->has_priv = true;
+    }
+    if (verbose) {
+        rsa_key_ctx *ctx = k->has_pub ? &k->pub : &k->priv;
+        printf("key %u: n (%zu bits)%s%s\n", key_count, mpz_sizeinbase(ctx->n, 2),
+            k->has_pub ? ", public" : "", k->has_priv ? ", private" : "");
+    }
+    key_count++;
+    return true;
+}
+
+// Carries out one request with the worker's key contexts.
+// IN: w (worker), frame (request header), body (request body), out (response body), out_len (its bytes)
+// OUT: out out_len (response body, malloc'd or NULL), uint8_t (response status)
+static uint8_t handle(Worker *w, proto_frame *frame, uint8_t *body, uint8_t **out, size_t *out_len) {
+    *out = NULL;
+    *out_len = 0;
+    if (frame->op == PROTO_PING) {
+        *out = (uint8_t *) malloc(frame->length > 0 ? frame->length : 1);
+        memcpy(*out, body, frame->length);
+        *out_len = frame->length;
+        return PROTO_OK;
+    }
+    if (frame->op < PROTO_ENCRYPT || frame->op > PROTO_VERIFY) {
+        return PROTO_ERR_OP;
+    }
+    bool public_op = frame->op == PROTO_ENCRYPT || frame->op == PROTO_VERIFY;
+    if (frame->key >= key_count) {
+        return PROTO_ERR_KEY;
+    }
+    Key *k = &w->keys[frame->key];
+    if (public_op ? !k->has_pub : !k->has_priv) {
+        return PROTO_ERR_KEY;
+    }
+    rsa_key_ctx *ctx = public_op ? &k->pub : &k->priv;
+    rsa_file_opts opts = { .threads = 1, .binary = true, .hybrid = false, .index = false };
+
+    switch (frame->op) {
+    case PROTO_ENCRYPT:
+    case PROTO_DECRYPT: {
+        opts.hybrid = frame->op == PROTO_ENCRYPT && (frame->status & PROTO_FLAG_HYBRID) != 0;
+        rsa_buf buf = { NULL, 0, 0 };
+        bool ok = frame->op == PROTO_ENCRYPT ? rsa_encrypt_buf_ctx(ctx, body, frame->length, &buf, &opts)
+                                             : rsa_decrypt_buf_ctx(ctx, body, frame->length, &buf, &opts);
+        *out = buf.data;
+        *out_len = buf.len;
+        return ok ? PROTO_OK : PROTO_ERR_INPUT;
+    }
+    case PROTO_SIGN: {
+        mpz_import(w->m, frame->length, 1, sizeof(uint8_t), 1, 0, body);
+        if (mpz_cmp(w->m, ctx->n) >= 0) {
+            return PROTO_ERR_INPUT;
+        }
+        rsa_sign_ctx(ctx, w->s, w->m);
+        *out = (uint8_t *) calloc(ctx->mod_bytes, sizeof(uint8_t));
+        *out_len = ctx->mod_bytes;
+        // right-align the signature in its mod_bytes, as the binary container does
+        size_t len = mpz_sgn(w->s) != 0 ? (mpz_sizeinbase(w->s, 2) + 7) / 8 : 0;
+        mpz_export(*out + ctx->mod_bytes - len, NULL, 1, sizeof(uint8_t), 1, 0, w->s);
+        return PROTO_OK;
+    }
+    default: // PROTO_VERIFY
+        if (frame->length < ctx->mod_bytes) {
+            return PROTO_ERR_INPUT;
+        }
+        mpz_import(w->s, ctx->mod_bytes, 1, sizeof(uint8_t), 1, 0, body);
+        mpz_import(w->m, frame->length - ctx->mod_bytes, 1, sizeof(uint8_t), 1, 0, body + ctx->mod_bytes);
+        *out = (uint8_t *) malloc(1);
+        **out = rsa_verify_ctx(ctx, w->m, w->s) ? 1 : 0;
+        *out_len = 1;
+        return PROTO_OK;
+    }
+}
+
+// Answers requests on one connection until the client closes it or sends a bad frame.
+// IN: w (worker), fd (connected socket)
+// OUT: N/A
+static void serve(Worker *w, int fd) {
+    uint8_t *body = NULL;
+    size_t cap = 0;
+    proto_frame frame;
+    while (proto_recv(fd, &frame, &body, &cap) == 1) {
+        uint8_t *out = NULL;
+        size_t out_len = 0;
+        uint8_t status = handle(w, &frame, body, &out, &out_len);
+        STAT_ADD(STAT_REQUESTS, 1);
+        if (status != PROTO_OK || out_len > PROTO_MAX_BODY) {
+            status = status != PROTO_OK ? status : PROTO_ERR_INPUT;
+            out_len = 0;
+        }
+        proto_frame reply = { (uint32_t) out_len, frame.id, frame.op, frame.key, status };
+        bool sent = proto_send(fd, &reply, out);
+        free(out);
+        if (!sent) {
+            break;
+        }
+    }
+    free(body);
+}
+
+// Worker loop: copies the key contexts, then takes connections off the queue and serves them one at a time.
+// IN: arg (Worker)
+// OUT: NULL
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *) arg;
+    for (uint32_t i = 0; i < key_count; i++) {
+        w->keys[i] = keys[i];
+        if (keys[i].has_pub) {
+            rsa_key_ctx_copy(&w->keys[i].pub, &keys[i].pub);
+        }
+        if (keys[i].has_priv) {
+            rsa_key_ctx_copy(&w->keys[i].priv, &keys[i].priv);
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    while (true) {
+        while (!stopping && queue_len == 0) {
+            pthread_cond_wait(&queued, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+        int fd = queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_len--;
+        w->fd = fd;
+        pthread_mutex_unlock(&lock);
+
+        serve(w, fd);
+
+        pthread_mutex_lock(&lock);
+        w->fd = -1;
+        close(fd);
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (uint32_t i = 0; i < key_count; i++) {
+        if (w->keys[i].has_pub) {
+            rsa_key_ctx_clear(&w->keys[i].pub);
+        }
+        if (w->keys[i].has_priv) {
+            rsa_key_ctx_clear(&w->keys[i].priv);
+        }
+    }
+    return NULL;
+}
+
+// Creates the listening socket at path, replacing a stale socket left there by an earlier run.
+// IN: path (socket path)
+// OUT: int (listening descriptor, -1 on failure)
+static int listen_at(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    char *socket_path = PROTO_DEFAULT_SOCKET;
+    char *stats_path = NULL;
+    uint32_t threads = 4;
+    bool verbose = false;
+    int opt = 0;
+
+    // keys are loaded after the options, so -v applies to all of them
+    char *key_specs[MAX_KEYS];
+    uint32_t spec_count = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'k':
+            if (spec_count < MAX_KEYS) {
+                key_specs[spec_count++] = optarg;
+            }
+            break;
+        case 's': socket_path = optarg; break;
+        case 't':
+            if (!pool_parse_threads(optarg, &threads)) {
+                fprintf(stderr, "Invalid number of threads.\n");
+                return 1;
+            }
+            break;
+        case 'S': stats_path = optarg; break;
+        case 'v': verbose = true; break;
+        case 'h':
+            printf("SYNOPSIS\n");
+            printf("   Serves RSA encryption, decryption, signing and verification over a Unix domain "
+                   "socket,\n");
+            printf("   keeping the keys loaded and a pool of workers warm between requests.\n\n");
+            printf("USAGE\n");
+            printf("   ./rsad [-hv] [-s socket] [-t threads] [-S statsfile] -k pbfile[:pvfile] "
+                   "[-k ...]\n\n");
+            printf("OPTIONS\n");
+            printf("   -h              Display program help and usage.\n");
+            printf("   -v              Display the keys loaded.\n");
+            printf("   -k keys         Load a key into the next slot, numbered from 0: a public key file,\n");
+            printf("                   a public and a private key file as pbfile:pvfile, or :pvfile alone.\n");
+            printf("   -s socket       Socket path (default: %s).\n", PROTO_DEFAULT_SOCKET);
+            printf("   -t threads      Worker threads, each serving one connection at a time, "
+                   "1 to %d (default: 4).\n", POOL_MAX_THREADS);
+            printf("   -S statsfile    Write counters and timings as JSON to statsfile (- for stdout) on "
+                   "exit.\n");
+            return 0;
+        }
+    }
+
+    if (spec_count == 0) {
+        fprintf(stderr, "No keys given.\n");
+        return 1;
+    }
+    if (stats_path != NULL) {
+        stats_enable();
+    }
+
+    for (uint32_t i = 0; i < spec_count; i++) {
+        char *colon = strchr(key_specs[i], ':');
+        char *pub_path = key_specs[i], *priv_path = NULL;
+        if (colon != NULL) {
+            *colon = '\0';
+            priv_path = colon + 1;
+        }
+        if (!load_key(*pub_path != '\0' ? pub_path : NULL, *priv_path != '\0' ? priv_path : NULL, verbose)) {
+            return 1;
+        }
+    }
+
+    int listener = listen_at(socket_path);
+    if (listener < 0) {
+        fprintf(stderr, "%s: Unable to listen on socket.\n", socket_path);
+        return 1;
+    }
+
+    // SIGINT and SIGTERM wake the accept loop through the self-pipe so it can shut down cleanly
+    if (pipe(stop_pipe) != 0) {
+        fprintf(stderr, "Unable to set up signal handling.\n");
+        close(listener);
+        unlink(socket_path);
+        return 1;
+    }
+    // the listener is non-blocking too, so a connection dropped between poll and accept cannot stall the loop
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    for (int i = 0; i < 2; i++) {
+        fcntl(stop_pipe[i], F_SETFL, fcntl(stop_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(stop_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // the workers start with SIGINT and SIGTERM blocked, so the signals are always taken by this thread
+    sigset_t stop_set, old_set;
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_set, &old_set);
+
+    // serve with as many workers as could be started
+    Worker *workers = (Worker *) calloc(threads, sizeof(Worker));
+    uint32_t started = 0;
+    while (workers != NULL && started < threads) {
+        Worker *w = &workers[started];
+        w->keys = (Key *) calloc(key_count, sizeof(Key));
+        if (w->keys == NULL) {
+            break;
+        }
+        w->fd = -1;
+        mpz_inits(w->m, w->s, NULL);
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            mpz_clears(w->m, w->s, NULL);
+            free(w->keys);
+            break;
+        }
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (started == 0) {
+        fprintf(stderr, "Unable to start worker threads.\n");
+        free(workers);
+        close(listener);
+        unlink(socket_path);
+        return 1;
+    }
+    threads = started;
+    if (verbose) {
+        printf("listening on %s with %u workers\n", socket_path, threads);
+        fflush(stdout);
+    }
+
+    struct pollfd fds[2] = { { .fd = listener, .events = POLLIN }, { .fd = stop_pipe[0], .events = POLLIN } };
+    while (!stop_signal) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+        if (fds[1].revents != 0 || !(fds[0].revents & POLLIN)) {
+            break; // a stop signal, or an error on the listener
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK) {
+                break;
+            }
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        if (queue_len == QUEUE_SIZE) {
+            pthread_mutex_unlock(&lock);
+            close(fd); // overloaded: the client sees the connection closed
+            continue;
+        }
+        queue[(queue_head + queue_len) % QUEUE_SIZE] = fd;
+        queue_len++;
+        pthread_cond_signal(&queued);
+        pthread_mutex_unlock(&lock);
+    }
+
+    // stop taking connections, end the ones being served and wait for the workers
+    close(listener);
+    close(stop_pipe[0]);
+    unlink(socket_path);
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    for (uint32_t i = 0; i < threads; i++) {
+        if (workers[i].fd >= 0) {
+            shutdown(workers[i].fd, SHUT_RD);
+        }
+    }
+    while (queue_len > 0) {
+        close(queue[queue_head]);
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_len--;
+    }
+    pthread_cond_broadcast(&queued);
+    pthread_mutex_unlock(&lock);
+    for (uint32_t i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        mpz_clears(workers[i].m, workers[i].s, NULL);
+        free(workers[i].keys);
+    }
+    free(workers);
+
+    int status = 0;
+    if (stats_path != NULL && !stats_write(stats_path, "rsad")) {
+        fprintf(stderr, "Unable to write stats.\n");
+        status = 1;
+    }
+    for (uint32_t i = 0; i < key_count; i++) {
+        if (keys[i].has_pub) {
+            rsa_key_ctx_clear(&keys[i].pub);
+        }
+        if (keys[i].has_priv) {
+            rsa_key_ctx_clear(&keys[i].priv);
+        }
+    }
+    return status;
+}
@@ -0,0 +1,48 @@
+#include "stats.h"
+
+#include <sys/resource.h>
+
+bool stats_enabled = false;
+_Atomic uint64_t stats_counters[STAT_COUNT];
+
+// JSON field names of the counters, in stat_id order. The timers, from STAT_EXP_NS on, are written in seconds.
+static const char *stat_names[STAT_COUNT] = { "candidates", "mr_rounds", "pub_retries", "pool_primes",
+    "pool_misses", "blocks", "bytes_in", "bytes_out", "requests", "exp_seconds", "io_seconds", "parse_seconds",
+    "aead_seconds" };
+
+// Timestamp of stats_enable, for the wall time of the run.
+static uint64_t start_ns;
+
+// Turns the counters on. Call once at startup, before any worker threads exist.
+// IN: N/A
+// OUT: N/A
+void stats_enable(void) {
+    stats_enabled = true;
+    start_ns = stats_clock();
+}
+
+// Writes the counters as one JSON object to path, with the tool name, the wall time since stats_enable and
+// the peak resident set size of the process.
+// IN: path (output file, "-" for stdout), tool (program name)
+// OUT: bool (false if the file could not be written)
+bool stats_write(const char *path, const char *tool) {
+    bool to_stdout = path[0] == '-' && path[1] == '\0';
+    FILE *out = to_stdout ? stdout : fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(out, "{\"tool\": \"%s\", \"wall_seconds\": %.6f", tool, (stats_clock() - start_ns) * 1e-9);
+    for (int i = 0; i < STAT_COUNT; i++) {
+        uint64_t v = atomic_load(&stats_counters[i]);
+        if (i >= STAT_EXP_NS) {
+            fprintf(out, ", \"%s\": %.6f", stat_names[i], v * 1e-9);
+        } else {
+            fprintf(out, ", \"%s\": %lu", stat_names[i], (unsigned long) v);
+        }
+    }
+    fprintf(out, ", \"peak_rss_kb\": %ld}\n", ru.ru_maxrss);
+    return to_stdout ? fflush(out) == 0 : fclose(out) == 0;
+}
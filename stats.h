@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Process-wide performance counters. Every update is behind a check of stats_enabled, which is only set
+// by stats_enable at startup, so with stats off the instrumented code pays one predictable branch per
+// update and never reads the clock. Updates sit outside the per-limb and per-byte loops.
+typedef enum {
+    STAT_CANDIDATES, // prime candidates make_prime handed to Miller-Rabin
+    STAT_MR_ROUNDS, // Miller-Rabin rounds run
+    STAT_PUB_RETRIES, // prime pairs rsa_make_pub discarded because e was not coprime to the totient
+    STAT_POOL_PRIMES, // primes rsa_make_pub took from the prime pool
+    STAT_POOL_MISSES, // primes rsa_make_pub searched for because the prime pool had none of their width
+    STAT_BLOCKS, // blocks exponentiated by the file and batch functions
+    STAT_BYTES_IN, // bytes read by the file functions
+    STAT_BYTES_OUT, // bytes written by the file functions
+    STAT_REQUESTS, // requests answered by rsad
+    STAT_EXP_NS, // time in block exponentiation
+    STAT_IO_NS, // time reading and writing files
+    STAT_PARSE_NS, // time converting between bytes or hex and numbers, keys included
+    STAT_AEAD_NS, // time in ChaCha20-Poly1305 in hybrid mode
+    STAT_COUNT
+} stat_id;
+
+extern bool stats_enabled;
+extern _Atomic uint64_t stats_counters[STAT_COUNT];
+
+// Adds n to counter id when stats are enabled.
+#define STAT_ADD(id, n)                                                                             \
+    do {                                                                                            \
+        if (__builtin_expect(stats_enabled, 0)) {                                                   \
+            atomic_fetch_add_explicit(&stats_counters[id], (uint64_t) (n), memory_order_relaxed);   \
+        }                                                                                           \
+    } while (0)
+
+// Adds the nanoseconds since start, a value of stats_clock, to timer id when stats are enabled.
+#define STAT_TIME(id, start) STAT_ADD(id, stats_clock() - (start))
+
+// Returns a monotonic timestamp in nanoseconds when stats are enabled, 0 otherwise.
+// IN: N/A
+// OUT: uint64_t (timestamp)
+static inline uint64_t stats_clock(void) {
+    if (__builtin_expect(!stats_enabled, 1)) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void stats_enable(void);
+
+bool stats_write(const char *path, const char *tool);
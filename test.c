@@ -0,0 +1,212 @@
+#include "numtheory.h"
+#include "randstate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "n:b:s:vh"
+
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+static bool verbose = false;
+
+// Prints the inputs and both results of a failed check.
+// IN: op (operation), a b (inputs), want (GMP result), got (our result)
+// OUT: N/A
+static void report(const char *op, mpz_t a, mpz_t b, mpz_t want, mpz_t got) {
+    failures++;
+    gmp_fprintf(stderr, "%s failed\n  a = %Zx\n  b = %Zx\n  want %Zx\n  got  %Zx\n", op, a, b, want, got);
+}
+
+// Checks gcd and gcd_ws against mpz_gcd on a and b, in both argument orders.
+// IN: ws (workspace), a b (numbers)
+// OUT: N/A
+static void check_gcd(numtheory_ws *ws, mpz_t a, mpz_t b) {
+    mpz_t want, got;
+    mpz_inits(want, got, NULL);
+    mpz_gcd(want, a, b);
+    gcd(got, a, b);
+    checks++;
+    if (mpz_cmp(want, got) != 0) {
+        report("gcd", a, b, want, got);
+    }
+    gcd_ws(ws, got, b, a);
+    checks++;
+    if (mpz_cmp(want, got) != 0) {
+        report("gcd_ws", b, a, want, got);
+    }
+    mpz_clears(want, got, NULL);
+}
+
+// Checks mod_inverse and mod_inverse_ws against mpz_invert for a modulo n (n >= 2). Where no inverse
+// exists, ours must give 0.
+// IN: ws (workspace), a (number), n (modulus)
+// OUT: N/A
+static void check_inverse(numtheory_ws *ws, mpz_t a, mpz_t n) {
+    mpz_t want, got;
+    mpz_inits(want, got, NULL);
+    if (mpz_invert(want, a, n) == 0) {
+        mpz_set_ui(want, 0);
+    }
+    mod_inverse(got, a, n);
+    checks++;
+    if (mpz_cmp(want, got) != 0) {
+        report("mod_inverse", a, n, want, got);
+    }
+    mod_inverse_ws(ws, got, a, n);
+    checks++;
+    if (mpz_cmp(want, got) != 0) {
+        report("mod_inverse_ws", a, n, want, got);
+    }
+    mpz_clears(want, got, NULL);
+}
+
+// Checks both routines on a and b, taking b as the modulus when it is at least 2.
+// IN: ws (workspace), a b (numbers)
+// OUT: N/A
+static void check_pair(numtheory_ws *ws, mpz_t a, mpz_t b) {
+    check_gcd(ws, a, b);
+    if (mpz_cmp_ui(b, 2) >= 0) {
+        check_inverse(ws, a, b);
+    }
+}
+
+// Edge cases and inputs with a known structure: zeros and ones, consecutive Fibonacci numbers (the
+// longest quotient sequences), numbers around a machine word and the Lehmer cut-off, and powers of two
+// with their neighbours (long runs of equal bits).
+// IN: ws (workspace), bits (largest width)
+// OUT: N/A
+static void structured(numtheory_ws *ws, uint64_t bits) {
+    mpz_t a, b, t;
+    mpz_inits(a, b, t, NULL);
+
+    const long small[] = { 0, 1, 2, 3, 4, 6, 7, 65537, -1, -6, -65537 };
+    size_t nsmall = sizeof(small) / sizeof(small[0]);
+    for (size_t i = 0; i < nsmall; i++) {
+        for (size_t j = 0; j < nsmall; j++) {
+            mpz_set_si(a, small[i]);
+            mpz_set_si(b, small[j]);
+            check_pair(ws, a, b);
+        }
+    }
+
+    mpz_set_ui(a, 1);
+    mpz_set_ui(b, 1);
+    while (mpz_sizeinbase(b, 2) <= bits) {
+        mpz_add(t, a, b);
+        mpz_swap(a, b);
+        mpz_swap(b, t);
+        check_pair(ws, b, a);
+        check_pair(ws, a, b);
+    }
+
+    const uint64_t widths[] = { 31, 32, 33, 61, 62, 63, 64, 65, 123, 124, 125, 127, 128, 129 };
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        for (long da = -1; da <= 1; da++) {
+            for (uint64_t k = 1; k <= bits; k = k < 256 ? k + 1 : 2 * k) {
+                mpz_ui_pow_ui(a, 2, widths[i]);
+                da < 0 ? mpz_sub_ui(a, a, 1) : mpz_add_ui(a, a, (unsigned long) da);
+                mpz_ui_pow_ui(b, 2, k);
+                mpz_sub_ui(t, b, 1);
+                mpz_add_ui(b, b, 1);
+                check_pair(ws, a, b);
+                check_pair(ws, b, a);
+                check_pair(ws, a, t);
+                check_pair(ws, t, a);
+            }
+        }
+    }
+    mpz_clears(a, b, t, NULL);
+}
+
+// Random inputs, each case run reps times at random widths up to bits: unrelated numbers, numbers with a
+// large common factor, a above the modulus, and a that has no inverse because it shares a factor with n.
+// Numbers with long runs of ones and zeros (mpz_rrandomb) are mixed in with uniform ones.
+// IN: ws (workspace), bits (largest width), reps (repetitions)
+// OUT: N/A
+static void randomized(numtheory_ws *ws, uint64_t bits, uint64_t reps) {
+    mpz_t a, b, g, n;
+    mpz_inits(a, b, g, n, NULL);
+    for (uint64_t r = 0; r < reps; r++) {
+        uint64_t wa = 1 + gmp_urandomm_ui(state, bits), wb = 1 + gmp_urandomm_ui(state, bits);
+        uint64_t wg = 1 + gmp_urandomm_ui(state, bits / 2 + 1);
+        bool runs = r % 2 == 1;
+        (runs ? mpz_rrandomb : mpz_urandomb)(a, state, wa);
+        (runs ? mpz_rrandomb : mpz_urandomb)(b, state, wb);
+        (runs ? mpz_rrandomb : mpz_urandomb)(g, state, wg);
+
+        // unrelated numbers
+        check_pair(ws, a, b);
+
+        // a common factor g
+        mpz_mul(a, a, g);
+        mpz_mul(b, b, g);
+        check_pair(ws, a, b);
+
+        // a > n, with and without an inverse: an odd n, and a times a multiple of n plus a unit
+        mpz_setbit(b, 0);
+        mpz_mul(n, b, g);
+        mpz_add(a, a, n);
+        check_inverse(ws, a, b);
+        mpz_mul_2exp(n, b, 3);
+        mpz_add(a, a, n);
+        check_inverse(ws, a, b);
+
+        // no inverse: a shares the factor g (g > 1) with n
+        mpz_add_ui(g, g, 2);
+        mpz_mul(n, b, g);
+        mpz_mul(a, a, g);
+        check_inverse(ws, a, n);
+        mpz_neg(a, a);
+        check_inverse(ws, a, n);
+    }
+    mpz_clears(a, b, g, n, NULL);
+}
+
+int main(int argc, char **argv) {
+    uint64_t reps = 2000;
+    uint64_t bits = 4096;
+    uint64_t seed = time(NULL);
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'n': reps = strtoull(optarg, NULL, 10); break;
+        case 'b': bits = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'v': verbose = true; break;
+        case 'h':
+            printf("SYNOPSIS\n");
+            printf("   Checks gcd and mod_inverse against mpz_gcd and mpz_invert.\n\n");
+            printf("USAGE\n");
+            printf("   ./test [-hv] [-n reps] [-b bits] [-s seed]\n\n");
+            printf("OPTIONS\n");
+            printf("   -h              Display program help and usage.\n");
+            printf("   -v              Display the seed and the number of checks.\n");
+            printf("   -n reps         Random inputs of each kind (default: 2000).\n");
+            printf("   -b bits         Largest input width (default: 4096).\n");
+            printf("   -s seed         Random seed (default: time(NULL)).\n");
+            return 0;
+        }
+    }
+    if (bits < 2) {
+        fprintf(stderr, "Invalid bits.\n");
+        return 1;
+    }
+
+    randstate_init(seed);
+    numtheory_ws ws;
+    numtheory_ws_init(&ws, bits);
+    structured(&ws, bits);
+    randomized(&ws, bits, reps);
+    numtheory_ws_clear(&ws);
+    randstate_clear();
+
+    if (verbose || failures > 0) {
+        printf("seed %lu: %lu checks, %lu failed\n", (unsigned long) seed, (unsigned long) checks,
+            (unsigned long) failures);
+    }
+    return failures > 0 ? 1 : 0;
+}
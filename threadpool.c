@@ -0,0 +1,156 @@
+#include "threadpool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+struct Pool {
+    uint32_t threads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start; // signalled when a new job is posted or the pool shuts down
+    pthread_cond_t done; // signalled when the last item of a job finishes
+    pool_fn fn;
+    void *arg;
+    uint64_t count; // number of items in the current job
+    uint64_t next; // next item to hand out
+    uint64_t finished; // items completed
+    bool shutdown;
+};
+
+typedef struct {
+    Pool *pool;
+    uint32_t id;
+} Worker;
+
+// Worker loop: waits for a job, then claims and runs items until the job is exhausted.
+// IN: arg (Worker)
+// OUT: NULL
+static void *pool_worker(void *arg) {
+    Worker *w = (Worker *) arg;
+    Pool *p = w->pool;
+    uint32_t id = w->id;
+    free(w);
+
+    pthread_mutex_lock(&p->lock);
+    while (true) {
+        while (!p->shutdown && p->next >= p->count) {
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        if (p->shutdown) {
+            break;
+        }
+        uint64_t index = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        p->fn(p->arg, index, id);
+
+        pthread_mutex_lock(&p->lock);
+        if (++p->finished == p->count) {
+            pthread_cond_signal(&p->done);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Creates a pool of worker threads. Returns NULL if no thread could be started.
+// IN: threads (number of worker threads)
+// OUT: Pool * (new pool)
+Pool *pool_create(uint32_t threads) {
+    Pool *p = (Pool *) calloc(1, sizeof(Pool));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->workers = (pthread_t *) calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    if (p->workers == NULL) {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (uint32_t i = 0; i < threads; i++) {
+        Worker *w = (Worker *) malloc(sizeof(Worker));
+        if (w == NULL) {
+            break;
+        }
+        w->pool = p;
+        w->id = i;
+        if (pthread_create(&p->workers[i], NULL, pool_worker, w) != 0) {
+            free(w);
+            break;
+        }
+        p->threads++;
+    }
+    if (p->threads == 0) {
+        pool_delete(&p);
+    }
+    return p;
+}
+
+// Stops the worker threads and frees the pool.
+// IN: p (pointer to the pool)
+// OUT: p (set to NULL)
+void pool_delete(Pool **p) {
+    if (*p == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&(*p)->lock);
+    (*p)->shutdown = true;
+    pthread_cond_broadcast(&(*p)->start);
+    pthread_mutex_unlock(&(*p)->lock);
+    for (uint32_t i = 0; i < (*p)->threads; i++) {
+        pthread_join((*p)->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&(*p)->lock);
+    pthread_cond_destroy(&(*p)->start);
+    pthread_cond_destroy(&(*p)->done);
+    free((*p)->workers);
+    free(*p);
+    *p = NULL;
+}
+
+// Returns the number of worker threads in the pool.
+// IN: p (pool)
+// OUT: uint32_t (number of workers)
+uint32_t pool_threads(Pool *p) {
+    return p->threads;
+}
+
+// Runs fn(arg, i, worker) for every i in [0, count) across the workers and waits for all of them to finish.
+// IN: p (pool), fn (work function), arg (argument passed to fn), count (number of items)
+// OUT: N/A
+void pool_run(Pool *p, pool_fn fn, void *arg, uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->arg = arg;
+    p->count = count;
+    p->next = 0;
+    p->finished = 0;
+    pthread_cond_broadcast(&p->start);
+    while (p->finished < p->count) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Parses a thread count given on the command line, which must be a whole number from 1 to POOL_MAX_THREADS.
+// IN: arg (argument text), threads (parsed count)
+// OUT: threads, bool (false if arg is not a valid thread count)
+bool pool_parse_threads(const char *arg, uint32_t *threads) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (arg[0] < '0' || arg[0] > '9' || *end != '\0' || errno != 0 || n < 1 || n > POOL_MAX_THREADS) {
+        return false;
+    }
+    *threads = (uint32_t) n;
+    return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most worker threads a tool accepts with -t.
+#define POOL_MAX_THREADS 1024
+
+// Work function run by the pool: index is the item being processed, worker the id of the thread running it.
+typedef void (*pool_fn)(void *arg, uint64_t index, uint32_t worker);
+
+typedef struct Pool Pool;
+
+Pool *pool_create(uint32_t threads);
+
+void pool_delete(Pool **p);
+
+uint32_t pool_threads(Pool *p);
+
+void pool_run(Pool *p, pool_fn fn, void *arg, uint64_t count);
+
+bool pool_parse_threads(const char *arg, uint32_t *threads);